@@ -24,6 +24,18 @@ struct fusefat32_config_t {
   bool  verbose;                /**< behave verbosely */
   bool  foreground;             /**< run program in foreground and
                                    do all logging to @em stderr  */
+  bool  fat_preload;            /**< load the whole FAT into memory at
+                                   mount time */
+  unsigned int fat_readahead;   /**< a number of FAT sectors to read ahead
+                                   while following cluster chains */
+  unsigned int cache_size;      /**< size of the cluster cache in MiB */
+  bool  dev_direct;             /**< open the device with @em O_DIRECT */
+  unsigned int partition;       /**< a number of partition to mount; zero
+                                   if the device is not partitioned */
+  unsigned long long offset;    /**< an offset of the file system on the
+                                   device in bytes */
+  unsigned int readahead;       /**< maximum size of data prefetched ahead
+                                   of sequential reader in KiB */
 };
 
 /// default fusefat32 config
@@ -31,7 +43,14 @@ struct fusefat32_config_t {
                                    .device      = NULL, \
                                    .log         = NULL, \
                                    .foreground  = false,\
-                                   .verbose     = false }
+                                   .verbose     = false,\
+                                   .fat_preload = false,\
+                                   .fat_readahead = 32,\
+                                   .cache_size  = 16,\
+                                   .dev_direct  = false,\
+                                   .partition   = 0,\
+                                   .offset      = 0,\
+                                   .readahead   = 1024 }
 
 /**
  * Generates FUSE input option descriptor
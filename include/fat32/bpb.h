@@ -18,6 +18,7 @@
 #include "utils/inlines.h"
 
 #include "fat32/errors.h"
+#include "fat32/dev.h"
 
 extern const uint32_t FAT32_MIN_CLUSTER_NUMBER;
 
@@ -43,7 +44,9 @@ struct fat32_bpb_t {
 
   /* fat32-specific fields  */
   uint32_t fat_size;               /**<  the size of one FAT */
-  uint16_t extended_flags;         /**<  extended flags. @todo macros */
+  uint16_t extended_flags;         /**<  extended flags. See
+                                      fat32_bpb_fat_mirroring() and
+                                      fat32_bpb_active_fat(). */
 
   uint16_t fs_version;             /**<  0x0000 for FAT32 */
   uint32_t root_cluster;           /**<  a number of the first cluster of root
@@ -89,12 +92,9 @@ bool
 fat32_bpb_check_validity(const struct fat32_bpb_t *bpb);
 
 /**
- * Reads BPB structure from file and validates it.
+ * Reads BPB structure from the beginning of the device and validates it.
  *
- * @param fd File descriptor used to read BPB. As this function
- *           is assumed to be used only once during driver initialization
- *           so we do not do any @em lseek and require for file offset to
- *           be exactly befory BPB on the disk.
+ * @param dev Device to read BPB from.
  * @param bpb A pointer to structure where read information must be stored.
  *
  * @retval FE_OK
@@ -103,7 +103,7 @@ fat32_bpb_check_validity(const struct fat32_bpb_t *bpb);
  * @retval FE_INVALID_FS data in the BPB block of device is inconsistent
  */
 enum fat32_error_t
-fat32_bpb_read(int fd, struct fat32_bpb_t *bpb);
+fat32_bpb_read(const struct fat32_dev_t *dev, struct fat32_bpb_t *bpb);
 
 /**
  * Calculates the number of clusters on the file system.
@@ -140,4 +140,34 @@ fat32_bpb_cluster_size(const struct fat32_bpb_t *bpb)
   return bpb->sectors_per_cluster * bpb->bytes_per_sector;
 }
 
+/**
+ * Determines whether FAT is mirrored at runtime into all FATs. Otherwise
+ * only the one returned by fat32_bpb_active_fat() is used.
+ *
+ * @param bpb BPB.
+ *
+ * @return @em true if mirroring is enabled.
+ */
+INLINE bool
+fat32_bpb_fat_mirroring(const struct fat32_bpb_t *bpb)
+{
+  /* bit 7 of extended flags disables mirroring */
+  return (bpb->extended_flags & 0x0080) == 0;
+}
+
+/**
+ * Returns a zero-based number of the FAT which must be used to read
+ * allocation information.
+ *
+ * @param bpb BPB.
+ *
+ * @return FAT number.
+ */
+INLINE uint8_t
+fat32_bpb_active_fat(const struct fat32_bpb_t *bpb)
+{
+  /* bits 0-3 of extended flags are valid only if mirroring is disabled */
+  return fat32_bpb_fat_mirroring(bpb) ? 0 : (bpb->extended_flags & 0x000f);
+}
+
 #endif /* _BPB_H_ */
@@ -0,0 +1,246 @@
+/**
+ * @file   cluster_cache.h
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:27:55 2026
+ *
+ * @brief  Cache of data clusters shared by all the file system objects.
+ *
+ * Cached clusters are managed using 2Q replacement policy. Clusters accessed
+ * for the first time are put into a FIFO queue (A1in) which takes only a
+ * quarter of the cache. Clusters evicted from it are remembered (without
+ * data) in a ghost queue (A1out). Only clusters accessed again while they
+ * are remembered get into the main LRU queue (Am). So a single pass over a
+ * big file can evict only clusters from A1in and does not affect the hot
+ * working set kept in Am.
+ *
+ * Buffers obtained from the cache are pinned until they are returned back.
+ * Modified buffers are written to the device on eviction and on
+ * synchronization. Only the sectors changed since the last write are
+ * written, so small updates of the same sector, like directory entries of
+ * several files growing at once, cost a single sector write.
+ *
+ * Clusters can be prefetched asynchronously by a separate thread. They are
+ * put into A1in like any other clusters accessed for the first time.
+ *
+ * If the device is a mapped image then nothing is cached: buffers point
+ * straight into the mapping and the page cache does the caching.
+ */
+#ifndef _CLUSTER_CACHE_H_
+#define _CLUSTER_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fat32/bpb.h"
+#include "fat32/dev.h"
+#include "fat32/errors.h"
+
+/// minimal number of clusters in the cache
+#define FAT32_CLUSTER_CACHE_MIN_SIZE 16
+
+/// opaque cluster cache
+struct fat32_cluster_cache_t;
+
+/**
+ * Creates a cluster cache.
+ *
+ * @param dev  Device clusters are read from.
+ * @param bpb  BPB of the file system.
+ * @param size A number of clusters to hold. Values less than
+ *             #FAT32_CLUSTER_CACHE_MIN_SIZE are rounded up.
+ *
+ * @return New cache or NULL on error. Error is specified using @em errno.
+ */
+struct fat32_cluster_cache_t *
+fat32_cluster_cache_create(const struct fat32_dev_t *dev,
+                           const struct fat32_bpb_t *bpb,
+                           uint32_t size);
+
+/**
+ * Frees the cache. Modified clusters are not written back so
+ * ::fat32_cluster_cache_sync must be called before if needed.
+ *
+ * @param cache Cache. May be NULL.
+ */
+void
+fat32_cluster_cache_free(struct fat32_cluster_cache_t *cache);
+
+/**
+ * Gets a cluster buffer pinning it in the cache. Buffer must be returned
+ * using ::fat32_cluster_cache_put.
+ *
+ * @param      cache   Cache.
+ * @param      cluster Cluster number.
+ * @param      read    Whether the cluster must be read from the device on
+ *                     cache miss. @em false can be passed when the caller is
+ *                     going to overwrite the whole buffer.
+ * @param[out] data    Cluster data.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+enum fat32_error_t
+fat32_cluster_cache_get(struct fat32_cluster_cache_t *cache,
+                        uint32_t cluster, bool read, uint8_t **data);
+
+/**
+ * Returns a buffer obtained by ::fat32_cluster_cache_get.
+ *
+ * @param cache Cache.
+ * @param data  Cluster data.
+ * @param dirty Whether buffer has been modified.
+ */
+void
+fat32_cluster_cache_put(struct fat32_cluster_cache_t *cache,
+                        uint8_t *data, bool dirty);
+
+/**
+ * Copies a part of the cluster to the buffer if the cluster is cached.
+ *
+ * @param cache   Cache.
+ * @param cluster Cluster number.
+ * @param buffer  Buffer to copy data to.
+ * @param offset  Offset in the cluster.
+ * @param size    A number of bytes to copy.
+ *
+ * @return Whether the cluster has been found.
+ */
+bool
+fat32_cluster_cache_read(struct fat32_cluster_cache_t *cache,
+                         uint32_t cluster, void *buffer,
+                         uint32_t offset, uint32_t size);
+
+/**
+ * Checks whether the cluster is cached or being prefetched. The device may
+ * hold stale data of such clusters so they must be read through the cache.
+ * Clusters of mapped image are never considered cached.
+ *
+ * @param cache   Cache.
+ * @param cluster Cluster number.
+ *
+ * @return Whether the cluster is cached.
+ */
+bool
+fat32_cluster_cache_contains(struct fat32_cluster_cache_t *cache,
+                             uint32_t cluster);
+
+/**
+ * Puts the data of the cluster read by the caller itself into the cache.
+ * Nothing is done if the cluster is already cached or there are no buffers
+ * which can be reused.
+ *
+ * @param cache   Cache.
+ * @param cluster Cluster number.
+ * @param data    The whole cluster data.
+ */
+void
+fat32_cluster_cache_fill(struct fat32_cluster_cache_t *cache,
+                         uint32_t cluster, const void *data);
+
+/**
+ * Modifies a part of the cluster containing given device offset. Changes
+ * reach the device when the cluster is written back. Unlike buffers returned
+ * by ::fat32_cluster_cache_put only the sectors covering the data are
+ * marked modified.
+ *
+ * @param cache  Cache.
+ * @param offset Global offset on the device. Must belong to data region.
+ * @param data   New data.
+ * @param size   Size of the data. Data must not cross cluster boundary.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+enum fat32_error_t
+fat32_cluster_cache_write(struct fat32_cluster_cache_t *cache,
+                          off_t offset, const void *data, size_t size);
+
+/**
+ * Starts the thread prefetching clusters. Threads don't survive @em fork so
+ * it must be called by the process serving requests. Until then prefetch
+ * requests are ignored. Nothing is done for mapped images or if the thread
+ * is running already.
+ *
+ * @param cache Cache.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_cluster_cache_prefetch_start(struct fat32_cluster_cache_t *cache);
+
+/**
+ * Stops the thread started by ::fat32_cluster_cache_prefetch_start. Runs
+ * which are queued already are read first. Called by
+ * ::fat32_cluster_cache_free too.
+ *
+ * @param cache Cache.
+ */
+void
+fat32_cluster_cache_prefetch_stop(struct fat32_cluster_cache_t *cache);
+
+/**
+ * Queues a run of adjacent clusters to be read into the cache
+ * asynchronously. Readers of clusters being read wait for them instead of
+ * reading them once more. The request is silently dropped if too many runs
+ * are queued already.
+ *
+ * @param cache Cache.
+ * @param first The first cluster of the run.
+ * @param count A number of clusters in the run.
+ */
+void
+fat32_cluster_cache_prefetch(struct fat32_cluster_cache_t *cache,
+                             uint32_t first, uint32_t count);
+
+/**
+ * Returns a maximum number of clusters which are worth prefetching ahead
+ * of a reader. Larger amounts of clusters would evict each other before
+ * they are read.
+ *
+ * @param cache Cache.
+ *
+ * @return A number of clusters.
+ */
+uint32_t
+fat32_cluster_cache_prefetch_limit(const struct fat32_cluster_cache_t *cache);
+
+/**
+ * Drops clusters from the cache without writing them back. Must be called
+ * when clusters are freed.
+ *
+ * @param cache Cache.
+ * @param first The first cluster to drop.
+ * @param count A number of adjacent clusters to drop.
+ */
+void
+fat32_cluster_cache_invalidate(struct fat32_cluster_cache_t *cache,
+                               uint32_t first, uint32_t count);
+
+/**
+ * Writes all modified clusters to the device. Adjacent clusters are written
+ * by a single request.
+ *
+ * @param cache Cache.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_cluster_cache_sync(struct fat32_cluster_cache_t *cache);
+
+/**
+ * Returns cache statistics.
+ *
+ * @param      cache  Cache.
+ * @param[out] hits   A number of cache hits.
+ * @param[out] misses A number of cache misses.
+ */
+void
+fat32_cluster_cache_stats(struct fat32_cluster_cache_t *cache,
+                          uint64_t *hits, uint64_t *misses);
+
+#endif /* _CLUSTER_CACHE_H_ */
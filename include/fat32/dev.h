@@ -0,0 +1,265 @@
+/**
+ * @file   dev.h
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:18:54 2026
+ *
+ * @brief  Device holding the file system.
+ *
+ * All the modules access the device only through the functions declared
+ * here. Positioned reads and writes are used so the device can be accessed
+ * from several threads simultaneously without any locking.
+ *
+ * The device can be opened with @em O_DIRECT so that its data is not cached
+ * by the kernel a second time. Requests which are not aligned on device
+ * blocks are then served through a pool of aligned bounce buffers. Memory
+ * allocated using ::fat32_dev_alloc is always suitably aligned so
+ * block-aligned requests to such memory go straight to the device.
+ *
+ * Regular image files are mapped into memory. Reads are then served straight
+ * from the mapping and cluster buffers point into it so directory and data
+ * accesses don't copy anything into intermediate buffers. Writes still use
+ * @em pwrite which is coherent with the shared mapping. Truncating the image
+ * while it's mounted leads to @em SIGBUS.
+ *
+ * A window of the device can be selected so that the file system on a
+ * partition of a whole disk image is accessed without a loop device. All
+ * offsets are relative to the start of the window then.
+ *
+ * When built with @em FAT32_IO_URING defined, batches of reads are submitted
+ * through io_uring so that the device sees all of them at once. Every thread
+ * gets its own ring. If io_uring is not supported by the kernel then plain
+ * @em pread is used.
+ */
+#ifndef _DEV_H_
+#define _DEV_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "fat32/errors.h"
+
+/// maximum number of requests in a batch passed to ::fat32_dev_read_batch
+#define FAT32_DEV_BATCH_SIZE 64
+
+/// memory alignment suitable for direct I/O on any device
+#define FAT32_DEV_ALIGNMENT 4096
+
+/// empty fat32_dev_pool_t definition (pool of bounce buffers)
+struct fat32_dev_pool_t;
+
+/// device holding the file system
+struct fat32_dev_t {
+  int fd;                       /**< file descriptor of the device */
+  bool     direct;              /**< device is opened with @em O_DIRECT */
+  uint32_t alignment;           /**< required alignment of offsets, sizes
+                                   and buffers for direct I/O */
+  struct fat32_dev_pool_t *pool; /**< bounce buffers for unaligned direct
+                                    I/O; NULL if @em direct is not set */
+  uint8_t *map;                 /**< the whole image mapped into memory;
+                                   NULL if the device is not mapped */
+  size_t   map_size;            /**< size of @em map */
+  off_t    base;                /**< device offset of the window holding the
+                                   file system */
+  off_t    size;                /**< size of the window; zero if it spans
+                                   to the end of the device */
+#ifdef FAT32_IO_URING
+  bool          uring;          /**< io_uring is supported by the kernel */
+  pthread_key_t rings;          /**< per-thread io_uring instances */
+#endif
+};
+
+/// a single read request of a batch
+struct fat32_dev_request_t {
+  void  *buffer;                /**< a buffer to store read data */
+  size_t size;                  /**< a number of bytes to read */
+  off_t  offset;                /**< an offset on the device */
+};
+
+/**
+ * Opens a device for reading and writing.
+ *
+ * @param dev    Device structure to initialize.
+ * @param path   A path to the device.
+ * @param direct Whether to bypass kernel caches using @em O_DIRECT.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_dev_open(struct fat32_dev_t *dev, const char *path, bool direct);
+
+/**
+ * Closes a device.
+ *
+ * @param dev Device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_dev_close(struct fat32_dev_t *dev);
+
+/**
+ * Allocates memory aligned on #FAT32_DEV_ALIGNMENT. Memory must be freed
+ * using @em free.
+ *
+ * @param size Size of memory to allocate.
+ *
+ * @return Allocated memory or NULL on error. Error is specified using
+ *         @em errno.
+ */
+void *
+fat32_dev_alloc(size_t size);
+
+/**
+ * Restricts all the further accesses to a window of the device.
+ *
+ * @param dev  Device.
+ * @param base An offset of the window on the device. Must be aligned on
+ *             device blocks if the device is opened for direct I/O.
+ * @param size Size of the window. Zero means up to the end of the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_dev_set_window(struct fat32_dev_t *dev, off_t base, off_t size);
+
+/**
+ * Returns a pointer to the mapped device data.
+ *
+ * @param dev    Device.
+ * @param offset An offset on the device.
+ * @param size   Size of data which is going to be accessed.
+ *
+ * @return NULL if the device is not mapped or the range is out of it.
+ */
+uint8_t *
+fat32_dev_map(const struct fat32_dev_t *dev, off_t offset, size_t size);
+
+/**
+ * Tells the kernel that mapped device data is going to be accessed soon so
+ * that it's read by large requests instead of faulting in page by page.
+ * Nothing is done if the device is not mapped.
+ *
+ * @param dev    Device.
+ * @param offset An offset on the device.
+ * @param size   Size of data.
+ */
+void
+fat32_dev_advise(const struct fat32_dev_t *dev, off_t offset, size_t size);
+
+/**
+ * Finds data in the device file so that the kernel can transfer it straight
+ * from the file (e.g. splice it) without copying through user space. That's
+ * not done for devices opened for direct I/O since their data is not in the
+ * page cache.
+ *
+ * @param      dev         Device.
+ * @param      offset      An offset on the device.
+ * @param      size        Size of data.
+ * @param[out] file_offset An offset of data in the file ::fat32_dev_t::fd.
+ *
+ * @return Whether data can be transferred from the file.
+ */
+bool
+fat32_dev_file_offset(const struct fat32_dev_t *dev, off_t offset,
+                      size_t size, off_t *file_offset);
+
+/**
+ * Reads data from the device.
+ *
+ * @param dev    Device.
+ * @param buffer A buffer to store read data.
+ * @param size   A number of bytes to read.
+ * @param offset An offset on the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+enum fat32_error_t
+fat32_dev_read(const struct fat32_dev_t *dev,
+               void *buffer, size_t size, off_t offset);
+
+/**
+ * Reads data from the device into several buffers.
+ *
+ * @param dev    Device.
+ * @param iov    Buffers to fill. The array is not modified.
+ * @param iovcnt A number of buffers. Must not exceed @em IOV_MAX.
+ * @param offset An offset on the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+enum fat32_error_t
+fat32_dev_readv(const struct fat32_dev_t *dev,
+                const struct iovec *iov, int iovcnt, off_t offset);
+
+/**
+ * Reads several pieces of data from the device. All the requests are
+ * submitted at once when io_uring is available so the device can serve them
+ * in parallel. Otherwise they are read one by one.
+ *
+ * @param dev      Device.
+ * @param requests Requests to serve.
+ * @param count    A number of requests. Must not exceed
+ *                 #FAT32_DEV_BATCH_SIZE.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+enum fat32_error_t
+fat32_dev_read_batch(const struct fat32_dev_t *dev,
+                     const struct fat32_dev_request_t *requests,
+                     unsigned int count);
+
+/**
+ * Writes data to the device.
+ *
+ * @param dev    Device.
+ * @param buffer Data to write.
+ * @param size   A number of bytes to write.
+ * @param offset An offset on the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_dev_write(const struct fat32_dev_t *dev,
+                const void *buffer, size_t size, off_t offset);
+
+/**
+ * Writes data from several buffers to the device.
+ *
+ * @param dev    Device.
+ * @param iov    Buffers to write. The array is not modified.
+ * @param iovcnt A number of buffers. Must not exceed @em IOV_MAX.
+ * @param offset An offset on the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_dev_writev(const struct fat32_dev_t *dev,
+                 const struct iovec *iov, int iovcnt, off_t offset);
+
+/**
+ * Flushes written data to the device.
+ *
+ * @param dev Device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_dev_sync(const struct fat32_dev_t *dev);
+
+#endif /* _DEV_H_ */
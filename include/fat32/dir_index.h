@@ -0,0 +1,208 @@
+/**
+ * @file   dir_index.h
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 11:02:45 2026
+ *
+ * @brief  Indexes of free directory entries.
+ *
+ * An index describes unused entries of a single directory as a sorted array
+ * of runs of adjacent deleted entries and the position of the end marker
+ * after which all the entries are unused. It allows to find a place for a
+ * set of entries of the given length without reading the directory. Indexes
+ * are built on the first insertion into the directory and are kept up to
+ * date by all the insertions and deletions. They are cached by the first
+ * cluster of the directory.
+ *
+ * An index also keeps a set of case folded short names of the objects in the
+ * directory so that a name can be checked for existence without reading the
+ * directory either.
+ */
+#ifndef _DIR_INDEX_H_
+#define _DIR_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "fat32/direntry.h"
+#include "fat32/errors.h"
+
+/// empty fat32_fs_t definition (see fat32/fs.h)
+struct fat32_fs_t;
+
+/// empty fat32_extent_map_t definition (see fat32/extent_map.h)
+struct fat32_extent_map_t;
+
+/// run of adjacent deleted directory entries
+struct fat32_dir_run_t {
+  uint32_t first;               /**< a number of the first entry of the run
+                                   in the directory */
+  uint32_t length;              /**< a number of entries in the run */
+};
+
+/// slot of a set of names
+struct fat32_dir_name_t {
+  uint8_t name[FAT32_DIRENTRY_NAME_SIZE]; /**< case folded short name; zero
+                                             first byte marks empty slot */
+};
+
+/// index of free entries of a single directory
+struct fat32_dir_index_t {
+  uint32_t                 first_cluster; /**< the first cluster of the
+                                             directory */
+  uint32_t                 entries;  /**< a number of entries clusters of the
+                                        directory can hold */
+  uint32_t                 end;      /**< a number of the entry holding the
+                                        end marker; this and all the
+                                        following entries are unused */
+  struct fat32_dir_run_t  *runs;     /**< runs of deleted entries before
+                                        @em end sorted by
+                                        #fat32_dir_run_t::first */
+  uint32_t                 count;    /**< a number of runs */
+  uint32_t                 capacity; /**< allocated size of @em runs */
+  uint32_t                 longest;  /**< no run is longer than this */
+  struct fat32_dir_name_t *names;    /**< open addressing set of names of the
+                                        objects in the directory */
+  uint32_t                 names_count;    /**< a number of names in the
+                                              set */
+  uint32_t                 names_capacity; /**< a number of slots in
+                                              @em names; a power of two */
+};
+
+/// Cache of directory indexes. Its structure is private to dir_index.c.
+struct fat32_dir_cache_t;
+
+/**
+ * Creates a cache of directory indexes.
+ *
+ * @param size A size of hash table used to look indexes up.
+ *
+ * @return New cache. NULL on error. Error is specified using @em errno.
+ */
+struct fat32_dir_cache_t *
+fat32_dir_cache_create(size_t size);
+
+/**
+ * Frees the cache and all the indexes in it.
+ *
+ * @param cache Cache to free.
+ */
+void
+fat32_dir_cache_free(struct fat32_dir_cache_t *cache);
+
+/**
+ * Takes the lock serializing all the modifications of directories. Indexes
+ * can be used only while it's held.
+ *
+ * @param cache Cache.
+ */
+void
+fat32_dir_cache_lock(struct fat32_dir_cache_t *cache);
+
+/**
+ * Releases the lock taken by ::fat32_dir_cache_lock.
+ *
+ * @param cache Cache.
+ */
+void
+fat32_dir_cache_unlock(struct fat32_dir_cache_t *cache);
+
+/**
+ * Returns an index of the directory building it if needed. Must be called
+ * with the lock held.
+ *
+ * @param      cache Cache.
+ * @param      fs    File system.
+ * @param      map   Extent map of the directory.
+ * @param[out] index The index is stored here on success.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO       memory allocation or IO error
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+enum fat32_error_t
+fat32_dir_cache_get(struct fat32_dir_cache_t *cache,
+                    const struct fat32_fs_t *fs,
+                    const struct fat32_extent_map_t *map,
+                    struct fat32_dir_index_t **index);
+
+/**
+ * Returns an index of the directory if it has been built. Must be called
+ * with the lock held.
+ *
+ * @param cache         Cache.
+ * @param first_cluster The first cluster of the directory.
+ *
+ * @return The index or NULL.
+ */
+struct fat32_dir_index_t *
+fat32_dir_cache_lookup(struct fat32_dir_cache_t *cache,
+                       uint32_t first_cluster);
+
+/**
+ * Drops an index of the directory. Must be called with the lock held when
+ * the directory is deleted or its index can't be updated.
+ *
+ * @param cache         Cache.
+ * @param first_cluster The first cluster of the directory.
+ */
+void
+fat32_dir_cache_invalidate(struct fat32_dir_cache_t *cache,
+                           uint32_t first_cluster);
+
+/**
+ * Checks whether the directory contains an object with the name. Names are
+ * matched regardless of case.
+ *
+ * @param index Directory index.
+ * @param name  Short name to look for.
+ *
+ * @return Result of the check.
+ */
+bool
+fat32_dir_index_contains(const struct fat32_dir_index_t *index,
+                         const uint8_t *name);
+
+/**
+ * Finds a run of unused entries and marks it used by an object with the
+ * name. Deleted entries are preferred to the ones past the end marker.
+ *
+ * @param      index Directory index.
+ * @param      count A number of adjacent entries needed.
+ * @param      name  Short name of the object.
+ * @param[out] entry A number of the first entry of the run.
+ *
+ * @retval FE_OK
+ * @retval FE_FS_IS_FULL the directory must be extended first
+ * @retval FE_ERRNO      memory allocation error; the index is left intact
+ */
+enum fat32_error_t
+fat32_dir_index_reserve(struct fat32_dir_index_t *index, uint32_t count,
+                        const uint8_t *name, uint32_t *entry);
+
+/**
+ * Accounts for clusters appended to the directory. They must be filled with
+ * zeros.
+ *
+ * @param index   Directory index.
+ * @param entries A number of entries the appended clusters hold.
+ */
+void
+fat32_dir_index_grow(struct fat32_dir_index_t *index, uint32_t entries);
+
+/**
+ * Marks a run of entries used by an object with the name deleted.
+ *
+ * @param index Directory index.
+ * @param entry A number of the first entry of the run.
+ * @param count A number of entries in the run.
+ * @param name  Short name of the object.
+ *
+ * @return @em false if memory can't be allocated. The index must be dropped
+ *         then.
+ */
+bool
+fat32_dir_index_release(struct fat32_dir_index_t *index, uint32_t entry,
+                        uint32_t count, const uint8_t *name);
+
+#endif /* _DIR_INDEX_H_ */
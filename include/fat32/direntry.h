@@ -18,6 +18,9 @@
 #include "fat32/errors.h"
 #include "utils/inlines.h"
 
+/// empty fat32_cluster_cache_t definition (see fat32/cluster_cache.h)
+struct fat32_cluster_cache_t;
+
 /// a size of the @em name field in #fat32_direntry_t
 #define FAT32_DIRENTRY_NAME_SIZE 11
 
@@ -157,22 +160,25 @@ char *
 fat32_direntry_short_name(const struct fat32_direntry_t *direntry);
 
 /**
- * Marks a direntry with the given offset as empty.
+ * Marks a direntry with the given offset as empty. The change is made in the
+ * cluster cache and reaches the device when the cache is synchronized.
  *
- * @param fd     File descriptor of device.
+ * @param cache  Cluster cache.
  * @param offset Global offset.
  *
  * @retval FE_OK
  * @retval FE_ERRNO IO errors while working with device.
  */
 enum fat32_error_t
-fat32_direntry_mark_free(int fd, off_t offset);
+fat32_direntry_mark_free(struct fat32_cluster_cache_t *cache, off_t offset);
 
 /**
- * Flushes current state of direntry to the file system.
+ * Flushes current state of direntry to the file system. The change is made
+ * in the cluster cache and reaches the device when the cache is
+ * synchronized.
  *
  * @param direntry Directory entry.
- * @param fd       File descriptor of device.
+ * @param cache    Cluster cache.
  * @param offset   Global offset of direntry.
  *
  * @retval FE_OK
@@ -182,14 +188,14 @@ fat32_direntry_mark_free(int fd, off_t offset);
  */
 enum fat32_error_t
 fat32_direntry_flush(const struct fat32_direntry_t *direntry,
-                     int fd, off_t offset);
+                     struct fat32_cluster_cache_t *cache, off_t offset);
 
 /**
  * Makes a direntry reference no clusters (i.e. make the file described by
  * direntry empty)
  *
  * @param direntry Directory entry.
- * @param fd       File descriptor of device.
+ * @param cache    Cluster cache.
  * @param offset   Global offset of direntry
  *
  * @retval FE_OK
@@ -199,7 +205,37 @@ fat32_direntry_flush(const struct fat32_direntry_t *direntry,
  */
 enum fat32_error_t
 fat32_direntry_make_empty(struct fat32_direntry_t *direntry,
-                          int fd, off_t offset);
+                          struct fat32_cluster_cache_t *cache,
+                          off_t offset);
+
+/**
+ * Fills a directory entry of a new object. The name is stored as a short
+ * name converted to upper case. Creation, modification and access times are
+ * set to the current time.
+ *
+ * @param[out] direntry Directory entry.
+ * @param      name     Name of the object.
+ * @param      attr     Attributes of the object.
+ * @param      cluster  The first cluster of the object. Zero for empty file.
+ *
+ * @return @em false if the name can't be stored as a short name. @em errno
+ *         is set to @em ENAMETOOLONG or @em EINVAL then.
+ */
+bool
+fat32_direntry_init(struct fat32_direntry_t *direntry, const char *name,
+                    fat32_direntry_attr_t attr, uint32_t cluster);
+
+/**
+ * Fills dot or dotdot entry of a new directory.
+ *
+ * @param[out] direntry Directory entry.
+ * @param      dotdot   Whether dotdot entry is filled.
+ * @param      cluster  The first cluster of the directory the entry refers
+ *                      to. Zero for the root directory.
+ */
+void
+fat32_direntry_init_dot(struct fat32_direntry_t *direntry, bool dotdot,
+                        uint32_t cluster);
 
 /**
  * Determines whether directory entry is dot or dotdot entry.
@@ -27,6 +27,13 @@ struct fat32_diriter_t {
                                             nothing to iterate. */
   uint32_t                 offset;       /**< Offset of the next item in cluster
                                             to iterate. */
+  uint32_t                 first_cluster; /**< The first cluster of iterated
+                                             directory. */
+  uint32_t                 entry;        /**< A number of the next item in
+                                            the directory. */
+  uint8_t                 *data;         /**< Contents of the current cluster
+                                            pinned in the cluster cache. NULL
+                                            if it hasn't been read yet. */
   bool                     list_dots;    /**< Indicates whether dot and dotdot
                                           * entries must be listed by iterator.
                                           * */
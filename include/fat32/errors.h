@@ -18,7 +18,8 @@
 enum fat32_error_t {
   FE_OK,                        /**< no errors occured */
   FE_ERRNO,                     /**< indicates that errno specifies error */
-  FE_NONBLOCK_DEV,              /**< invalid device is not a block device */
+  FE_NONBLOCK_DEV,              /**< invalid device is neither a block device
+                                   nor a regular file */
   FE_INVALID_DEV,               /**< invalid device (too small and other
                                    errors of that kind)
                                 */
@@ -29,10 +30,12 @@ enum fat32_error_t {
   FE_FS_IS_FULL,                /**< no free space on the file system */
   FE_FS_INCONSISTENT,            /**< returned when because of IO errors file
                                  * system is left in inconsistent state. */
-  FE_FS_PARTIALLY_CONSISTENT    /**< file system is in the state in which
+  FE_FS_PARTIALLY_CONSISTENT,   /**< file system is in the state in which
                                  * it can be used without visible problems
                                  * but fsck needed to make it strictly
                                  * consistent */
+  FE_NO_PARTITION               /**< requested partition is not found in
+                                   the partition table */
 };
 
 #endif /* _FAT32_ERRORS_H_ */
@@ -0,0 +1,137 @@
+/**
+ * @file   extent_map.h
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:02:05 2026
+ *
+ * @brief  Run-length maps of cluster chains.
+ *
+ * An extent map describes a cluster chain as a sorted array of physically
+ * contiguous runs of clusters. It allows to find a cluster with the given
+ * number in the chain by binary search instead of walking the chain through
+ * FAT. Maps are cached by the first cluster of the chain and shared by all
+ * the users of the same chain.
+ */
+#ifndef _EXTENT_MAP_H_
+#define _EXTENT_MAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "fat32/errors.h"
+#include "fat32/fat.h"
+
+/// physically contiguous run of clusters in a cluster chain
+struct fat32_extent_t {
+  uint32_t logical;             /**< a number of the first cluster of the
+                                   extent in the cluster chain */
+  uint32_t physical;            /**< the first cluster of the extent */
+  uint32_t length;              /**< a number of clusters in the extent */
+};
+
+/// extent map of a single cluster chain
+struct fat32_extent_map_t {
+  uint32_t               first_cluster; /**< the first cluster of the chain */
+  struct fat32_extent_t *extents;       /**< extents sorted by
+                                           #fat32_extent_t::logical */
+  uint32_t               count;         /**< a number of extents */
+  uint32_t               clusters;      /**< a number of clusters in the
+                                           chain */
+  unsigned int           refs;          /**< number of references to the
+                                           map */
+  bool                   stale;         /**< Set when the chain has been
+                                           changed. Stale map is not returned
+                                           by the cache anymore and is freed
+                                           when the last reference to it is
+                                           dropped. */
+};
+
+/// Cache of extent maps. Its structure is private to extent_map.c.
+struct fat32_extent_cache_t;
+
+/**
+ * Creates an extent maps cache.
+ *
+ * @param size A size of hash table used to index maps.
+ *
+ * @return New cache. NULL on error. Error is specified using @em errno.
+ */
+struct fat32_extent_cache_t *
+fat32_extent_cache_create(size_t size);
+
+/**
+ * Frees the cache and all the maps in it.
+ *
+ * @param cache Cache to free.
+ */
+void
+fat32_extent_cache_free(struct fat32_extent_cache_t *cache);
+
+/**
+ * Returns an extent map for the cluster chain building it if needed.
+ * A long-living reference to the map is kept in @em slot: if @em slot
+ * already references an up to date map then it's used, otherwise the
+ * reference in @em slot is replaced by a reference to an actual map.
+ * Additionally a reference for the caller is acquired which must be dropped
+ * by ::fat32_extent_cache_release call.
+ *
+ * @param      cache         Extent maps cache.
+ * @param      fat           FAT object.
+ * @param      first_cluster The first cluster of the chain.
+ * @param      slot          Long-living reference to the map (for instance,
+ *                           a field of file system object). Must point to
+ *                           NULL initially.
+ * @param[out] map           Extent map is stored here on success.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO       @li memory allocation error
+ *                        @li IO errors while reading FAT
+ * @retval FE_INVALID_DEV Device ended prematurely.
+ * @retval FE_INVALID_FS  Bad or free cluster encountered in the chain or
+ *                        the chain is cyclic.
+ */
+enum fat32_error_t
+fat32_extent_cache_get(struct fat32_extent_cache_t *cache,
+                       const struct fat32_fat_t *fat,
+                       uint32_t first_cluster,
+                       struct fat32_extent_map_t **slot,
+                       struct fat32_extent_map_t **map);
+
+/**
+ * Drops a reference to the map.
+ *
+ * @param cache Extent maps cache.
+ * @param map   Extent map. Can be NULL.
+ */
+void
+fat32_extent_cache_release(struct fat32_extent_cache_t *cache,
+                           struct fat32_extent_map_t *map);
+
+/**
+ * Marks a map for the chain starting with the given cluster as stale. Must be
+ * called every time the chain is changed.
+ *
+ * @param cache         Extent maps cache.
+ * @param first_cluster The first cluster of the chain.
+ */
+void
+fat32_extent_cache_invalidate(struct fat32_extent_cache_t *cache,
+                              uint32_t first_cluster);
+
+/**
+ * Finds a physical cluster by its number in the chain.
+ *
+ * @param      map      Extent map.
+ * @param      logical  A number of cluster in the chain.
+ * @param[out] physical Physical cluster number.
+ * @param[out] run      A number of physically contiguous clusters in the
+ *                      chain starting from the found one. Can be NULL.
+ *
+ * @return @em false if the chain is shorter than @em logical + 1 clusters.
+ *         @em true otherwise.
+ */
+bool
+fat32_extent_map_lookup(const struct fat32_extent_map_t *map,
+                        uint32_t logical, uint32_t *physical, uint32_t *run);
+
+#endif /* _EXTENT_MAP_H_ */
@@ -17,12 +17,26 @@
 /// empty fat32_fs_t definition to work around recursive #include
 struct fat32_fs_t;
 
+/// empty fat32_fs_params_t definition to work around recursive #include
+struct fat32_fs_params_t;
+
+/// Cache of FAT sectors. Its structure is private to fat.c.
+struct fat32_fat_cache_t;
+
+/// a run of physically contiguous clusters
+struct fat32_fat_run_t {
+  uint32_t start;                       /**< the first cluster of the run */
+  uint32_t length;                      /**< a number of clusters in the run */
+};
+
 /// structure encapsulating data needed to work with file allocation tables
 struct fat32_fat_t {
-  int fd;                                /**< a duplicate of file descriptor
-                                            used in #fat32_fs_t */
+  const struct fat32_dev_t *dev;         /**< device storing the file
+                                            system */
   uint32_t bytes_per_sector_log;         /**< the number of the highest bit set
                                             in bytes_per_sector */
+  uint32_t first_sector;                 /**< the first sector of the active
+                                            FAT which is used for reading */
   uint32_t free_cluster_hint;            /**< This field has the same meaning
                                           * as
                                           #fat32_fs_info_t::free_cluster_hint
@@ -33,9 +47,42 @@ struct fat32_fat_t {
                                             initialized by
                                             fat32_fs_open() call
                                          */
-  const struct fat32_fs_info_t *fs_info; /**< a pointer to FSInfo structure
+  struct fat32_fs_info_t *fs_info;       /**< A pointer to FSInfo structure
                                             allocated and initialized by
-                                            ::fat32_fs_open call */
+                                            ::fat32_fs_open call.
+                                            #fat32_fs_info_t::last_free_count
+                                            is kept exact while FAT is in
+                                            use. */
+  uint64_t *free_map;                    /**< Bitmap of free clusters indexed
+                                            by cluster number. Set bit means
+                                            that cluster is free. Kept in sync
+                                            with FAT entries. NULL if FSInfo
+                                            has been trusted at mount time
+                                            and nothing has been allocated
+                                            yet. */
+  uint32_t  clusters_end;                /**< a number following the last
+                                            valid cluster number */
+  uint32_t  reserved;                    /**< A number of free clusters
+                                            promised to data which open
+                                            files keep in memory. They are
+                                            not counted as free and can be
+                                            allocated only for that data.
+                                            Protected by the cache lock. */
+  bool      inconsistent;                /**< Set when clusters may have been
+                                            lost because of IO errors. The
+                                            volume is not marked clean on
+                                            unmount then so that FAT is
+                                            scanned on the next mount. */
+  uint32_t  readahead;                   /**< a number of sectors read ahead
+                                            after a cache miss once
+                                            readahead is started. Zero if
+                                            it's disabled. */
+  struct fat32_fat_cache_t *cache;       /**< Whole FAT sectors kept in memory
+                                            with LRU eviction. All FAT entries
+                                            are read and modified through it.
+                                            Modified sectors are written back
+                                            to all mirrored FATs on eviction
+                                            or by ::fat32_fat_sync call. */
 };
 
 /// type for each separate entry in FAT
@@ -43,34 +90,87 @@ typedef uint32_t fat32_fat_entry_t;
 
 /**
  * Initializes a structure needed to work with file allocation tables.
+ * If the volume has been unmounted cleanly free clusters count and hint
+ * are taken from FSInfo and FAT is not scanned until the first allocation.
+ * The volume is marked as not clean until ::fat32_fat_finalize call.
  * As BPB and FSInfo related functions does not allocate or deallocate memory
  * for the structure itself as all this functions are intended to be used
  * only internally.
  *
- * @param fat a structure to initialize
- * @param fs Partially initialized #fat32_fs_t structure.
- *           By the time of the call #fat32_fs_t::bpb,
- *           fat32_fs_t::fs_info and fat32_fs_t::fd fields must
- *           have been set correctly.
+ * @param fat    a structure to initialize
+ * @param fs     Partially initialized #fat32_fs_t structure.
+ *               By the time of the call #fat32_fs_t::bpb,
+ *               fat32_fs_t::fs_info and fat32_fs_t::dev fields must
+ *               have been set correctly.
+ * @param params File system parameters. Used to determine a size of FAT
+ *               cache.
  *
  * @retval FE_OK
- * @retval FE_ERRNO file descriptor of device storing fs can't be dupped
+ * @retval FE_ERRNO @li memory allocation error
+ *                  @li unable to initialize synchronization objects
+ *                  @li FAT can't be read to build free clusters bitmap
+ *                  @li clean shutdown bit can't be cleared
+ * @retval FE_INVALID_DEV underlying device file ended prematurely
  */
 enum fat32_error_t
 fat32_fat_init(struct fat32_fat_t *fat,
-               const struct fat32_fs_t *fs);
+               const struct fat32_fs_t *fs,
+               const struct fat32_fs_params_t *params);
 
 /**
- * Closes all acquired resources for a FAT structure.
+ * Closes all acquired resources for a FAT structure. All modified FAT sectors
+ * are written to the device before that. Then FSInfo is updated and the
+ * volume is marked as cleanly unmounted in FAT[1].
  *
  * @param fat a structure to finalize
  *
  * @retval FE_OK
- * @retval FE_ERRNO @em close system call returned an error
+ * @retval FE_ERRNO @li @em close system call returned an error
+ *                  @li modified FAT sectors, FSInfo or the clean shutdown
+ *                      bit can't be written to the device
  */
 enum fat32_error_t
 fat32_fat_finalize(struct fat32_fat_t *fat);
 
+/**
+ * Starts a thread reading FAT sectors into the cache ahead of chain walks.
+ * On a cache miss a window of sectors following the missed one is read
+ * asynchronously. When the first sector of the window is accessed the next
+ * window is requested. Threads don't survive @em fork so it must be called
+ * by the process serving requests. Nothing is done if readahead is disabled
+ * or already running.
+ *
+ * @param fat FAT object.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+enum fat32_error_t
+fat32_fat_readahead_start(struct fat32_fat_t *fat);
+
+/**
+ * Stops readahead thread if it's running. Called by ::fat32_fat_finalize
+ * too.
+ *
+ * @param fat FAT object.
+ */
+void
+fat32_fat_readahead_stop(struct fat32_fat_t *fat);
+
+/**
+ * Writes all modified FAT sectors from the cache to the device. If FAT
+ * mirroring is enabled sectors are written to every FAT. Writes go in the
+ * order of offsets and adjacent sectors are written by a single vectored
+ * write.
+ *
+ * @param fat FAT object.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO @li data can't be written to underlying device
+ */
+enum fat32_error_t
+fat32_fat_sync(struct fat32_fat_t *fat);
+
 /**
  * Returns a FAT entry for a given cluster number
  *
@@ -79,14 +179,34 @@ fat32_fat_finalize(struct fat32_fat_t *fat);
  * @param[out] entry a place to store the resulting entry
  *
  * @retval FE_OK
- * @retval FE_ERRNO @li @em lseek failed
- *                  @li data can't be read from underlying device
+ * @retval FE_ERRNO @li data can't be read from underlying device
  * @retval FE_INVALID_DEV - underlying device file ended prematurely
+ * @retval FE_INVALID_FS  - cluster number lies outside of preloaded FAT
  */
 enum fat32_error_t
 fat32_fat_get_entry(const struct fat32_fat_t *fat,
                     uint32_t cluster, fat32_fat_entry_t *entry);
 
+/**
+ * Follows a cluster chain while it goes through physically adjacent
+ * clusters. The run ends at the last cluster of the file system. FAT
+ * entries are compared with expected values many at a time using SIMD
+ * instructions if they are available.
+ *
+ * @param      fat     FAT
+ * @param      cluster The first cluster of the run.
+ * @param[out] length  A number of clusters in the run. At least one.
+ * @param[out] entry   FAT entry of the last cluster of the run.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO @li data can't be read from underlying device
+ * @retval FE_INVALID_DEV - underlying device file ended prematurely
+ * @retval FE_INVALID_FS  - cluster number lies outside of the file system
+ */
+enum fat32_error_t
+fat32_fat_get_run(const struct fat32_fat_t *fat, uint32_t cluster,
+                  uint32_t *length, fat32_fat_entry_t *entry);
+
 /**
  * Returns a nth FAT entry for a cluster. If n == 1 then this function
  * is equal to ::fat32_fat_get_entry. If n == 0 then such entry is returned
@@ -99,8 +219,7 @@ fat32_fat_get_entry(const struct fat32_fat_t *fat,
  * @param[out] entry   A place to store resulting entry.
  *
  * @retval FE_OK
- * @retval FE_ERRNO @li @em lseek failed
- *                  @li data can't be read from underlying device
+ * @retval FE_ERRNO @li data can't be read from underlying device
  * @retval FE_INVALID_DEV - underlying device file ended prematurely
  * @retval FE_INVALID_FS  - bad or free cluster encountered in cluster chain.
  * @retval FE_CLUSTER_CHAIN_ENDED - a number of clusters in chain is less
@@ -156,20 +275,111 @@ bool
 fat32_fat_entry_is_free(fat32_fat_entry_t entry);
 
 /**
- * Tries to find a free cluster.
+ * Tries to find a free cluster. The search is done in the bitmap of free
+ * clusters starting from #fat32_fat_t::free_cluster_hint and wrapping
+ * around to the beginning of FAT. Device is accessed only if the bitmap
+ * has not been built yet.
  *
  * @param      fat     FAT object.
  * @param[out] cluster A number of free cluster is stored here on success.
  *
- * @retval FE_OK         Free cluster found successfully
- * @retval FE_ERRNO @li @em lseek failed
- *                  @li data can't be read from underlying device
- * @retval FE_INVALID_DEV - underlying device file ended prematurely
- * @retval FE_FS_IS_FULL There is no free space on the file system.
+ * @retval FE_OK          Free cluster found successfully
+ * @retval FE_FS_IS_FULL  There is no free space on the file system.
+ * @retval FE_ERRNO       Free clusters bitmap can't be built.
+ * @retval FE_INVALID_DEV Underlying device file ended prematurely.
  */
 enum fat32_error_t
 fat32_fat_find_free_cluster(struct fat32_fat_t *fat, uint32_t *cluster);
 
+/**
+ * Finds a run of free clusters. If it's possible the run starts right after
+ * the @em near cluster. Otherwise the first run of at least @em wanted
+ * clusters is looked for starting from the free cluster hint. If there is
+ * no such run the longest free run is returned. Clusters are not marked
+ * used.
+ *
+ * @param      fat    FAT object.
+ * @param      wanted Desired number of clusters.
+ * @param      near   A cluster after which the run is preferred to start or
+ *                    zero if there is no preference.
+ * @param[out] run    Found run. Its length never exceeds @em wanted.
+ *
+ * @retval FE_OK
+ * @retval FE_FS_IS_FULL
+ * @retval FE_ERRNO       free clusters bitmap can't be built
+ * @retval FE_INVALID_DEV
+ */
+enum fat32_error_t
+fat32_fat_allocate_run(struct fat32_fat_t *fat, uint32_t wanted,
+                       uint32_t near, struct fat32_fat_run_t *run);
+
+/**
+ * Allocates a chain of clusters using as few physically contiguous runs as
+ * possible. All the entries of the chain are written in one pass under a
+ * single lock acquisition.
+ *
+ * @param      fat      FAT object.
+ * @param      count    A number of clusters to allocate.
+ * @param      reserved A number of clusters among @em count reserved by
+ *                      ::fat32_fat_reserve. The reservation is taken back
+ *                      once they are allocated.
+ * @param      previous The last cluster of the chain to extend or zero if a
+ *                      new chain must be created.
+ * @param[out] first    The first allocated cluster.
+ * @param[out] extents  A number of contiguous extents the allocated clusters
+ *                      form. A run physically continuing @em previous
+ *                      is not counted as it extends the existing extent.
+ *
+ * @retval FE_OK
+ * @retval FE_FS_IS_FULL         not enough free clusters; nothing is
+ *                               allocated
+ * @retval FE_ERRNO              free clusters bitmap can't be built
+ * @retval FE_INVALID_DEV
+ * @retval FE_FS_INCONSISTENT    an error occurred while chain was being
+ *                               written; the clusters linked so far are
+ *                               freed
+ */
+enum fat32_error_t
+fat32_fat_allocate_chain(struct fat32_fat_t *fat, uint32_t count,
+                         uint32_t reserved, uint32_t previous,
+                         uint32_t *first, uint32_t *extents);
+
+/**
+ * Returns a number of free clusters on the file system which are not
+ * reserved.
+ *
+ * @param fat FAT object.
+ *
+ * @return A number of free clusters.
+ */
+uint32_t
+fat32_fat_free_clusters(const struct fat32_fat_t *fat);
+
+/**
+ * Reserves free clusters for data which is kept in memory and gets clusters
+ * allocated later. Nothing else can allocate the reserved clusters so the
+ * allocation of the data never runs out of space.
+ *
+ * @param fat   FAT object.
+ * @param count A number of clusters to reserve.
+ *
+ * @retval FE_OK
+ * @retval FE_FS_IS_FULL there are not enough free clusters which are not
+ *                       reserved
+ */
+enum fat32_error_t
+fat32_fat_reserve(struct fat32_fat_t *fat, uint32_t count);
+
+/**
+ * Gives back clusters reserved by ::fat32_fat_reserve for data which is
+ * dropped without being allocated.
+ *
+ * @param fat   FAT object.
+ * @param count A number of clusters to give back.
+ */
+void
+fat32_fat_unreserve(struct fat32_fat_t *fat, uint32_t count);
+
 /**
  * Marks all clusters in the cluster chain as free.
  *
@@ -177,8 +387,7 @@ fat32_fat_find_free_cluster(struct fat32_fat_t *fat, uint32_t *cluster);
  * @param cluster The first cluster in a chain.
  *
  * @retval FE_OK
- * @retval FE_ERRNO @li @em lseek failed
- *                  @li data can't be read from underlying device
+ * @retval FE_ERRNO @li data can't be read from underlying device
  * @retval FE_INVALID_DEV underlying device file ended prematurely
  * @retval FE_FS_INCONSISTENT Because of IO errors during writing file system
  *                              is left in inconsistent state. @em errno is
@@ -5,6 +5,17 @@
  *
  * @brief  Information about open files.
  *
+ * The state shared by all open instances of a file lives here. Data written
+ * past the clusters allocated to the file is kept in memory until the file
+ * is flushed. Clusters are allocated for all of it at once then so that the
+ * allocator knows the final size and can place it in a single extent.
+ *
+ * Clusters added to the file without data (by growing @em truncate or
+ * @em fallocate) are not zeroed right away. Everything past the
+ * #fat32_file_info_t::initialized watermark is read as zeros instead and is
+ * zeroed on the device only when the file is flushed or written past the
+ * watermark.
+ *
  * @todo: move to fusefat32 directory
  *
  *
@@ -13,6 +24,19 @@
 #define _FILE_INFO_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/// empty fat32_direntry_t definition
+struct fat32_direntry_t;
+
+/// empty fat32_fat_t definition
+struct fat32_fat_t;
+
+/// Maximum size of data kept in memory for a file before clusters are
+/// allocated for it.
+#define FAT32_FILE_INFO_DELAYED_MAX (16 << 20)
 
 /// Structure storing information about open files.
 struct fat32_file_info_t {
@@ -21,6 +45,33 @@ struct fat32_file_info_t {
                                  *   while it's open. So that the last
                                  *   @em release call can perform actual
                                  *   deletion. */
+  pthread_rwlock_t lock;        /**< Taken for reading by readers and for
+                                 *   writing by writers and flushes of the
+                                 *   file. Protects all the fields below
+                                 *   and the directory entry. */
+  struct fat32_direntry_t *direntry; /**< Directory entry shared by all
+                                      *   open instances. NULL until the
+                                      *   first instance is attached. */
+  bool         direntry_dirty;  /**< directory entry differs from the one
+                                 *   on the device */
+  uint32_t     initialized;     /**< Size of the data which is valid on the
+                                 *   device or in memory. The rest of the
+                                 *   file is read as zeros. */
+  uint32_t     delayed_first;   /**< A number of the first cluster in the
+                                 *   chain which is kept in memory. It's
+                                 *   equal to the number of allocated
+                                 *   clusters. */
+  uint32_t     delayed_count;   /**< A number of elements in @em delayed.
+                                 *   A free cluster is reserved in FAT for
+                                 *   each of them. */
+  uint32_t     delayed_capacity; /**< allocated size of @em delayed */
+  uint32_t     delayed_buffers; /**< A number of elements of @em delayed
+                                 *   which hold data. Only they count
+                                 *   towards the memory limit. */
+  uint8_t    **delayed;         /**< Data of clusters which are not
+                                 *   allocated yet. NULL stands for a
+                                 *   cluster which has never been written
+                                 *   and is read as zeros. */
 };
 
 /**
@@ -35,4 +86,73 @@ struct fat32_file_info_t {
 void *
 fat32_file_info_cloner(const void *file_info);
 
+/**
+ * Frees the structure together with all the data it holds.
+ *
+ * @param file_info Structure to free.
+ */
+void
+fat32_file_info_free(void *file_info);
+
+/**
+ * Returns a buffer holding data of a cluster which is not allocated yet.
+ * The buffer is created filled with zeros if it does not exist. Free
+ * clusters are reserved in FAT for the cluster and the holes before it so
+ * that they can be allocated on flush. Must be called with the lock taken
+ * for writing.
+ *
+ * @param file_info    Information about the file.
+ * @param fat          FAT to reserve clusters in.
+ * @param cluster_size Size of the cluster.
+ * @param logical      A number of the cluster in the chain. Must not be less
+ *                     than #fat32_file_info_t::delayed_first.
+ *
+ * @return The buffer. NULL on error. Error is specified using @em errno
+ *         which is set to @em ENOSPC if there are not enough free clusters.
+ */
+uint8_t *
+fat32_file_info_delayed_get(struct fat32_file_info_t *file_info,
+                            struct fat32_fat_t *fat,
+                            uint32_t cluster_size, uint32_t logical);
+
+/**
+ * Copies a part of a cluster which is not allocated yet. Parts which have
+ * never been written are read as zeros. Must be called with the lock taken.
+ *
+ * @param file_info Information about the file.
+ * @param logical   A number of the cluster in the chain.
+ * @param buffer    A buffer to copy data to.
+ * @param offset    An offset in the cluster.
+ * @param size      A number of bytes to copy.
+ *
+ * @return @em false if the cluster is not kept in memory.
+ */
+bool
+fat32_file_info_delayed_read(const struct fat32_file_info_t *file_info,
+                             uint32_t logical, void *buffer,
+                             uint32_t offset, uint32_t size);
+
+/**
+ * Forgets the data of clusters which are not allocated yet past the given
+ * number of clusters and gives back the clusters reserved for it. Must be
+ * called with the lock taken for writing.
+ *
+ * @param file_info Information about the file.
+ * @param fat       FAT the clusters are reserved in.
+ * @param clusters  A number of clusters the file is cut to.
+ */
+void
+fat32_file_info_delayed_truncate(struct fat32_file_info_t *file_info,
+                                 struct fat32_fat_t *fat, uint32_t clusters);
+
+/**
+ * Forgets all the data kept in memory once it has been written to newly
+ * allocated clusters. The reservation of the clusters is taken back by the
+ * allocation itself. Must be called with the lock taken for writing.
+ *
+ * @param file_info Information about the file.
+ */
+void
+fat32_file_info_delayed_clear(struct fat32_file_info_t *file_info);
+
 #endif /* _FILE_INFO_H_ */
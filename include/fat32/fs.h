@@ -20,17 +20,24 @@
 #include "hash_table.h"
 
 #include "fat32/bpb.h"
+#include "fat32/dev.h"
 #include "fat32/fs_info.h"
 #include "fat32/fat.h"
+#include "fat32/cluster_cache.h"
 #include "fat32/errors.h"
 
 /// empty fat32_fs_object_t definition to work around recursive #include
 struct fat32_fs_object_t;
 
+/// empty fat32_extent_cache_t definition (see fat32/extent_map.h)
+struct fat32_extent_cache_t;
+
+/// empty fat32_dir_cache_t definition (see fat32/dir_index.h)
+struct fat32_dir_cache_t;
+
 /// filesystem descriptor
 struct fat32_fs_t {
-  int              fd;             /**< file descriptor of device where
-                                      filesystem is stored */
+  struct fat32_dev_t dev;          /**< device where filesystem is stored */
 
   pthread_mutex_t *write_lock;     /**< Mutex to lock on writing.
                                         Assume the following invariant:
@@ -52,15 +59,43 @@ struct fat32_fs_t {
                                        file handles and corresponding to them
                                        fs objects */
   struct fat32_fh_allocator_t *fh_allocator; /**< allocator for file handles */
+  struct fat32_extent_cache_t *extent_cache; /**< extent maps of cluster
+                                                chains of open files */
+  struct fat32_cluster_cache_t *cluster_cache; /**< cached data clusters */
+  struct fat32_dir_cache_t *dir_cache; /**< indexes of free entries of
+                                          modified directories */
 
   uint32_t cluster_size;            /**< cached size of the cluster on file
                                      * system */
+  uint32_t readahead_max;           /**< maximum number of clusters
+                                     * prefetched ahead of sequential
+                                     * reader */
 };
 
 /// filesystem parameters
 struct fat32_fs_params_t {
   size_t file_table_size;     /**< a size of hash table for open files */
   size_t fh_table_size;       /**< a size of hash table for file handles  */
+  size_t extent_table_size;   /**< a size of hash table for extent maps */
+  size_t dir_table_size;      /**< a size of hash table for indexes of free
+                                 directory entries */
+  size_t fat_cache_size;      /**< a number of FAT sectors kept in memory */
+  bool   fat_preload;         /**< load the whole FAT into memory at mount
+                                 time instead of caching separate sectors */
+  uint32_t fat_readahead;     /**< a number of FAT sectors read
+                                 asynchronously after a cache miss. Zero
+                                 disables readahead. */
+  uint64_t cluster_cache_size; /**< a size of memory used to cache data
+                                  clusters in bytes */
+  bool   dev_direct;          /**< open the device with @em O_DIRECT */
+  uint32_t partition;         /**< a number of partition holding the file
+                                 system on a whole disk device; zero if
+                                 the device is not partitioned */
+  off_t  dev_offset;          /**< an offset of the file system on the
+                                 device; used if @em partition is zero */
+  uint32_t readahead;         /**< maximum size of data prefetched ahead of
+                                 sequential reader in bytes. Zero disables
+                                 readahead. */
 };
 
 /**
@@ -74,9 +109,10 @@ struct fat32_fs_params_t {
  * @retval FE_ERRNO @li memory allocation error
  *                  @li unable to create or initialize synchronization objects
  *                  @li unable to read/lseek/etc on device file
- * @retval FE_NONBLOCK_DEV device is not a block device
+ * @retval FE_NONBLOCK_DEV device is neither a block device nor an image file
  * @retval FE_INVALID_DEV device ends prematurely
  * @retval FE_INVALID_FS BPB/FSInfo on the device is inconsistent
+ * @retval FE_NO_PARTITION requested partition does not exist
  */
 enum fat32_error_t
 fat32_fs_open(const char *path, const struct fat32_fs_params_t *params,
@@ -94,8 +130,30 @@ enum fat32_error_t
 fat32_fs_close(struct fat32_fs_t *fs);
 
 /**
- * Reads a cluster into the buffer. Function does not restore file offset
- * after the call.
+ * Starts background threads of the file system. The file system is usable
+ * without them but does no asynchronous readahead then. Threads are not
+ * inherited by a child process so it must be called after daemonizing.
+ *
+ * @param fs a file system opened by ::fat32_fs_open
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO unable to create a thread
+ */
+enum fat32_error_t
+fat32_fs_start(struct fat32_fs_t *fs);
+
+/**
+ * Stops threads started by ::fat32_fs_start. Nothing is done for threads
+ * which are not running.
+ *
+ * @param fs a file system
+ */
+void
+fat32_fs_stop(struct fat32_fs_t *fs);
+
+/**
+ * Reads a cluster into the buffer. The cluster is taken from the cluster
+ * cache if it's there.
  *
  * @param fs file system object
  * @param buffer which size is greater or equal to
@@ -5,8 +5,6 @@
  *
  * @brief  FSInfo structures and related function's prototypes.
  *
- * @todo keep correct free space hint
- * @todo keep correct free cluster hint
  */
 #ifndef _FS_INFO_H_
 #define _FS_INFO_H_
@@ -15,6 +13,7 @@
 #include <inttypes.h>
 
 #include "fat32/bpb.h"
+#include "fat32/dev.h"
 #include "fat32/errors.h"
 
 /// number of bytes in the first reserved block in fsinfo structure
@@ -63,22 +62,36 @@ int
 fat32_fs_info_verbose_info(const struct fat32_fs_info_t *fs_info);
 
 /**
- * Read fs_info structure from file. An offset from which reading occurs
- * is taken from BPB. This functions restores original file position after
- * reading all needed data.
+ * Read fs_info structure from device. An offset from which reading occurs
+ * is taken from BPB.
  *
- * @param fd a file to read FSInfo from
+ * @param dev a device to read FSInfo from
  * @param bpb BPB structure
  * @param fs_info a place to store readed data
  *
  * @retval FE_OK
- * @retval FE_ERRNO @li unable to @em lseek in the underlying device file
- *                  @li unable to @em read from the underlying device file
+ * @retval FE_ERRNO unable to @em read from the underlying device file
  * @retval FE_INVALID_DEV device file ended prematurely
  * @retval FE_INVALID_FS FSInfo structure read is inconsistent
  */
 enum fat32_error_t
-fat32_fs_info_read(int fd, const struct fat32_bpb_t *bpb,
-       struct fat32_fs_info_t *fs_info);
+fat32_fs_info_read(const struct fat32_dev_t *dev,
+                   const struct fat32_bpb_t *bpb,
+                   struct fat32_fs_info_t *fs_info);
+
+/**
+ * Writes fs_info structure to device. An offset is taken from BPB.
+ *
+ * @param dev     a device to write FSInfo to
+ * @param bpb     BPB structure
+ * @param fs_info FSInfo to write
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO unable to @em write to the underlying device file
+ */
+enum fat32_error_t
+fat32_fs_info_write(const struct fat32_dev_t *dev,
+                    const struct fat32_bpb_t *bpb,
+                    const struct fat32_fs_info_t *fs_info);
 
 #endif /* _FS_INFO_H_ */
@@ -17,6 +17,8 @@
 #include <inttypes.h>
 
 #include "fat32/errors.h"
+#include "fat32/extent_map.h"
+#include "fat32/file_info.h"
 
 #define REIMPORT_INLINES
 #include "fat32/fs.h"
@@ -47,14 +49,37 @@ struct fat32_fs_object_t {
                                            directory) */
   const struct fat32_fs_t    *fs;   /**< file system containing the object */
 
-  uint32_t                    last_cluster; /**< last accessed cluster */
-  uint32_t                    last_cluster_number; /**< a number of the last
-                                                    * accessed cluster in the
-                                                    * file's cluster chain */
+  struct fat32_extent_map_t  *extent_map; /**< Extent map of the object's
+                                           * cluster chain. Built on the
+                                           * first access and shared with all
+                                           * other objects having the same
+                                           * first cluster. */
   off_t                       offset; /**< An offset of the directory entry
                                        * corresponding to the object. Makes
                                        * sense only if fs obect has been created
                                        * from directory entry. */
+  uint32_t                    dir_cluster; /**< The first cluster of the
+                                            * directory containing the
+                                            * object. Zero for root
+                                            * directory. */
+  uint32_t                    dir_entry; /**< A number of the directory
+                                          * entry of the object in the
+                                          * directory containing it. */
+  off_t                       read_end; /**< An offset following the last
+                                         * read data. Used to detect
+                                         * sequential reading. */
+  uint32_t                    ra_window; /**< A number of clusters
+                                          * prefetched ahead of sequential
+                                          * reader. Zero if the object is
+                                          * read randomly. */
+  uint32_t                    ra_next; /**< A number of the first cluster
+                                        * in the chain which has not been
+                                        * prefetched yet. */
+  struct fat32_file_info_t   *file_info; /**< State shared by all open
+                                          * instances of the file. NULL if
+                                          * the object is not open. The
+                                          * directory entry is owned by it
+                                          * then. */
 };
 
 /**
@@ -80,6 +105,9 @@ fat32_fs_object_root_dir(const struct fat32_fs_t *fs);
  *             name only from directory entry that's why it's picked to
  *             parameters list.
  * @param offset A global offset of the provided directory entry.
+ * @param dir_cluster The first cluster of the directory containing the
+ *                    directory entry.
+ * @param dir_entry   A number of the directory entry in the directory.
  *
  * @return File system object is returned in case of success. In case
  *         of errors @em NULL is returned and @em errno is set appropriately.
@@ -87,7 +115,8 @@ fat32_fs_object_root_dir(const struct fat32_fs_t *fs);
 struct fat32_fs_object_t *
 fat32_fs_object_direntry(const struct fat32_fs_t       *fs,
                          const struct fat32_direntry_t *direntry,
-                         const char *name, off_t offset);
+                         const char *name, off_t offset,
+                         uint32_t dir_cluster, uint32_t dir_entry);
 
 
 
@@ -99,6 +128,103 @@ fat32_fs_object_direntry(const struct fat32_fs_t       *fs,
 void
 fat32_fs_object_free(struct fat32_fs_object_t *fs_object);
 
+/**
+ * Attaches an object being opened to the state shared by all open instances
+ * of the file. The first attached object passes its directory entry to the
+ * shared state, others start using it instead of their own copies.
+ *
+ * @param fs_object File system object representing the file.
+ * @param file_info Information about the open file.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO       IO errors or memory allocation error.
+ * @retval FE_INVALID_DEV Device ended prematurely.
+ * @retval FE_INVALID_FS  Bad or free cluster encountered in cluster chain.
+ */
+enum fat32_error_t
+fat32_fs_object_attach(struct fat32_fs_object_t *fs_object,
+                       struct fat32_file_info_t *file_info);
+
+/**
+ * Allocates clusters for the data of the open file kept in memory and
+ * writes it there. Modified directory entry is written too if requested.
+ * Otherwise it stays in the state shared by all open instances of the file
+ * so that successive updates of the size cost a single write.
+ *
+ * @param fs_object File system object attached to the open file.
+ * @param direntry  Whether to write modified directory entry.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO           IO errors while working with device.
+ * @retval FE_INVALID_DEV     Device ended prematurely.
+ * @retval FE_INVALID_FS      Invalid file system.
+ * @retval FE_FS_IS_FULL      There are not enough free clusters. Data is
+ *                            kept in memory.
+ * @retval FE_FS_INCONSISTENT Due to IO error fs left in inconsistent state.
+ */
+enum fat32_error_t
+fat32_fs_object_flush(struct fat32_fs_object_t *fs_object, bool direntry);
+
+/**
+ * Fills a range of the open file with zeros. Parts of the range in clusters
+ * kept in memory are zeroed there, clusters which are neither allocated nor
+ * kept in memory are skipped. Must be called with the lock of the file
+ * taken for writing.
+ *
+ * @param fs_object File system object attached to the open file.
+ * @param from      An offset of the range in the file.
+ * @param to        An offset following the range.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO           IO errors while working with device.
+ * @retval FE_INVALID_DEV     Device ended prematurely.
+ * @retval FE_INVALID_FS      Invalid file system.
+ */
+enum fat32_error_t
+fat32_fs_object_zero_range(struct fat32_fs_object_t *fs_object,
+                           uint32_t from, uint32_t to);
+
+/**
+ * Preallocates clusters for the open file so that it can grow up to the
+ * specified size without further allocations. Clusters are allocated in as
+ * few extents as possible and are not written: they are past the
+ * initialized data. Data kept in memory is allocated first.
+ *
+ * @param fs_object File system object attached to the open file.
+ * @param end       Size of the file the clusters are needed for.
+ * @param keep_size If @em true the size of the file is not changed and the
+ *                  clusters past its end are freed by ::fat32_fs_object_trim.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO           IO errors while working with device.
+ * @retval FE_INVALID_DEV     Device ended prematurely.
+ * @retval FE_INVALID_FS      Invalid file system.
+ * @retval FE_FS_IS_FULL      There are not enough free clusters. Nothing is
+ *                            preallocated.
+ * @retval FE_FS_INCONSISTENT Due to IO error fs left in inconsistent state.
+ */
+enum fat32_error_t
+fat32_fs_object_preallocate(struct fat32_fs_object_t *fs_object,
+                            uint32_t end, bool keep_size);
+
+/**
+ * Frees clusters of the open file past its end. Must be called after
+ * ::fat32_fs_object_flush when the last instance of the file is closed.
+ *
+ * @param fs_object File system object attached to the open file.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO           IO errors while working with device.
+ * @retval FE_INVALID_DEV     Device ended prematurely.
+ * @retval FE_INVALID_FS      Invalid file system.
+ * @retval FE_FS_INCONSISTENT Due to IO error fs left in inconsistent state.
+ * @retval FE_FS_PARTIALLY_CONSISTENT The clusters are detached from the
+ *                                    file but have not been freed due to IO
+ *                                    errors.
+ */
+enum fat32_error_t
+fat32_fs_object_trim(struct fat32_fs_object_t *fs_object);
+
 /**
  * Returns a number of the first cluster of file system object.
  *
@@ -109,6 +235,24 @@ fat32_fs_object_free(struct fat32_fs_object_t *fs_object);
 uint32_t
 fat32_fs_object_first_cluster(const struct fat32_fs_object_t *fs_object);
 
+/**
+ * Returns an extent map of object's cluster chain. The map is built on the
+ * first call and kept in the object until it gets stale. The reference to
+ * the map returned must be dropped using ::fat32_extent_cache_release when
+ * it's not needed anymore.
+ *
+ * @param      fs_object File system object.
+ * @param[out] map       Extent map is stored here on success.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO       IO errors or memory allocation error.
+ * @retval FE_INVALID_DEV Device ended prematurely.
+ * @retval FE_INVALID_FS  Bad or free cluster encountered in cluster chain.
+ */
+enum fat32_error_t
+fat32_fs_object_extent_map(struct fat32_fs_object_t *fs_object,
+                           struct fat32_extent_map_t **map);
+
 /**
  * Determines whether file system object is an ordinary file.
  *
@@ -234,9 +378,41 @@ enum fat32_error_t
 fat32_fs_object_delete(struct fat32_fs_object_t *fs_object);
 
 /**
- * Truncate a file represented by fs object.
+ * Creates an empty file or directory in the directory. The name is stored as
+ * a short name converted to upper case. A place for the directory entry is
+ * found using the index of free entries of the directory. The directory is
+ * extended if there are no free entries in it. The object is not created if
+ * the directory already contains an object with the same name regardless of
+ * case.
+ *
+ * @param parent    File system object representing the directory.
+ * @param name      A name of the new object.
+ * @param directory Whether a directory is created.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO           @li the name can't be stored as a short name
+ *                            @li the object already exists (@em errno is
+ *                                set to @em EEXIST)
+ *                            @li IO errors while working with device
+ * @retval FE_INVALID_DEV     Device ended prematurely.
+ * @retval FE_INVALID_FS      Invalid file system.
+ * @retval FE_FS_IS_FULL      There are no free clusters.
+ * @retval FE_FS_INCONSISTENT Due to IO error fs left in inconsistent state.
+ * @retval FE_FS_PARTIALLY_CONSISTENT The object has not been created and
+ *                                    the cluster allocated for it has not
+ *                                    been freed due to IO errors.
+ */
+enum fat32_error_t
+fat32_fs_object_create(struct fat32_fs_object_t *parent, const char *name,
+                       bool directory);
+
+/**
+ * Truncate a file represented by fs object. A growing file gets clusters
+ * allocated but not written: they are read as zeros until they are written
+ * or the file is flushed. A shrinking file gets its directory entry written
+ * and clusters past the new end freed right away.
  *
- * @param fs_object File system object representing file to truncate.
+ * @param fs_object File system object attached to the open file.
  * @param length    Desired new length of a file.
  *
  * @retval FE_OK
@@ -244,6 +420,7 @@ fat32_fs_object_delete(struct fat32_fs_object_t *fs_object);
  * @retval FE_FS_INCONSISTENT Due to IO error fs left in insonsistent state.
  * @retval FE_INVALID_DEV     Invalid device.
  * @retval FE_INVALID_FS      Invalid file system.
+ * @retval FE_FS_IS_FULL      There are not enough free clusters.
  * @retval FE_FS_PARTIALLY_INCONSISTENT Due to IO error fs left in partially
  *                                      inconsistent state.
  */
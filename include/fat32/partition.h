@@ -0,0 +1,77 @@
+/**
+ * @file   partition.h
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:37:42 2026
+ *
+ * @brief  Partition tables of whole disk images.
+ *
+ * Both MBR (including logical partitions inside of an extended one) and GPT
+ * are understood. Partitions are numbered the same way Linux does it:
+ * primary MBR partitions and GPT entries get numbers starting from one,
+ * logical MBR partitions are numbered starting from five.
+ */
+#ifndef _PARTITION_H_
+#define _PARTITION_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fat32/dev.h"
+#include "fat32/errors.h"
+
+/// an entry of MBR partition table
+struct fat32_mbr_entry_t {
+  uint8_t  status;              /**< boot indicator */
+  uint8_t  chs_first[3];        /**< CHS address of the first sector */
+  uint8_t  type;                /**< partition type */
+  uint8_t  chs_last[3];         /**< CHS address of the last sector */
+  uint32_t lba_first;           /**< LBA of the first sector */
+  uint32_t sectors;             /**< a number of sectors in partition */
+} __attribute__((packed));
+
+/// GPT header
+struct fat32_gpt_header_t {
+  uint8_t  signature[8];        /**< "EFI PART" */
+  uint32_t revision;            /**< GPT revision */
+  uint32_t header_size;         /**< size of the header */
+  uint32_t header_crc;          /**< CRC32 of the header */
+  uint32_t reserved;            /**< must be zero */
+  uint64_t current_lba;         /**< LBA of this header */
+  uint64_t backup_lba;          /**< LBA of the backup header */
+  uint64_t first_usable_lba;    /**< the first LBA usable by partitions */
+  uint64_t last_usable_lba;     /**< the last LBA usable by partitions */
+  uint8_t  disk_guid[16];       /**< disk identifier */
+  uint64_t entries_lba;         /**< the first LBA of partition entries */
+  uint32_t entries_count;       /**< a number of partition entries */
+  uint32_t entry_size;          /**< size of a partition entry */
+  uint32_t entries_crc;         /**< CRC32 of partition entries */
+} __attribute__((packed));
+
+/// GPT partition entry
+struct fat32_gpt_entry_t {
+  uint8_t  type_guid[16];       /**< partition type; zero if unused */
+  uint8_t  guid[16];            /**< partition identifier */
+  uint64_t lba_first;           /**< the first LBA of partition */
+  uint64_t lba_last;            /**< the last LBA of partition (inclusive) */
+  uint64_t attributes;          /**< attribute flags */
+  uint16_t name[36];            /**< UTF-16LE partition name */
+} __attribute__((packed));
+
+/**
+ * Finds a partition on the device.
+ *
+ * @param      dev    Device holding the whole disk.
+ * @param      number Partition number starting from one.
+ * @param[out] offset An offset of the partition on the device.
+ * @param[out] size   Size of the partition.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV   device ended prematurely
+ * @retval FE_NO_PARTITION  there is no partition table or the partition
+ */
+enum fat32_error_t
+fat32_partition_find(const struct fat32_dev_t *dev, uint32_t number,
+                     off_t *offset, off_t *size);
+
+#endif /* _PARTITION_H_ */
@@ -28,6 +28,10 @@ typedef unsigned int (*hash_function_t)(const void *);
 /// a type of function to compare to keys for equality
 typedef bool (*equality_function_t)(const void *, const void *);
 
+/// a type of function called for each key value pair with an additional
+/// argument
+typedef void (*visitor_t)(void *, void *, void *);
+
 /// incomplete declaration of hash table structure visible from outside
 struct hash_table_t;
 
@@ -114,6 +118,18 @@ hash_table_delete(struct hash_table_t *hash_table, const void *key);
 void *
 hash_table_lookup(struct hash_table_t *hash_table, const void *key);
 
+/**
+ * Calls a function for each key value pair in hash table. The order is
+ * unspecified. The function must not modify hash table.
+ *
+ * @param hash_table Hash table.
+ * @param visitor    A function called with a key, a value and @em arg.
+ * @param arg        An additional argument passed to @em visitor.
+ */
+void
+hash_table_foreach(struct hash_table_t *hash_table,
+                   visitor_t visitor, void *arg);
+
 /**
  * Hash function for strings.
  *
@@ -135,4 +151,25 @@ hash_table_string_hash(const void *str);
 bool
 hash_table_string_equal(const void *a, const void *b);
 
+/**
+ * Hash function for strings which ignores case of letters.
+ *
+ * @param str A string.
+ *
+ * @return Hash value.
+ */
+unsigned int
+hash_table_string_case_hash(const void *str);
+
+/**
+ * Equality function for strings which ignores case of letters.
+ *
+ * @param a String.
+ * @param b String.
+ *
+ * @return Result of comparison.
+ */
+bool
+hash_table_string_case_equal(const void *a, const void *b);
+
 #endif
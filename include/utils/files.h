@@ -57,6 +57,23 @@ xclose(int fd);
 ssize_t
 xread(int fd, void *buf, size_t count);
 
+/**
+ * Analogue of standard @em pread system call which ensures
+ * that all requested data is read by one call (if it's possible).
+ * File position is not changed so the function can be used concurrently
+ * on the same file descriptor.
+ *
+ * @param fd     file descriptor
+ * @param buf    a buffer to store read information
+ * @param count  number of bytes to read
+ * @param offset an offset in file to read from
+ *
+ * @return Number of bytes read. Less than @em count means that the end of
+ *         file has been reached. Error is indicated by -1 value.
+ */
+ssize_t
+xpread(int fd, void *buf, size_t count, off_t offset);
+
 /**
  * Analogue of standard @em write system call which ensures
  * that all requested data is written by one call (if it's possible).
@@ -151,6 +151,11 @@ fat32_bpb_check_validity(const struct fat32_bpb_t *bpb)
     return false;
   }
 
+  /* there must be at least one FAT and the active one must exist */
+  if (bpb->fats_count == 0 || fat32_bpb_active_fat(bpb) >= bpb->fats_count) {
+    return false;
+  }
+
   /* fs version must be 0x0000 on FAT32 */
   if (bpb->fs_version != FAT32_FS_VERSION) {
     return false;
@@ -179,16 +184,13 @@ fat32_bpb_check_validity(const struct fat32_bpb_t *bpb)
 }
 
 enum fat32_error_t
-fat32_bpb_read(int fd, struct fat32_bpb_t *bpb)
+fat32_bpb_read(const struct fat32_dev_t *dev, struct fat32_bpb_t *bpb)
 {
   /* @todo endianess */
-  ssize_t nread = xread(fd, bpb, sizeof(struct fat32_bpb_t));
-  if (nread >= 0) {
-    if (nread < sizeof(struct fat32_bpb_t)) {
-      return FE_INVALID_DEV;
-    }
-  } else {
-    return FE_ERRNO;
+  enum fat32_error_t ret =
+    fat32_dev_read(dev, bpb, sizeof(struct fat32_bpb_t), 0);
+  if (ret != FE_OK) {
+    return ret;
   }
 
   if (!fat32_bpb_check_validity(bpb)) {
@@ -0,0 +1,1266 @@
+/**
+ * @file   cluster_cache.c
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:27:55 2026
+ *
+ * @brief  Implementation of the cluster cache.
+ *
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "fat32/cluster_cache.h"
+#include "fat32/utils.h"
+
+/// queues cache entries can belong to
+enum fat32_cluster_cache_queue_id_t {
+  FAT32_CLUSTER_CACHE_FREE,     /**< entry does not hold any cluster */
+  FAT32_CLUSTER_CACHE_A1IN,     /**< FIFO of clusters accessed once */
+  FAT32_CLUSTER_CACHE_AM,       /**< LRU of frequently accessed clusters */
+};
+
+/// a cluster stored in the cache
+struct fat32_cluster_cache_entry_t {
+  uint32_t cluster;             /**< cluster number */
+  uint8_t  queue;               /**< queue holding the entry (one of
+                                   #fat32_cluster_cache_queue_id_t) */
+  bool     loading;             /**< cluster is being read from the device */
+  bool     dirty;               /**< cluster has been modified in memory and
+                                   must be written back to the device */
+  uint32_t dirty_first;         /**< offset of the first modified byte
+                                   rounded down to
+                                   fat32_cluster_cache_t::dirty_unit */
+  uint32_t dirty_end;           /**< offset following the last modified
+                                   byte rounded up to
+                                   fat32_cluster_cache_t::dirty_unit */
+  uint32_t refs;                /**< a number of users pinning the entry */
+  uint8_t *data;                /**< cluster's contents */
+
+  struct fat32_cluster_cache_entry_t *prev;      /**< more recent entry in
+                                                    the queue */
+  struct fat32_cluster_cache_entry_t *next;      /**< less recent entry in
+                                                    the queue or next free
+                                                    entry */
+  struct fat32_cluster_cache_entry_t *hash_next; /**< next entry in the same
+                                                    hash bucket */
+};
+
+/// a queue of cache entries
+struct fat32_cluster_cache_queue_t {
+  struct fat32_cluster_cache_entry_t *head;  /**< the most recent entry */
+  struct fat32_cluster_cache_entry_t *tail;  /**< the least recent entry */
+  uint32_t                            count; /**< a number of entries */
+};
+
+/// a cluster recently evicted from A1in queue
+struct fat32_cluster_cache_ghost_t {
+  uint32_t cluster;             /**< cluster number; zero if slot is unused */
+  struct fat32_cluster_cache_ghost_t *hash_next; /**< next ghost in the same
+                                                    hash bucket */
+};
+
+/// a run of adjacent clusters queued for prefetching
+struct fat32_cluster_cache_run_t {
+  uint32_t first;               /**< the first cluster */
+  uint32_t count;               /**< a number of clusters */
+};
+
+/// maximum number of runs waiting to be prefetched
+#define FAT32_CLUSTER_CACHE_PREFETCH_QUEUE 32
+
+/// Cache of data clusters.
+struct fat32_cluster_cache_t {
+  pthread_mutex_t lock;         /**< lock protecting the whole cache */
+  pthread_cond_t  changed;      /**< broadcasted when an entry has been
+                                   loaded or unpinned */
+
+  const struct fat32_dev_t *dev; /**< device */
+  const struct fat32_bpb_t *bpb; /**< BPB */
+  uint32_t cluster_size;        /**< size of a cluster in bytes */
+  uint32_t dirty_unit;          /**< granularity of modified ranges: a
+                                   sector or a block of direct I/O */
+  off_t    data_offset;         /**< device offset of the first cluster */
+
+  uint32_t size;                /**< a number of clusters in the cache */
+  struct fat32_cluster_cache_entry_t  *entries; /**< all the entries */
+  uint8_t *data;                /**< memory for clusters' contents */
+  struct fat32_cluster_cache_entry_t **dirty;   /**< buffer used to collect
+                                                   dirty entries on
+                                                   synchronization */
+
+  struct fat32_cluster_cache_entry_t **buckets; /**< hash table indexed by
+                                                   cluster number */
+  uint32_t buckets_mask;        /**< number of buckets minus one */
+
+  struct fat32_cluster_cache_entry_t *free; /**< list of unused entries */
+  struct fat32_cluster_cache_queue_t  a1in; /**< clusters accessed once */
+  struct fat32_cluster_cache_queue_t  am;   /**< hot clusters */
+  uint32_t a1in_max;            /**< A1in size which triggers eviction from
+                                   it instead of Am */
+
+  struct fat32_cluster_cache_ghost_t  *ghosts; /**< A1out ring */
+  struct fat32_cluster_cache_ghost_t **ghost_buckets; /**< hash table of
+                                                         ghosts */
+  uint32_t ghosts_count;        /**< a number of slots in A1out */
+  uint32_t ghost_next;          /**< slot to reuse next */
+  uint32_t ghost_buckets_mask;  /**< number of ghost buckets minus one */
+
+  uint32_t dirty_count;         /**< a number of dirty entries */
+  uint64_t hits;                /**< a number of cache hits */
+  uint64_t misses;              /**< a number of cache misses */
+
+  bool      prefetching;        /**< prefetch thread is running */
+  bool      prefetch_stop;      /**< prefetch thread must exit */
+  pthread_t prefetch_thread;    /**< thread reading prefetched clusters */
+  pthread_cond_t prefetch_wakeup; /**< signalled when runs are queued or
+                                     the thread must stop */
+  struct fat32_cluster_cache_run_t
+    prefetch_queue[FAT32_CLUSTER_CACHE_PREFETCH_QUEUE]; /**< ring of runs
+                                                           to prefetch */
+  uint32_t  prefetch_head;      /**< the oldest queued run */
+  uint32_t  prefetch_count;     /**< a number of queued runs */
+};
+
+/// maximum number of clusters passed to a single vectored write
+#define FAT32_CLUSTER_CACHE_MAX_IOV 256
+
+/**
+ * Returns the smallest power of two which is not less than @em value.
+ */
+static uint32_t
+fat32_cluster_cache_round_up(uint32_t value)
+{
+  uint32_t result = 1;
+
+  while (result < value) {
+    result <<= 1;
+  }
+
+  return result;
+}
+
+struct fat32_cluster_cache_t *
+fat32_cluster_cache_create(const struct fat32_dev_t *dev,
+                           const struct fat32_bpb_t *bpb,
+                           uint32_t size)
+{
+  struct fat32_cluster_cache_t *cache =
+    calloc(1, sizeof(struct fat32_cluster_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  /* clusters of mapped image are accessed in place so the cache stays
+   * unused */
+  if (size < FAT32_CLUSTER_CACHE_MIN_SIZE || dev->map != NULL) {
+    size = FAT32_CLUSTER_CACHE_MIN_SIZE;
+  }
+
+  cache->dev          = dev;
+  cache->bpb          = bpb;
+  cache->cluster_size = fat32_bpb_cluster_size(bpb);
+  cache->dirty_unit   = bpb->bytes_per_sector;
+  cache->data_offset  =
+    fat32_cluster_to_offset(bpb, FAT32_MIN_CLUSTER_NUMBER);
+  cache->size         = size;
+  cache->a1in_max     = size / 4;
+  cache->ghosts_count = size / 2;
+
+  /* partial writes of direct I/O blocks would be read back first */
+  if (dev->alignment > cache->dirty_unit) {
+    cache->dirty_unit = dev->alignment;
+  }
+  if (cache->dirty_unit > cache->cluster_size) {
+    cache->dirty_unit = cache->cluster_size;
+  }
+
+  uint32_t buckets       = fat32_cluster_cache_round_up(size);
+  uint32_t ghost_buckets = fat32_cluster_cache_round_up(cache->ghosts_count);
+
+  cache->buckets_mask       = buckets - 1;
+  cache->ghost_buckets_mask = ghost_buckets - 1;
+
+  cache->entries = calloc(size, sizeof(struct fat32_cluster_cache_entry_t));
+  cache->dirty   = calloc(size, sizeof(struct fat32_cluster_cache_entry_t *));
+  cache->buckets =
+    calloc(buckets, sizeof(struct fat32_cluster_cache_entry_t *));
+  cache->ghosts  = calloc(cache->ghosts_count,
+                          sizeof(struct fat32_cluster_cache_ghost_t));
+  cache->ghost_buckets = calloc(ghost_buckets,
+                                sizeof(struct fat32_cluster_cache_ghost_t *));
+  if (cache->entries == NULL || cache->dirty == NULL ||
+      cache->buckets == NULL || cache->ghosts == NULL ||
+      cache->ghost_buckets == NULL) {
+    goto cleanup;
+  }
+
+  /* aligned memory lets clusters be transferred without bounce buffers */
+  cache->data = fat32_dev_alloc((size_t) size * cache->cluster_size);
+  if (cache->data == NULL) {
+    goto cleanup;
+  }
+
+  for (uint32_t i = 0; i < size; ++i) {
+    struct fat32_cluster_cache_entry_t *entry = &cache->entries[i];
+
+    entry->queue = FAT32_CLUSTER_CACHE_FREE;
+    entry->data  = cache->data + (size_t) i * cache->cluster_size;
+    entry->next  = (i + 1 < size) ? &cache->entries[i + 1] : NULL;
+  }
+  cache->free = &cache->entries[0];
+
+  int ret = pthread_mutex_init(&cache->lock, NULL);
+  if (ret != 0) {
+    errno = ret;
+    goto cleanup;
+  }
+
+  ret = pthread_cond_init(&cache->changed, NULL);
+  if (ret != 0) {
+    pthread_mutex_destroy(&cache->lock);
+    errno = ret;
+    goto cleanup;
+  }
+
+  return cache;
+
+cleanup:
+  free(cache->entries);
+  free(cache->dirty);
+  free(cache->buckets);
+  free(cache->ghosts);
+  free(cache->ghost_buckets);
+  free(cache->data);
+  free(cache);
+
+  return NULL;
+}
+
+void
+fat32_cluster_cache_free(struct fat32_cluster_cache_t *cache)
+{
+  if (cache == NULL) {
+    return;
+  }
+
+  fat32_cluster_cache_prefetch_stop(cache);
+
+  assert( pthread_cond_destroy(&cache->changed) == 0 );
+  assert( pthread_mutex_destroy(&cache->lock) == 0 );
+
+  free(cache->entries);
+  free(cache->dirty);
+  free(cache->buckets);
+  free(cache->ghosts);
+  free(cache->ghost_buckets);
+  free(cache->data);
+  free(cache);
+}
+
+/**
+ * Returns a queue by its identifier.
+ */
+static struct fat32_cluster_cache_queue_t *
+fat32_cluster_cache_queue(struct fat32_cluster_cache_t *cache, uint8_t queue)
+{
+  assert( queue != FAT32_CLUSTER_CACHE_FREE );
+
+  return (queue == FAT32_CLUSTER_CACHE_AM) ? &cache->am : &cache->a1in;
+}
+
+/**
+ * Inserts an entry to the head of the queue.
+ */
+static void
+fat32_cluster_cache_queue_push(struct fat32_cluster_cache_t *cache,
+                               struct fat32_cluster_cache_entry_t *entry,
+                               uint8_t queue_id)
+{
+  struct fat32_cluster_cache_queue_t *queue =
+    fat32_cluster_cache_queue(cache, queue_id);
+
+  entry->queue = queue_id;
+  entry->prev  = NULL;
+  entry->next  = queue->head;
+
+  if (queue->head != NULL) {
+    queue->head->prev = entry;
+  } else {
+    queue->tail = entry;
+  }
+  queue->head = entry;
+  ++queue->count;
+}
+
+/**
+ * Removes an entry from its queue.
+ */
+static void
+fat32_cluster_cache_queue_remove(struct fat32_cluster_cache_t *cache,
+                                 struct fat32_cluster_cache_entry_t *entry)
+{
+  struct fat32_cluster_cache_queue_t *queue =
+    fat32_cluster_cache_queue(cache, entry->queue);
+
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    queue->head = entry->next;
+  }
+
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    queue->tail = entry->prev;
+  }
+
+  entry->prev  = NULL;
+  entry->next  = NULL;
+  entry->queue = FAT32_CLUSTER_CACHE_FREE;
+  --queue->count;
+}
+
+/**
+ * Finds cached cluster.
+ *
+ * @return Cache entry or NULL if cluster is not cached.
+ */
+static struct fat32_cluster_cache_entry_t *
+fat32_cluster_cache_lookup(const struct fat32_cluster_cache_t *cache,
+                           uint32_t cluster)
+{
+  struct fat32_cluster_cache_entry_t *entry =
+    cache->buckets[cluster & cache->buckets_mask];
+
+  while (entry != NULL && entry->cluster != cluster) {
+    entry = entry->hash_next;
+  }
+
+  return entry;
+}
+
+/**
+ * Removes an entry from the hash table.
+ */
+static void
+fat32_cluster_cache_unhash(struct fat32_cluster_cache_t *cache,
+                           struct fat32_cluster_cache_entry_t *entry)
+{
+  struct fat32_cluster_cache_entry_t **link =
+    &cache->buckets[entry->cluster & cache->buckets_mask];
+
+  while (*link != entry) {
+    link = &(*link)->hash_next;
+  }
+
+  *link            = entry->hash_next;
+  entry->hash_next = NULL;
+}
+
+/**
+ * Finds a ghost of the cluster.
+ *
+ * @return A link pointing to the ghost or to NULL if there's no such ghost.
+ */
+static struct fat32_cluster_cache_ghost_t **
+fat32_cluster_cache_ghost_lookup(struct fat32_cluster_cache_t *cache,
+                                 uint32_t cluster)
+{
+  struct fat32_cluster_cache_ghost_t **link =
+    &cache->ghost_buckets[cluster & cache->ghost_buckets_mask];
+
+  while (*link != NULL && (*link)->cluster != cluster) {
+    link = &(*link)->hash_next;
+  }
+
+  return link;
+}
+
+/**
+ * Remembers a cluster evicted from A1in queue in A1out. The oldest ghost is
+ * forgotten if A1out is full.
+ */
+static void
+fat32_cluster_cache_ghost_add(struct fat32_cluster_cache_t *cache,
+                              uint32_t cluster)
+{
+  if (cache->ghosts_count == 0) {
+    return;
+  }
+
+  struct fat32_cluster_cache_ghost_t *ghost =
+    &cache->ghosts[cache->ghost_next];
+
+  cache->ghost_next = (cache->ghost_next + 1) % cache->ghosts_count;
+
+  if (ghost->cluster != 0) {
+    struct fat32_cluster_cache_ghost_t **link =
+      fat32_cluster_cache_ghost_lookup(cache, ghost->cluster);
+
+    assert( *link == ghost );
+    *link = ghost->hash_next;
+  }
+
+  struct fat32_cluster_cache_ghost_t **bucket =
+    &cache->ghost_buckets[cluster & cache->ghost_buckets_mask];
+
+  ghost->cluster   = cluster;
+  ghost->hash_next = *bucket;
+  *bucket          = ghost;
+}
+
+/**
+ * Inserts an entry to the cache. The entry is put to Am if the cluster has
+ * been evicted from A1in recently and to A1in otherwise.
+ */
+static void
+fat32_cluster_cache_insert(struct fat32_cluster_cache_t *cache,
+                           struct fat32_cluster_cache_entry_t *entry,
+                           uint32_t cluster)
+{
+  struct fat32_cluster_cache_ghost_t **link =
+    fat32_cluster_cache_ghost_lookup(cache, cluster);
+  uint8_t queue = FAT32_CLUSTER_CACHE_A1IN;
+
+  if (*link != NULL) {
+    struct fat32_cluster_cache_ghost_t *ghost = *link;
+
+    *link            = ghost->hash_next;
+    ghost->cluster   = 0;
+    ghost->hash_next = NULL;
+
+    queue = FAT32_CLUSTER_CACHE_AM;
+  }
+
+  struct fat32_cluster_cache_entry_t **bucket =
+    &cache->buckets[cluster & cache->buckets_mask];
+
+  entry->cluster   = cluster;
+  entry->loading   = false;
+  entry->dirty     = false;
+  entry->refs      = 0;
+  entry->hash_next = *bucket;
+  *bucket          = entry;
+
+  fat32_cluster_cache_queue_push(cache, entry, queue);
+}
+
+/**
+ * Marks an entry as recently used.
+ */
+static void
+fat32_cluster_cache_touch(struct fat32_cluster_cache_t *cache,
+                          struct fat32_cluster_cache_entry_t *entry)
+{
+  /* A1in is a FIFO so repeated accesses don't change the order */
+  if (entry->queue == FAT32_CLUSTER_CACHE_AM && cache->am.head != entry) {
+    fat32_cluster_cache_queue_remove(cache, entry);
+    fat32_cluster_cache_queue_push(cache, entry, FAT32_CLUSTER_CACHE_AM);
+  }
+}
+
+/**
+ * Returns an entry to the list of free ones.
+ */
+static void
+fat32_cluster_cache_drop(struct fat32_cluster_cache_t *cache,
+                         struct fat32_cluster_cache_entry_t *entry)
+{
+  assert( entry->refs == 0 && !entry->loading );
+
+  if (entry->dirty) {
+    entry->dirty = false;
+    --cache->dirty_count;
+  }
+
+  fat32_cluster_cache_unhash(cache, entry);
+  fat32_cluster_cache_queue_remove(cache, entry);
+
+  entry->next = cache->free;
+  cache->free = entry;
+}
+
+/**
+ * Writes the modified range of an entry to the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+static enum fat32_error_t
+fat32_cluster_cache_write_back(struct fat32_cluster_cache_t *cache,
+                               struct fat32_cluster_cache_entry_t *entry)
+{
+  off_t offset = fat32_cluster_to_offset(cache->bpb, entry->cluster) +
+    entry->dirty_first;
+
+  enum fat32_error_t ret =
+    fat32_dev_write(cache->dev, entry->data + entry->dirty_first,
+                    entry->dirty_end - entry->dirty_first, offset);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  entry->dirty = false;
+  --cache->dirty_count;
+
+  return FE_OK;
+}
+
+/**
+ * Finds the least recent entry which is not pinned in the queue.
+ */
+static struct fat32_cluster_cache_entry_t *
+fat32_cluster_cache_victim(struct fat32_cluster_cache_queue_t *queue)
+{
+  struct fat32_cluster_cache_entry_t *entry = queue->tail;
+
+  while (entry != NULL && (entry->refs != 0 || entry->loading)) {
+    entry = entry->prev;
+  }
+
+  return entry;
+}
+
+/**
+ * Gets an unused entry evicting some cluster if needed. Evicted clusters
+ * are taken from A1in while it's bigger than its share of the cache and
+ * from Am otherwise.
+ *
+ * @param      cache Cache.
+ * @param[out] entry Unused entry. NULL if all the entries are pinned.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO evicted cluster can't be written back
+ */
+static enum fat32_error_t
+fat32_cluster_cache_reclaim(struct fat32_cluster_cache_t *cache,
+                            struct fat32_cluster_cache_entry_t **entry)
+{
+  if (cache->free != NULL) {
+    *entry      = cache->free;
+    cache->free = (*entry)->next;
+    (*entry)->next = NULL;
+
+    return FE_OK;
+  }
+
+  struct fat32_cluster_cache_entry_t *victim = NULL;
+
+  if (cache->a1in.count > cache->a1in_max || cache->am.count == 0) {
+    victim = fat32_cluster_cache_victim(&cache->a1in);
+  }
+
+  if (victim == NULL) {
+    victim = fat32_cluster_cache_victim(&cache->am);
+  }
+
+  if (victim == NULL) {
+    victim = fat32_cluster_cache_victim(&cache->a1in);
+  }
+
+  *entry = NULL;
+  if (victim == NULL) {
+    return FE_OK;
+  }
+
+  if (victim->dirty) {
+    enum fat32_error_t ret = fat32_cluster_cache_write_back(cache, victim);
+    if (ret != FE_OK) {
+      return ret;
+    }
+  }
+
+  if (victim->queue == FAT32_CLUSTER_CACHE_A1IN) {
+    fat32_cluster_cache_ghost_add(cache, victim->cluster);
+  }
+
+  fat32_cluster_cache_unhash(cache, victim);
+  fat32_cluster_cache_queue_remove(cache, victim);
+
+  *entry = victim;
+
+  return FE_OK;
+}
+
+/**
+ * Gets a cluster of the mapped image. The buffer points straight into the
+ * mapping so changes reach the page cache immediately.
+ *
+ * @retval FE_OK
+ * @retval FE_INVALID_DEV the cluster is beyond the end of the image
+ */
+static enum fat32_error_t
+fat32_cluster_cache_get_mapped(struct fat32_cluster_cache_t *cache,
+                               uint32_t cluster, bool read, uint8_t **data)
+{
+  off_t offset = fat32_cluster_to_offset(cache->bpb, cluster);
+
+  *data = fat32_dev_map(cache->dev, offset, cache->cluster_size);
+  if (*data == NULL) {
+    return FE_INVALID_DEV;
+  }
+
+  if (read) {
+    fat32_dev_advise(cache->dev, offset, cache->cluster_size);
+  }
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_cluster_cache_get(struct fat32_cluster_cache_t *cache,
+                        uint32_t cluster, bool read, uint8_t **data)
+{
+  struct fat32_cluster_cache_entry_t *entry;
+  enum fat32_error_t                  ret;
+
+  if (cache->dev->map != NULL) {
+    return fat32_cluster_cache_get_mapped(cache, cluster, read, data);
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  while (true) {
+    entry = fat32_cluster_cache_lookup(cache, cluster);
+
+    if (entry != NULL) {
+      if (entry->loading) {
+        assert( pthread_cond_wait(&cache->changed, &cache->lock) == 0 );
+        continue;
+      }
+
+      ++cache->hits;
+      ++entry->refs;
+      fat32_cluster_cache_touch(cache, entry);
+
+      assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+      *data = entry->data;
+      return FE_OK;
+    }
+
+    ret = fat32_cluster_cache_reclaim(cache, &entry);
+    if (ret != FE_OK) {
+      assert( pthread_mutex_unlock(&cache->lock) == 0 );
+      return ret;
+    }
+
+    if (entry != NULL) {
+      break;
+    }
+
+    /* everything is pinned: waiting for some entry to be returned */
+    assert( pthread_cond_wait(&cache->changed, &cache->lock) == 0 );
+  }
+
+  ++cache->misses;
+  fat32_cluster_cache_insert(cache, entry, cluster);
+  entry->refs    = 1;
+  entry->loading = read;
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  if (!read) {
+    *data = entry->data;
+    return FE_OK;
+  }
+
+  /* other users of the cluster wait for loading to finish */
+  ret = fat32_dev_read(cache->dev, entry->data, cache->cluster_size,
+                       fat32_cluster_to_offset(cache->bpb, cluster));
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  entry->loading = false;
+  if (ret != FE_OK) {
+    int error = errno;
+
+    entry->refs = 0;
+    fat32_cluster_cache_drop(cache, entry);
+
+    errno = error;
+  }
+
+  assert( pthread_cond_broadcast(&cache->changed) == 0 );
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  *data = entry->data;
+  return ret;
+}
+
+/**
+ * Unpins a buffer obtained by ::fat32_cluster_cache_get marking a range of
+ * it modified. Ranges of successive modifications are joined so that they
+ * are written back together.
+ *
+ * @param cache Cache.
+ * @param data  Cluster data.
+ * @param from  Offset of the modified range in the cluster.
+ * @param to    Offset following the range. Equal to @em from if nothing has
+ *              been modified.
+ */
+static void
+fat32_cluster_cache_unpin(struct fat32_cluster_cache_t *cache,
+                          uint8_t *data, uint32_t from, uint32_t to)
+{
+  if (cache->dev->map != NULL) {
+    /* mapped clusters are neither pinned nor written back */
+    return;
+  }
+
+  size_t index = (size_t) (data - cache->data) / cache->cluster_size;
+  struct fat32_cluster_cache_entry_t *entry = &cache->entries[index];
+
+  assert( index < cache->size );
+  assert( from <= to && to <= cache->cluster_size );
+
+  from = from / cache->dirty_unit * cache->dirty_unit;
+  to   = (to + cache->dirty_unit - 1) / cache->dirty_unit * cache->dirty_unit;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  assert( entry->refs > 0 );
+
+  if (from != to) {
+    if (!entry->dirty) {
+      entry->dirty       = true;
+      entry->dirty_first = from;
+      entry->dirty_end   = to;
+      ++cache->dirty_count;
+    } else {
+      if (from < entry->dirty_first) {
+        entry->dirty_first = from;
+      }
+      if (to > entry->dirty_end) {
+        entry->dirty_end = to;
+      }
+    }
+  }
+
+  if (--entry->refs == 0) {
+    assert( pthread_cond_broadcast(&cache->changed) == 0 );
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+void
+fat32_cluster_cache_put(struct fat32_cluster_cache_t *cache,
+                        uint8_t *data, bool dirty)
+{
+  fat32_cluster_cache_unpin(cache, data, 0, dirty ? cache->cluster_size : 0);
+}
+
+bool
+fat32_cluster_cache_read(struct fat32_cluster_cache_t *cache,
+                         uint32_t cluster, void *buffer,
+                         uint32_t offset, uint32_t size)
+{
+  assert( offset + size <= cache->cluster_size );
+
+  if (cache->dev->map != NULL) {
+    const uint8_t *mapped =
+      fat32_dev_map(cache->dev,
+                    fat32_cluster_to_offset(cache->bpb, cluster) + offset,
+                    size);
+    if (mapped != NULL) {
+      memcpy(buffer, mapped, size);
+    }
+
+    return (mapped != NULL);
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  struct fat32_cluster_cache_entry_t *entry;
+
+  /* cluster being prefetched is waited for instead of being read twice */
+  while ((entry = fat32_cluster_cache_lookup(cache, cluster)) != NULL &&
+         entry->loading) {
+    assert( pthread_cond_wait(&cache->changed, &cache->lock) == 0 );
+  }
+
+  bool found = (entry != NULL);
+
+  if (found) {
+    ++cache->hits;
+    fat32_cluster_cache_touch(cache, entry);
+    memcpy(buffer, entry->data + offset, size);
+  } else {
+    ++cache->misses;
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return found;
+}
+
+bool
+fat32_cluster_cache_contains(struct fat32_cluster_cache_t *cache,
+                             uint32_t cluster)
+{
+  if (cache->dev->map != NULL) {
+    return false;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+  bool found = (fat32_cluster_cache_lookup(cache, cluster) != NULL);
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return found;
+}
+
+void
+fat32_cluster_cache_fill(struct fat32_cluster_cache_t *cache,
+                         uint32_t cluster, const void *data)
+{
+  struct fat32_cluster_cache_entry_t *entry;
+
+  if (cache->dev->map != NULL) {
+    return;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  if (fat32_cluster_cache_lookup(cache, cluster) == NULL &&
+      fat32_cluster_cache_reclaim(cache, &entry) == FE_OK &&
+      entry != NULL) {
+    memcpy(entry->data, data, cache->cluster_size);
+    fat32_cluster_cache_insert(cache, entry, cluster);
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+enum fat32_error_t
+fat32_cluster_cache_write(struct fat32_cluster_cache_t *cache,
+                          off_t offset, const void *data, size_t size)
+{
+  assert( offset >= cache->data_offset );
+
+  off_t    relative = offset - cache->data_offset;
+  uint32_t cluster  = relative / cache->cluster_size +
+    FAT32_MIN_CLUSTER_NUMBER;
+  uint32_t inner    = relative % cache->cluster_size;
+
+  assert( inner + size <= cache->cluster_size );
+
+  uint8_t *buffer;
+  enum fat32_error_t ret = fat32_cluster_cache_get(cache, cluster,
+                                                   true, &buffer);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  memcpy(buffer + inner, data, size);
+  fat32_cluster_cache_unpin(cache, buffer, inner, inner + size);
+
+  return FE_OK;
+}
+
+void
+fat32_cluster_cache_invalidate(struct fat32_cluster_cache_t *cache,
+                               uint32_t first, uint32_t count)
+{
+  struct fat32_cluster_cache_entry_t *entry;
+
+  if (cache->dev->map != NULL) {
+    return;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  if (count > cache->size) {
+    /* checking every entry is cheaper than looking up every cluster */
+    for (uint32_t i = 0; i < cache->size; ++i) {
+      entry = &cache->entries[i];
+
+      while (entry->queue != FAT32_CLUSTER_CACHE_FREE &&
+             entry->cluster - first < count &&
+             (entry->refs != 0 || entry->loading)) {
+        assert( pthread_cond_wait(&cache->changed, &cache->lock) == 0 );
+      }
+
+      if (entry->queue != FAT32_CLUSTER_CACHE_FREE &&
+          entry->cluster - first < count) {
+        fat32_cluster_cache_drop(cache, entry);
+      }
+    }
+  } else {
+    for (uint32_t cluster = first; cluster < first + count; ++cluster) {
+      while ((entry = fat32_cluster_cache_lookup(cache, cluster)) != NULL &&
+             (entry->refs != 0 || entry->loading)) {
+        assert( pthread_cond_wait(&cache->changed, &cache->lock) == 0 );
+      }
+
+      if (entry != NULL) {
+        fat32_cluster_cache_drop(cache, entry);
+      }
+    }
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+/**
+ * Compares cache entries by cluster number. Used to sort dirty entries.
+ */
+static int
+fat32_cluster_cache_entry_compare(const void *a, const void *b)
+{
+  const struct fat32_cluster_cache_entry_t *x =
+    *(const struct fat32_cluster_cache_entry_t * const *) a;
+  const struct fat32_cluster_cache_entry_t *y =
+    *(const struct fat32_cluster_cache_entry_t * const *) b;
+
+  if (x->cluster < y->cluster) {
+    return -1;
+  } else if (x->cluster > y->cluster) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * Writes dirty entries which are not pinned to the device. Runs of adjacent
+ * clusters are written by a single vectored write which starts at the
+ * modified range of the first cluster and ends at the modified range of the
+ * last one. A single cluster costs a write of its modified range only.
+ *
+ * @param      cache   Cache.
+ * @param[out] written A number of written clusters.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+static enum fat32_error_t
+fat32_cluster_cache_sync_unpinned(struct fat32_cluster_cache_t *cache,
+                                  uint32_t *written)
+{
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < cache->size; ++i) {
+    struct fat32_cluster_cache_entry_t *entry = &cache->entries[i];
+
+    if (entry->dirty && entry->refs == 0) {
+      cache->dirty[count++] = entry;
+    }
+  }
+
+  qsort(cache->dirty, count, sizeof(struct fat32_cluster_cache_entry_t *),
+        fat32_cluster_cache_entry_compare);
+
+  struct iovec iov[FAT32_CLUSTER_CACHE_MAX_IOV];
+
+  for (uint32_t i = 0; i < count; ) {
+    const struct fat32_cluster_cache_entry_t *first = cache->dirty[i];
+    int iovcnt = 0;
+
+    /* unmodified parts inside the run are written too: one request is
+     * cheaper than several smaller ones */
+    while (i + iovcnt < count && iovcnt < FAT32_CLUSTER_CACHE_MAX_IOV &&
+           cache->dirty[i + iovcnt]->cluster == first->cluster + iovcnt) {
+      iov[iovcnt].iov_base = cache->dirty[i + iovcnt]->data;
+      iov[iovcnt].iov_len  = cache->cluster_size;
+      ++iovcnt;
+    }
+
+    const struct fat32_cluster_cache_entry_t *last =
+      cache->dirty[i + iovcnt - 1];
+
+    iov[iovcnt - 1].iov_len  = last->dirty_end;
+    iov[0].iov_base          = first->data + first->dirty_first;
+    iov[0].iov_len          -= first->dirty_first;
+
+    enum fat32_error_t ret =
+      fat32_dev_writev(cache->dev, iov, iovcnt,
+                       fat32_cluster_to_offset(cache->bpb, first->cluster) +
+                       first->dirty_first);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    for (int j = 0; j < iovcnt; ++j, ++i) {
+      cache->dirty[i]->dirty = false;
+      --cache->dirty_count;
+    }
+  }
+
+  *written = count;
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_cluster_cache_sync(struct fat32_cluster_cache_t *cache)
+{
+  enum fat32_error_t ret = FE_OK;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  while (cache->dirty_count != 0) {
+    uint32_t written;
+
+    ret = fat32_cluster_cache_sync_unpinned(cache, &written);
+    if (ret != FE_OK) {
+      break;
+    }
+
+    if (written == 0) {
+      /* the rest of dirty entries are being modified right now */
+      assert( pthread_cond_wait(&cache->changed, &cache->lock) == 0 );
+    }
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
+}
+
+void
+fat32_cluster_cache_stats(struct fat32_cluster_cache_t *cache,
+                          uint64_t *hits, uint64_t *misses)
+{
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  *hits   = cache->hits;
+  *misses = cache->misses;
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+/**
+ * Reserves cache entries for a run of adjacent clusters which are not cached
+ * yet. Clusters are inserted into the cache as being loaded so that readers
+ * wait for them instead of reading them once more. Cached clusters at the
+ * start of the run are skipped. Must be called with cache lock held.
+ *
+ * @param      cache    Cache.
+ * @param      first    The first cluster of the run.
+ * @param      count    A number of clusters in the run.
+ * @param[out] reserved The first reserved cluster.
+ *
+ * @return A number of reserved clusters.
+ */
+static uint32_t
+fat32_cluster_cache_reserve(struct fat32_cluster_cache_t *cache,
+                            uint32_t first, uint32_t count,
+                            uint32_t *reserved)
+{
+  while (count > 0 && fat32_cluster_cache_lookup(cache, first) != NULL) {
+    ++first;
+    --count;
+  }
+
+  uint32_t n = 0;
+  while (n < count && n < FAT32_CLUSTER_CACHE_MAX_IOV &&
+         fat32_cluster_cache_lookup(cache, first + n) == NULL) {
+    struct fat32_cluster_cache_entry_t *entry;
+
+    /* a victim which can't be written back stops prefetching */
+    if (fat32_cluster_cache_reclaim(cache, &entry) != FE_OK ||
+        entry == NULL) {
+      break;
+    }
+
+    fat32_cluster_cache_insert(cache, entry, first + n);
+    entry->loading = true;
+    ++n;
+  }
+
+  *reserved = first;
+
+  return n;
+}
+
+/**
+ * Reads a run of reserved clusters. Must be called with cache lock held.
+ * The lock is released while reading.
+ *
+ * @param cache Cache.
+ * @param run   The run reserved by ::fat32_cluster_cache_reserve.
+ */
+static void
+fat32_cluster_cache_load(struct fat32_cluster_cache_t *cache,
+                         struct fat32_cluster_cache_run_t run)
+{
+  struct fat32_cluster_cache_entry_t *entries[FAT32_CLUSTER_CACHE_MAX_IOV];
+  struct iovec                        iov[FAT32_CLUSTER_CACHE_MAX_IOV];
+
+  for (uint32_t i = 0; i < run.count; ++i) {
+    /* reserved entries can't be evicted or invalidated while loading */
+    entries[i] = fat32_cluster_cache_lookup(cache, run.first + i);
+    assert( entries[i] != NULL && entries[i]->loading );
+
+    iov[i].iov_base = entries[i]->data;
+    iov[i].iov_len  = cache->cluster_size;
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  enum fat32_error_t ret =
+    fat32_dev_readv(cache->dev, iov, run.count,
+                    fat32_cluster_to_offset(cache->bpb, run.first));
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  for (uint32_t i = 0; i < run.count; ++i) {
+    entries[i]->loading = false;
+
+    /* failed prefetching is not an error: clusters are read on demand */
+    if (ret != FE_OK) {
+      fat32_cluster_cache_drop(cache, entries[i]);
+    }
+  }
+
+  assert( pthread_cond_broadcast(&cache->changed) == 0 );
+}
+
+/**
+ * Prefetch thread function.
+ *
+ * @param arg Cache.
+ *
+ * @return Always NULL.
+ */
+static void *
+fat32_cluster_cache_prefetch_thread(void *arg)
+{
+  struct fat32_cluster_cache_t *cache = arg;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  while (true) {
+    while (!cache->prefetch_stop && cache->prefetch_count == 0) {
+      assert( pthread_cond_wait(&cache->prefetch_wakeup,
+                                &cache->lock) == 0 );
+    }
+
+    /* reserved runs are loaded even when stopping so that no entry is left
+     * in loading state */
+    if (cache->prefetch_count == 0) {
+      break;
+    }
+
+    struct fat32_cluster_cache_run_t run =
+      cache->prefetch_queue[cache->prefetch_head];
+
+    cache->prefetch_head =
+      (cache->prefetch_head + 1) % FAT32_CLUSTER_CACHE_PREFETCH_QUEUE;
+    --cache->prefetch_count;
+
+    fat32_cluster_cache_load(cache, run);
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return NULL;
+}
+
+enum fat32_error_t
+fat32_cluster_cache_prefetch_start(struct fat32_cluster_cache_t *cache)
+{
+  /* mapped images are prefetched by the kernel */
+  if (cache->prefetching || cache->dev->map != NULL) {
+    return FE_OK;
+  }
+
+  cache->prefetch_stop  = false;
+  cache->prefetch_head  = 0;
+  cache->prefetch_count = 0;
+
+  int ret = pthread_cond_init(&cache->prefetch_wakeup, NULL);
+  if (ret != 0) {
+    errno = ret;
+    return FE_ERRNO;
+  }
+
+  ret = pthread_create(&cache->prefetch_thread, NULL,
+                       fat32_cluster_cache_prefetch_thread, cache);
+  if (ret != 0) {
+    pthread_cond_destroy(&cache->prefetch_wakeup);
+    errno = ret;
+    return FE_ERRNO;
+  }
+
+  cache->prefetching = true;
+
+  return FE_OK;
+}
+
+void
+fat32_cluster_cache_prefetch_stop(struct fat32_cluster_cache_t *cache)
+{
+  if (!cache->prefetching) {
+    return;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+  cache->prefetch_stop = true;
+  assert( pthread_cond_signal(&cache->prefetch_wakeup) == 0 );
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  assert( pthread_join(cache->prefetch_thread, NULL) == 0 );
+
+  pthread_cond_destroy(&cache->prefetch_wakeup);
+  cache->prefetching = false;
+}
+
+void
+fat32_cluster_cache_prefetch(struct fat32_cluster_cache_t *cache,
+                             uint32_t first, uint32_t count)
+{
+  if (cache->dev->map != NULL) {
+    fat32_dev_advise(cache->dev, fat32_cluster_to_offset(cache->bpb, first),
+                     (size_t) count * cache->cluster_size);
+    return;
+  }
+
+  if (!cache->prefetching || count == 0) {
+    return;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  /* when the device can't keep up the rest of the run is dropped */
+  while (count > 0 &&
+         cache->prefetch_count < FAT32_CLUSTER_CACHE_PREFETCH_QUEUE) {
+    uint32_t reserved;
+    uint32_t n = fat32_cluster_cache_reserve(cache, first, count, &reserved);
+
+    if (n == 0) {
+      break;
+    }
+
+    uint32_t tail = (cache->prefetch_head + cache->prefetch_count) %
+      FAT32_CLUSTER_CACHE_PREFETCH_QUEUE;
+
+    cache->prefetch_queue[tail].first = reserved;
+    cache->prefetch_queue[tail].count = n;
+    ++cache->prefetch_count;
+
+    count -= reserved + n - first;
+    first  = reserved + n;
+  }
+
+  assert( pthread_cond_signal(&cache->prefetch_wakeup) == 0 );
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+uint32_t
+fat32_cluster_cache_prefetch_limit(const struct fat32_cluster_cache_t *cache)
+{
+  /* prefetched clusters get into A1in; the window must fit in a half of it
+   * so that clusters are not evicted before they are read */
+  if (cache->dev->map != NULL) {
+    return UINT32_MAX;
+  }
+
+  return cache->a1in_max / 2;
+}
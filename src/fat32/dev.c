@@ -0,0 +1,1085 @@
+/**
+ * @file   dev.c
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:18:54 2026
+ *
+ * @brief  Implementation of device access functions.
+ *
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#ifdef FAT32_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "utils/files.h"
+#include "utils/log.h"
+
+#include "fat32/dev.h"
+
+/// size of a bounce buffer used for unaligned direct I/O
+#define FAT32_DEV_POOL_BUFFER_SIZE (128 * 1024)
+
+/// maximum number of idle bounce buffers kept in the pool
+#define FAT32_DEV_POOL_SIZE 16
+
+/// pool of aligned bounce buffers
+struct fat32_dev_pool_t {
+  pthread_mutex_t lock;         /**< lock protecting the pool */
+  pthread_mutex_t partial;      /**< lock serializing writes of partial
+                                   blocks which are read first */
+  uint8_t *buffers[FAT32_DEV_POOL_SIZE]; /**< idle buffers */
+  uint32_t count;               /**< a number of idle buffers */
+};
+
+#ifdef FAT32_IO_URING
+/// io_uring instance used by a single thread
+struct fat32_dev_ring_t {
+  int fd;                       /**< file descriptor of the ring */
+
+  void    *sq_ring;             /**< mapped submission queue ring */
+  size_t   sq_ring_size;        /**< size of the mapping */
+  unsigned *sq_tail;            /**< submission queue tail */
+  unsigned *sq_mask;            /**< submission queue index mask */
+  unsigned *sq_array;           /**< submission queue indirection array */
+
+  struct io_uring_sqe *sqes;    /**< mapped submission queue entries */
+  size_t               sqes_size; /**< size of the mapping */
+
+  void                *cq_ring; /**< mapped completion queue ring */
+  size_t               cq_ring_size; /**< size of the mapping */
+  unsigned            *cq_head; /**< completion queue head */
+  unsigned            *cq_tail; /**< completion queue tail */
+  unsigned            *cq_mask; /**< completion queue index mask */
+  struct io_uring_cqe *cqes;    /**< completion queue entries */
+};
+
+/**
+ * Unmaps and closes a ring.
+ *
+ * @param ring A ring. May be NULL.
+ */
+static void
+fat32_dev_ring_free(struct fat32_dev_ring_t *ring)
+{
+  if (ring == NULL) {
+    return;
+  }
+
+  if (ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+
+  if (ring->cq_ring != MAP_FAILED) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+
+  if (ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+
+  if (ring->fd != -1) {
+    close(ring->fd);
+  }
+
+  free(ring);
+}
+
+/**
+ * Thread specific data destructor.
+ *
+ * @param ring A ring of the exiting thread.
+ */
+static void
+fat32_dev_ring_destructor(void *ring)
+{
+  fat32_dev_ring_free((struct fat32_dev_ring_t *) ring);
+}
+
+/**
+ * Creates a ring big enough to hold #FAT32_DEV_BATCH_SIZE requests.
+ *
+ * @return New ring or NULL on error. Error is specified using @em errno.
+ */
+static struct fat32_dev_ring_t *
+fat32_dev_ring_create(void)
+{
+  struct fat32_dev_ring_t *ring = malloc(sizeof(struct fat32_dev_ring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+
+  ring->sq_ring = MAP_FAILED;
+  ring->cq_ring = MAP_FAILED;
+  ring->sqes    = MAP_FAILED;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = syscall(__NR_io_uring_setup, FAT32_DEV_BATCH_SIZE, &params);
+  if (ring->fd < 0) {
+    goto cleanup;
+  }
+
+  ring->sq_ring_size = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned);
+  ring->sq_ring      = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    goto cleanup;
+  }
+
+  ring->cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->cq_ring      = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+  if (ring->cq_ring == MAP_FAILED) {
+    goto cleanup;
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes      = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    goto cleanup;
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+
+  ring->sq_tail  = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask  = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->cq_head  = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail  = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask  = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes     = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return ring;
+
+cleanup:
+  {
+    int error = errno;
+    fat32_dev_ring_free(ring);
+    errno = error;
+  }
+  return NULL;
+}
+
+/**
+ * Returns a ring of the calling thread creating it if needed.
+ *
+ * @param dev Device.
+ *
+ * @return A ring or NULL if it can't be created.
+ */
+static struct fat32_dev_ring_t *
+fat32_dev_ring_get(const struct fat32_dev_t *dev)
+{
+  struct fat32_dev_ring_t *ring = pthread_getspecific(dev->rings);
+
+  if (ring == NULL) {
+    ring = fat32_dev_ring_create();
+    if (ring != NULL && pthread_setspecific(dev->rings, ring) != 0) {
+      fat32_dev_ring_free(ring);
+      ring = NULL;
+    }
+  }
+
+  return ring;
+}
+
+/**
+ * Submits a batch of reads to the ring and waits for all of them to
+ * complete. Short reads are finished using ::fat32_dev_read.
+ *
+ * @param dev      Device.
+ * @param ring     A ring of the calling thread.
+ * @param requests Requests.
+ * @param count    A number of requests.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+static enum fat32_error_t
+fat32_dev_ring_read(const struct fat32_dev_t *dev,
+                    struct fat32_dev_ring_t *ring,
+                    const struct fat32_dev_request_t *requests,
+                    unsigned int count)
+{
+  struct iovec iov[count];
+  unsigned     tail = *ring->sq_tail;
+
+  for (unsigned int i = 0; i < count; ++i) {
+    unsigned             index = (tail + i) & *ring->sq_mask;
+    struct io_uring_sqe *sqe   = &ring->sqes[index];
+
+    iov[i].iov_base = requests[i].buffer;
+    iov[i].iov_len  = requests[i].size;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode    = IORING_OP_READV;
+    sqe->fd        = dev->fd;
+    sqe->off       = dev->base + requests[i].offset;
+    sqe->addr      = (unsigned long) &iov[i];
+    sqe->len       = 1;
+    sqe->user_data = i;
+
+    ring->sq_array[index] = index;
+  }
+
+  /* entries must be visible to the kernel before the tail is */
+  __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+  enum fat32_error_t ret       = FE_OK;
+  int                error     = 0;
+  unsigned int       submitted = 0;
+  unsigned int       completed = 0;
+
+  while (completed < count) {
+    int nsubmitted = syscall(__NR_io_uring_enter, ring->fd,
+                             count - submitted, count - completed,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+    if (nsubmitted < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+
+      if (ret == FE_OK) {
+        ret   = FE_ERRNO;
+        error = errno;
+      }
+
+      /* requests which have not been submitted yet are withdrawn; the
+       * submitted ones refer to @em iov and to the buffers and must be
+       * completed before returning, otherwise the kernel may write to
+       * freed memory and their completions would be taken for the ones of
+       * the next batch */
+      if (submitted != count) {
+        __atomic_store_n(ring->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+        count = submitted;
+      }
+      continue;
+    }
+    submitted += nsubmitted;
+
+    unsigned head = *ring->cq_head;
+    unsigned end  = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != end; ++head, ++completed) {
+      struct io_uring_cqe              *cqe     =
+        &ring->cqes[head & *ring->cq_mask];
+      const struct fat32_dev_request_t *request = &requests[cqe->user_data];
+
+      if (ret != FE_OK) {
+        continue;
+      }
+
+      if (cqe->res < 0) {
+        ret   = FE_ERRNO;
+        error = -cqe->res;
+      } else if (cqe->res < request->size) {
+        ret = fat32_dev_read(dev, (char *) request->buffer + cqe->res,
+                             request->size - cqe->res,
+                             request->offset + cqe->res);
+        error = errno;
+      }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  if (ret == FE_ERRNO) {
+    errno = error;
+  }
+
+  return ret;
+}
+#endif
+
+/**
+ * Skips completely processed buffers and adjusts the first partially
+ * processed one.
+ *
+ * @param[in,out] iov    Buffers.
+ * @param[in,out] iovcnt A number of buffers.
+ * @param         done   A number of bytes processed.
+ */
+static void
+fat32_dev_iov_advance(struct iovec **iov, int *iovcnt, size_t done)
+{
+  while (*iovcnt > 0 && done >= (*iov)->iov_len) {
+    done -= (*iov)->iov_len;
+    ++*iov;
+    --*iovcnt;
+  }
+
+  if (*iovcnt > 0) {
+    (*iov)->iov_base  = (char *) (*iov)->iov_base + done;
+    (*iov)->iov_len  -= done;
+  }
+}
+
+void *
+fat32_dev_alloc(size_t size)
+{
+  void *memory;
+  int   ret = posix_memalign(&memory, FAT32_DEV_ALIGNMENT, size);
+
+  if (ret != 0) {
+    errno = ret;
+    return NULL;
+  }
+
+  return memory;
+}
+
+/**
+ * Takes a bounce buffer from the pool. New buffer is allocated if there are
+ * no idle ones.
+ *
+ * @param pool Pool.
+ *
+ * @return A buffer of #FAT32_DEV_POOL_BUFFER_SIZE bytes or NULL on error.
+ */
+static uint8_t *
+fat32_dev_pool_get(struct fat32_dev_pool_t *pool)
+{
+  uint8_t *buffer = NULL;
+
+  assert( pthread_mutex_lock(&pool->lock) == 0 );
+  if (pool->count != 0) {
+    buffer = pool->buffers[--pool->count];
+  }
+  assert( pthread_mutex_unlock(&pool->lock) == 0 );
+
+  if (buffer == NULL) {
+    buffer = fat32_dev_alloc(FAT32_DEV_POOL_BUFFER_SIZE);
+  }
+
+  return buffer;
+}
+
+/**
+ * Returns a bounce buffer to the pool.
+ *
+ * @param pool   Pool.
+ * @param buffer A buffer obtained by ::fat32_dev_pool_get.
+ */
+static void
+fat32_dev_pool_put(struct fat32_dev_pool_t *pool, uint8_t *buffer)
+{
+  assert( pthread_mutex_lock(&pool->lock) == 0 );
+  if (pool->count < FAT32_DEV_POOL_SIZE) {
+    pool->buffers[pool->count++] = buffer;
+    buffer = NULL;
+  }
+  assert( pthread_mutex_unlock(&pool->lock) == 0 );
+
+  free(buffer);
+}
+
+/**
+ * Frees the pool and all the idle buffers.
+ *
+ * @param pool Pool. May be NULL.
+ */
+static void
+fat32_dev_pool_free(struct fat32_dev_pool_t *pool)
+{
+  if (pool == NULL) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < pool->count; ++i) {
+    free(pool->buffers[i]);
+  }
+
+  pthread_mutex_destroy(&pool->partial);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/**
+ * Prepares the device for direct I/O: determines the required alignment and
+ * creates a pool of bounce buffers.
+ *
+ * @param dev Device opened with @em O_DIRECT.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+static enum fat32_error_t
+fat32_dev_direct_init(struct fat32_dev_t *dev)
+{
+  struct stat stat;
+  int         block_size;
+
+  if (fstat(dev->fd, &stat) < 0) {
+    return FE_ERRNO;
+  }
+
+  /* the largest block size any device can require is assumed when it can't
+   * be asked for it */
+  dev->alignment = FAT32_DEV_ALIGNMENT;
+  if (S_ISBLK(stat.st_mode) && ioctl(dev->fd, BLKSSZGET, &block_size) == 0 &&
+      block_size > 0 && FAT32_DEV_ALIGNMENT % block_size == 0) {
+    dev->alignment = block_size;
+  }
+
+  dev->pool = malloc(sizeof(struct fat32_dev_pool_t));
+  if (dev->pool == NULL) {
+    return FE_ERRNO;
+  }
+
+  dev->pool->count = 0;
+
+  int ret = pthread_mutex_init(&dev->pool->lock, NULL);
+  if (ret != 0) {
+    free(dev->pool);
+    dev->pool = NULL;
+
+    errno = ret;
+    return FE_ERRNO;
+  }
+
+  ret = pthread_mutex_init(&dev->pool->partial, NULL);
+  if (ret != 0) {
+    pthread_mutex_destroy(&dev->pool->lock);
+    free(dev->pool);
+    dev->pool = NULL;
+
+    errno = ret;
+    return FE_ERRNO;
+  }
+
+  return FE_OK;
+}
+
+/**
+ * Checks whether a request can be passed to the device as is.
+ *
+ * @param dev    Device.
+ * @param buffer Request buffer.
+ * @param size   Request size.
+ * @param offset Request offset.
+ *
+ * @return @em true if the device is not opened for direct I/O or request is
+ *         properly aligned.
+ */
+static bool
+fat32_dev_is_aligned(const struct fat32_dev_t *dev,
+                     const void *buffer, size_t size, off_t offset)
+{
+  if (!dev->direct) {
+    return true;
+  }
+
+  uintptr_t mask = dev->alignment - 1;
+
+  return (((uintptr_t) buffer | size | (uintptr_t) offset) & mask) == 0;
+}
+
+/**
+ * Reads data from the device opened for direct I/O through bounce buffer.
+ * Enclosing device blocks are read and the requested part is copied to the
+ * caller's buffer.
+ *
+ * @param dev    Device.
+ * @param buffer A buffer to store read data.
+ * @param size   A number of bytes to read.
+ * @param offset An offset on the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+static enum fat32_error_t
+fat32_dev_read_bounced(const struct fat32_dev_t *dev,
+                       void *buffer, size_t size, off_t offset)
+{
+  uint8_t *bounce = fat32_dev_pool_get(dev->pool);
+  if (bounce == NULL) {
+    return FE_ERRNO;
+  }
+
+  enum fat32_error_t ret  = FE_OK;
+  off_t              mask = dev->alignment - 1;
+
+  while (size > 0) {
+    off_t  start = offset & ~mask;
+    size_t head  = offset - start;
+    size_t span  = (head + size + mask) & ~mask;
+    if (span > FAT32_DEV_POOL_BUFFER_SIZE) {
+      span = FAT32_DEV_POOL_BUFFER_SIZE;
+    }
+    size_t piece = (span - head > size) ? size : span - head;
+
+    ssize_t nread = xpread(dev->fd, bounce, span, dev->base + start);
+    if (nread == -1) {
+      ret = FE_ERRNO;
+      break;
+    } else if (nread < head + piece) {
+      ret = FE_INVALID_DEV;
+      break;
+    }
+
+    memcpy(buffer, bounce + head, piece);
+
+    buffer  = (uint8_t *) buffer + piece;
+    offset += piece;
+    size   -= piece;
+  }
+
+  fat32_dev_pool_put(dev->pool, bounce);
+
+  return ret;
+}
+
+/**
+ * Writes data to the device opened for direct I/O through bounce buffer.
+ * Partially overwritten device blocks are read first.
+ *
+ * @param dev    Device.
+ * @param buffer Data to write.
+ * @param size   A number of bytes to write.
+ * @param offset An offset on the device.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV device ended prematurely
+ */
+static enum fat32_error_t
+fat32_dev_write_bounced(const struct fat32_dev_t *dev,
+                        const void *buffer, size_t size, off_t offset)
+{
+  uint8_t *bounce = fat32_dev_pool_get(dev->pool);
+  if (bounce == NULL) {
+    return FE_ERRNO;
+  }
+
+  enum fat32_error_t ret  = FE_OK;
+  off_t              mask = dev->alignment - 1;
+
+  while (size > 0) {
+    off_t  start = offset & ~mask;
+    size_t head  = offset - start;
+    size_t span  = (head + size + mask) & ~mask;
+    if (span > FAT32_DEV_POOL_BUFFER_SIZE) {
+      span = FAT32_DEV_POOL_BUFFER_SIZE;
+    }
+    size_t piece = (span - head > size) ? size : span - head;
+    size_t tail  = head + piece;
+
+    /* other parts of the same block may be written by another thread
+     * meanwhile and must not be overwritten by stale data */
+    bool partial = (head != 0 || (tail & mask) != 0);
+    if (partial) {
+      assert( pthread_mutex_lock(&dev->pool->partial) == 0 );
+    }
+
+    if (head != 0) {
+      ret = fat32_dev_read(dev, bounce, dev->alignment, start);
+    }
+
+    if (ret == FE_OK && (tail & mask) != 0) {
+      size_t last = tail & ~mask;
+
+      ret = fat32_dev_read(dev, bounce + last, dev->alignment, start + last);
+    }
+
+    if (ret == FE_OK) {
+      memcpy(bounce + head, buffer, piece);
+
+      ret = fat32_dev_write(dev, bounce, span, start);
+    }
+
+    if (partial) {
+      assert( pthread_mutex_unlock(&dev->pool->partial) == 0 );
+    }
+
+    if (ret != FE_OK) {
+      break;
+    }
+
+    buffer  = (const uint8_t *) buffer + piece;
+    offset += piece;
+    size   -= piece;
+  }
+
+  fat32_dev_pool_put(dev->pool, bounce);
+
+  return ret;
+}
+
+/**
+ * Checks whether all the buffers of vectored request can be passed to the
+ * device as is.
+ *
+ * @param dev    Device.
+ * @param iov    Buffers.
+ * @param iovcnt A number of buffers.
+ * @param offset Request offset.
+ *
+ * @return @em true if the request is properly aligned.
+ */
+static bool
+fat32_dev_iov_is_aligned(const struct fat32_dev_t *dev,
+                         const struct iovec *iov, int iovcnt, off_t offset)
+{
+  for (int i = 0; i < iovcnt; ++i) {
+    if (!fat32_dev_is_aligned(dev, iov[i].iov_base, iov[i].iov_len, offset)) {
+      return false;
+    }
+
+    offset += iov[i].iov_len;
+  }
+
+  return true;
+}
+
+/**
+ * Maps the whole image file into memory. Failure is not fatal: the device
+ * is accessed using ordinary reads then.
+ *
+ * @param dev Device which is a regular file.
+ * @param size Size of the file.
+ */
+static void
+fat32_dev_map_file(struct fat32_dev_t *dev, off_t size)
+{
+  if (size <= 0 || (uintmax_t) size > SIZE_MAX) {
+    return;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   dev->fd, 0);
+  if (map == MAP_FAILED) {
+    log_warning("Can't map the image (%s). Falling back to pread.",
+                strerror(errno));
+    return;
+  }
+
+  dev->map      = map;
+  dev->map_size = size;
+
+  /* most accesses touch a few metadata blocks; data reads ask for their
+   * ranges explicitly using ::fat32_dev_advise */
+  madvise(dev->map, dev->map_size, MADV_RANDOM);
+}
+
+enum fat32_error_t
+fat32_dev_open(struct fat32_dev_t *dev, const char *path, bool direct)
+{
+  struct stat stat;
+
+  dev->direct    = direct;
+  dev->alignment = 1;
+  dev->pool      = NULL;
+  dev->map       = NULL;
+  dev->map_size  = 0;
+  dev->base      = 0;
+  dev->size      = 0;
+
+  dev->fd = xopen(path, O_RDWR | (direct ? O_DIRECT : 0));
+  if (dev->fd < 0) {
+    return FE_ERRNO;
+  }
+
+  if (direct && fat32_dev_direct_init(dev) != FE_OK) {
+    int error = errno;
+
+    xclose(dev->fd);
+    dev->fd = -1;
+
+    errno = error;
+    return FE_ERRNO;
+  }
+
+  /* direct I/O is asked for to bypass the page cache which a mapping is
+   * served from */
+  if (!direct && fstat(dev->fd, &stat) == 0 && S_ISREG(stat.st_mode)) {
+    fat32_dev_map_file(dev, stat.st_size);
+  }
+
+#ifdef FAT32_IO_URING
+  int ret = pthread_key_create(&dev->rings, fat32_dev_ring_destructor);
+  if (ret != 0) {
+    if (dev->map != NULL) {
+      munmap(dev->map, dev->map_size);
+    }
+    fat32_dev_pool_free(dev->pool);
+    xclose(dev->fd);
+    dev->fd = -1;
+
+    errno = ret;
+    return FE_ERRNO;
+  }
+
+  /* the ring of the mounting thread is created to check kernel support */
+  dev->uring = true;
+  if (fat32_dev_ring_get(dev) == NULL) {
+    log_warning("io_uring is not available (%s). Falling back to pread.",
+                strerror(errno));
+    dev->uring = false;
+  }
+#endif
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_dev_close(struct fat32_dev_t *dev)
+{
+  if (dev->map != NULL) {
+    munmap(dev->map, dev->map_size);
+    dev->map      = NULL;
+    dev->map_size = 0;
+  }
+
+  if (xclose(dev->fd) < 0) {
+    return FE_ERRNO;
+  }
+
+  dev->fd = -1;
+
+  fat32_dev_pool_free(dev->pool);
+  dev->pool = NULL;
+
+#ifdef FAT32_IO_URING
+  /* rings of other threads are freed when those threads exit */
+  fat32_dev_ring_free(pthread_getspecific(dev->rings));
+  pthread_setspecific(dev->rings, NULL);
+  pthread_key_delete(dev->rings);
+#endif
+
+  return FE_OK;
+}
+
+/**
+ * Checks whether a request fits in the device window.
+ *
+ * @param dev    Device.
+ * @param offset Request offset.
+ * @param size   Request size.
+ *
+ * @return @em true if the request doesn't cross the end of the window or the
+ *         window is not limited.
+ */
+static bool
+fat32_dev_fits(const struct fat32_dev_t *dev, off_t offset, size_t size)
+{
+  return dev->size == 0 ||
+    (offset >= 0 && offset <= dev->size && size <= dev->size - offset);
+}
+
+/**
+ * Returns a total size of buffers.
+ */
+static size_t
+fat32_dev_iov_size(const struct iovec *iov, int iovcnt)
+{
+  size_t size = 0;
+
+  for (int i = 0; i < iovcnt; ++i) {
+    size += iov[i].iov_len;
+  }
+
+  return size;
+}
+
+enum fat32_error_t
+fat32_dev_read(const struct fat32_dev_t *dev,
+               void *buffer, size_t size, off_t offset)
+{
+  /* data following the partition does not belong to the file system */
+  if (!fat32_dev_fits(dev, offset, size)) {
+    return FE_INVALID_DEV;
+  }
+
+  const uint8_t *mapped = fat32_dev_map(dev, offset, size);
+  if (mapped != NULL) {
+    memcpy(buffer, mapped, size);
+    return FE_OK;
+  }
+
+  if (!fat32_dev_is_aligned(dev, buffer, size, offset)) {
+    return fat32_dev_read_bounced(dev, buffer, size, offset);
+  }
+
+  ssize_t nread = xpread(dev->fd, buffer, size, dev->base + offset);
+
+  if (nread == -1) {
+    return FE_ERRNO;
+  } else if (nread < size) {
+    return FE_INVALID_DEV;
+  }
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_dev_readv(const struct fat32_dev_t *dev,
+                const struct iovec *iov, int iovcnt, off_t offset)
+{
+  if (dev->map != NULL || !fat32_dev_iov_is_aligned(dev, iov, iovcnt, offset)) {
+    /* buffers are read one by one copying them from the mapping or bouncing
+     * unaligned ones */
+    for (int i = 0; i < iovcnt; ++i) {
+      enum fat32_error_t ret = fat32_dev_read(dev, iov[i].iov_base,
+                                              iov[i].iov_len, offset);
+      if (ret != FE_OK) {
+        return ret;
+      }
+
+      offset += iov[i].iov_len;
+    }
+
+    return FE_OK;
+  }
+
+  if (!fat32_dev_fits(dev, offset, fat32_dev_iov_size(iov, iovcnt))) {
+    return FE_INVALID_DEV;
+  }
+
+  /* buffers array is modified while advancing through it */
+  struct iovec  work[iovcnt];
+  struct iovec *current = work;
+
+  memcpy(work, iov, sizeof(work));
+
+  while (iovcnt > 0) {
+    ssize_t nread = preadv(dev->fd, current, iovcnt, dev->base + offset);
+
+    if (nread < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return FE_ERRNO;
+    } else if (nread == 0) {
+      return FE_INVALID_DEV;
+    }
+
+    offset += nread;
+    fat32_dev_iov_advance(&current, &iovcnt, nread);
+  }
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_dev_read_batch(const struct fat32_dev_t *dev,
+                     const struct fat32_dev_request_t *requests,
+                     unsigned int count)
+{
+  assert( count <= FAT32_DEV_BATCH_SIZE );
+
+#ifdef FAT32_IO_URING
+  bool aligned = (dev->map == NULL);
+  for (unsigned int i = 0; i < count && aligned; ++i) {
+    aligned = fat32_dev_is_aligned(dev, requests[i].buffer,
+                                   requests[i].size, requests[i].offset) &&
+              fat32_dev_fits(dev, requests[i].offset, requests[i].size);
+  }
+
+  /* a single request gains nothing from the ring; unaligned direct requests
+   * need bounce buffers; mapped images are copied from memory; requests
+   * crossing the end of the partition are failed by the loop below */
+  if (dev->uring && count > 1 && aligned) {
+    struct fat32_dev_ring_t *ring = fat32_dev_ring_get(dev);
+
+    if (ring != NULL) {
+      return fat32_dev_ring_read(dev, ring, requests, count);
+    }
+  }
+#endif
+
+  for (unsigned int i = 0; i < count; ++i) {
+    enum fat32_error_t ret = fat32_dev_read(dev, requests[i].buffer,
+                                            requests[i].size,
+                                            requests[i].offset);
+    if (ret != FE_OK) {
+      return ret;
+    }
+  }
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_dev_write(const struct fat32_dev_t *dev,
+                const void *buffer, size_t size, off_t offset)
+{
+  if (!fat32_dev_is_aligned(dev, buffer, size, offset)) {
+    return fat32_dev_write_bounced(dev, buffer, size, offset);
+  }
+
+  struct iovec iov = { .iov_base = (void *) buffer, .iov_len = size };
+
+  return fat32_dev_writev(dev, &iov, 1, offset);
+}
+
+enum fat32_error_t
+fat32_dev_writev(const struct fat32_dev_t *dev,
+                 const struct iovec *iov, int iovcnt, off_t offset)
+{
+  if (!fat32_dev_iov_is_aligned(dev, iov, iovcnt, offset)) {
+    /* buffers are written one by one bouncing unaligned ones */
+    for (int i = 0; i < iovcnt; ++i) {
+      enum fat32_error_t ret = fat32_dev_write(dev, iov[i].iov_base,
+                                               iov[i].iov_len, offset);
+      if (ret != FE_OK) {
+        return ret;
+      }
+
+      offset += iov[i].iov_len;
+    }
+
+    return FE_OK;
+  }
+
+  if (!fat32_dev_fits(dev, offset, fat32_dev_iov_size(iov, iovcnt))) {
+    errno = ENOSPC;
+    return FE_ERRNO;
+  }
+
+  struct iovec  work[iovcnt];
+  struct iovec *current = work;
+
+  memcpy(work, iov, sizeof(work));
+
+  while (iovcnt > 0) {
+    ssize_t nwritten = pwritev(dev->fd, current, iovcnt,
+                               dev->base + offset);
+
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return FE_ERRNO;
+    } else if (nwritten == 0) {
+      /* nothing can be written: the device is full */
+      errno = ENOSPC;
+      return FE_ERRNO;
+    }
+
+    offset += nwritten;
+    fat32_dev_iov_advance(&current, &iovcnt, nwritten);
+  }
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_dev_sync(const struct fat32_dev_t *dev)
+{
+  /* some devices do not support synchronization at all */
+  if (fdatasync(dev->fd) < 0 && errno != EINVAL) {
+    return FE_ERRNO;
+  }
+
+  return FE_OK;
+}
+
+/**
+ * Returns a size of the mapped part of the window.
+ *
+ * @param dev Device.
+ *
+ * @return Zero if the device is not mapped.
+ */
+static size_t
+fat32_dev_map_limit(const struct fat32_dev_t *dev)
+{
+  if (dev->map == NULL || (uintmax_t) dev->base >= dev->map_size) {
+    return 0;
+  }
+
+  size_t limit = dev->map_size - dev->base;
+  if (dev->size != 0 && (uintmax_t) dev->size < limit) {
+    limit = dev->size;
+  }
+
+  return limit;
+}
+
+uint8_t *
+fat32_dev_map(const struct fat32_dev_t *dev, off_t offset, size_t size)
+{
+  size_t limit = fat32_dev_map_limit(dev);
+
+  if (offset < 0 || (uintmax_t) offset > limit ||
+      size > limit - (size_t) offset || limit == 0) {
+    return NULL;
+  }
+
+  return dev->map + dev->base + offset;
+}
+
+void
+fat32_dev_advise(const struct fat32_dev_t *dev, off_t offset, size_t size)
+{
+  size_t limit = fat32_dev_map_limit(dev);
+
+  if (offset < 0 || (uintmax_t) offset >= limit) {
+    return;
+  }
+
+  if (size > limit - (size_t) offset) {
+    size = limit - offset;
+  }
+
+  /* madvise wants page aligned address */
+  size_t page  = sysconf(_SC_PAGESIZE);
+  size_t first = (size_t) (dev->base + offset);
+  size_t start = first & ~(page - 1);
+
+  /* this is only a hint so errors are ignored */
+  madvise(dev->map + start, size + (first - start), MADV_WILLNEED);
+}
+
+enum fat32_error_t
+fat32_dev_set_window(struct fat32_dev_t *dev, off_t base, off_t size)
+{
+  /* bounced requests are aligned relative to the window */
+  if (base < 0 || size < 0 || (dev->direct && base % dev->alignment != 0)) {
+    errno = EINVAL;
+    return FE_ERRNO;
+  }
+
+  dev->base = base;
+  dev->size = size;
+
+  return FE_OK;
+}
+
+bool
+fat32_dev_file_offset(const struct fat32_dev_t *dev, off_t offset,
+                      size_t size, off_t *file_offset)
+{
+  if (dev->direct || offset < 0 || !fat32_dev_fits(dev, offset, size)) {
+    return false;
+  }
+
+  *file_offset = dev->base + offset;
+
+  return true;
+}
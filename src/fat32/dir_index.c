@@ -0,0 +1,637 @@
+/**
+ * @file   dir_index.c
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 11:02:45 2026
+ *
+ * @brief  Indexes of free directory entries implementation.
+ *
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hash_table.h"
+
+#include "fat32/cluster_cache.h"
+#include "fat32/dir_index.h"
+#include "fat32/direntry.h"
+#include "fat32/extent_map.h"
+#include "fat32/fs.h"
+
+/// Cache of directory indexes.
+struct fat32_dir_cache_t {
+  pthread_mutex_t      lock;    /**< lock serializing modifications of
+                                   directories */
+  struct hash_table_t *indexes; /**< indexes by the first cluster of a
+                                   directory */
+};
+
+/**
+ * Hash function on cluster numbers.
+ *
+ * @param cluster A pointer to cluster number.
+ *
+ * @return Hash value.
+ */
+static unsigned int
+fat32_dir_cluster_hash(const void *cluster)
+{
+  return *((const uint32_t *) cluster);
+}
+
+/**
+ * Equality function on cluster numbers.
+ *
+ * @param a A pointer to cluster number.
+ * @param b A pointer to cluster number.
+ *
+ * @return Result of comparison.
+ */
+static bool
+fat32_dir_cluster_equal(const void *a, const void *b)
+{
+  return *((const uint32_t *) a) == *((const uint32_t *) b);
+}
+
+/**
+ * Cloner for cluster numbers to use with hash tables.
+ *
+ * @param cluster A pointer to cluster number.
+ *
+ * @return Allocated copy. NULL on error.
+ */
+static void *
+fat32_dir_cluster_cloner(const void *cluster)
+{
+  uint32_t *result = malloc(sizeof(uint32_t));
+  if (result == NULL) {
+    return NULL;
+  }
+
+  *result = *((const uint32_t *) cluster);
+
+  return result;
+}
+
+/**
+ * Frees a directory index.
+ *
+ * @param index Index to free.
+ */
+static void
+fat32_dir_index_free(void *index)
+{
+  struct fat32_dir_index_t *dir_index = index;
+
+  free(dir_index->runs);
+  free(dir_index->names);
+  free(dir_index);
+}
+
+/**
+ * Folds the case of a short name. Only ASCII letters are folded.
+ *
+ * @param      name   Short name.
+ * @param[out] result Folded name.
+ */
+static void
+fat32_dir_name_fold(const uint8_t *name, struct fat32_dir_name_t *result)
+{
+  for (int i = 0; i < FAT32_DIRENTRY_NAME_SIZE; ++i) {
+    uint8_t c = name[i];
+
+    result->name[i] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+  }
+}
+
+/**
+ * Hash function on folded names (FNV-1a).
+ *
+ * @param name Folded name.
+ *
+ * @return Hash value.
+ */
+static uint32_t
+fat32_dir_name_hash(const struct fat32_dir_name_t *name)
+{
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < FAT32_DIRENTRY_NAME_SIZE; ++i) {
+    hash ^= name->name[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/**
+ * Finds a slot holding the name.
+ *
+ * @param index Directory index.
+ * @param name  Folded name.
+ *
+ * @return A number of the slot. #fat32_dir_index_t::names_capacity if the
+ *         name is not in the set.
+ */
+static uint32_t
+fat32_dir_names_find(const struct fat32_dir_index_t *index,
+                     const struct fat32_dir_name_t *name)
+{
+  if (index->names_count == 0) {
+    return index->names_capacity;
+  }
+
+  uint32_t mask = index->names_capacity - 1;
+
+  /* the set is never full so an empty slot ends the probing */
+  for (uint32_t i = fat32_dir_name_hash(name) & mask;
+       index->names[i].name[0] != 0; i = (i + 1) & mask) {
+    if (memcmp(index->names[i].name, name->name,
+               FAT32_DIRENTRY_NAME_SIZE) == 0) {
+      return i;
+    }
+  }
+
+  return index->names_capacity;
+}
+
+/**
+ * Puts the name to the first empty slot on its probing sequence. There must
+ * be room for it.
+ *
+ * @param names    Slots of the set.
+ * @param capacity A number of the slots.
+ * @param name     Folded name.
+ */
+static void
+fat32_dir_names_place(struct fat32_dir_name_t *names, uint32_t capacity,
+                      const struct fat32_dir_name_t *name)
+{
+  uint32_t mask = capacity - 1;
+  uint32_t i    = fat32_dir_name_hash(name) & mask;
+
+  while (names[i].name[0] != 0) {
+    i = (i + 1) & mask;
+  }
+
+  names[i] = *name;
+}
+
+/**
+ * Makes sure the set of names has room for one more name keeping it at most
+ * three quarters full.
+ *
+ * @param index Directory index.
+ *
+ * @return @em false if memory can't be allocated. The set is intact then.
+ */
+static bool
+fat32_dir_names_prepare(struct fat32_dir_index_t *index)
+{
+  if ((uint64_t) (index->names_count + 1) * 4 <=
+      (uint64_t) index->names_capacity * 3) {
+    return true;
+  }
+
+  uint32_t capacity =
+    (index->names_capacity == 0) ? 16 : index->names_capacity * 2;
+
+  struct fat32_dir_name_t *names =
+    calloc(capacity, sizeof(struct fat32_dir_name_t));
+  if (names == NULL) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < index->names_capacity; ++i) {
+    if (index->names[i].name[0] != 0) {
+      fat32_dir_names_place(names, capacity, &index->names[i]);
+    }
+  }
+
+  free(index->names);
+  index->names          = names;
+  index->names_capacity = capacity;
+
+  return true;
+}
+
+/**
+ * Adds the name to the set. The same name can be added several times. There
+ * must be room for it (see ::fat32_dir_names_prepare).
+ *
+ * @param index Directory index.
+ * @param name  Short name.
+ */
+static void
+fat32_dir_names_add(struct fat32_dir_index_t *index, const uint8_t *name)
+{
+  struct fat32_dir_name_t folded;
+  fat32_dir_name_fold(name, &folded);
+
+  assert( folded.name[0] != 0 );
+
+  fat32_dir_names_place(index->names, index->names_capacity, &folded);
+  ++index->names_count;
+}
+
+/**
+ * Removes one occurrence of the name from the set. Following names of the
+ * same probing sequence are shifted back so that no tombstones are needed.
+ *
+ * @param index Directory index.
+ * @param name  Short name.
+ */
+static void
+fat32_dir_names_remove(struct fat32_dir_index_t *index, const uint8_t *name)
+{
+  struct fat32_dir_name_t folded;
+  fat32_dir_name_fold(name, &folded);
+
+  uint32_t hole = fat32_dir_names_find(index, &folded);
+  if (hole == index->names_capacity) {
+    return;
+  }
+
+  uint32_t mask = index->names_capacity - 1;
+
+  for (uint32_t i = (hole + 1) & mask;
+       index->names[i].name[0] != 0; i = (i + 1) & mask) {
+    uint32_t home = fat32_dir_name_hash(&index->names[i]) & mask;
+
+    /* the name can't move if its home slot is between the hole and it */
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      index->names[hole] = index->names[i];
+      hole               = i;
+    }
+  }
+
+  index->names[hole].name[0] = 0;
+  --index->names_count;
+}
+
+/**
+ * Inserts a run into the index at the given position.
+ *
+ * @param index    Directory index.
+ * @param position A number of the run to insert before.
+ * @param first    The first entry of the run.
+ * @param length   A number of entries in the run.
+ *
+ * @return @em false if memory can't be allocated.
+ */
+static bool
+fat32_dir_index_insert(struct fat32_dir_index_t *index, uint32_t position,
+                       uint32_t first, uint32_t length)
+{
+  if (index->count == index->capacity) {
+    uint32_t capacity = (index->capacity == 0) ? 8 : index->capacity * 2;
+
+    struct fat32_dir_run_t *runs =
+      realloc(index->runs, capacity * sizeof(struct fat32_dir_run_t));
+    if (runs == NULL) {
+      return false;
+    }
+
+    index->runs     = runs;
+    index->capacity = capacity;
+  }
+
+  memmove(&index->runs[position + 1], &index->runs[position],
+          (index->count - position) * sizeof(struct fat32_dir_run_t));
+  index->runs[position].first  = first;
+  index->runs[position].length = length;
+  ++index->count;
+
+  if (length > index->longest) {
+    index->longest = length;
+  }
+
+  return true;
+}
+
+/**
+ * Builds an index of the directory reading all its clusters up to the end
+ * marker.
+ *
+ * @param      fs     File system.
+ * @param      map    Extent map of the directory.
+ * @param[out] result Built index is stored here on success.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_dir_index_build(const struct fat32_fs_t *fs,
+                      const struct fat32_extent_map_t *map,
+                      struct fat32_dir_index_t **result)
+{
+  uint32_t per_cluster = fs->cluster_size / sizeof(struct fat32_direntry_t);
+  enum fat32_error_t ret = FE_OK;
+
+  struct fat32_dir_index_t *index = malloc(sizeof(struct fat32_dir_index_t));
+  if (index == NULL) {
+    return FE_ERRNO;
+  }
+
+  index->first_cluster = map->first_cluster;
+  index->entries       = map->clusters * per_cluster;
+  index->end           = index->entries;
+  index->runs          = NULL;
+  index->count         = 0;
+  index->capacity      = 0;
+  index->longest       = 0;
+  index->names          = NULL;
+  index->names_count    = 0;
+  index->names_capacity = 0;
+
+  uint32_t run_first  = 0;
+  uint32_t run_length = 0;
+  bool     ended      = false;
+
+  for (uint32_t n = 0; n < map->clusters && !ended; ++n) {
+    uint32_t physical;
+    uint8_t *data;
+
+    assert( fat32_extent_map_lookup(map, n, &physical, NULL) );
+
+    ret = fat32_cluster_cache_get(fs->cluster_cache, physical, true, &data);
+    if (ret != FE_OK) {
+      goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < per_cluster; ++i) {
+      const struct fat32_direntry_t *direntry =
+        (const struct fat32_direntry_t *) data + i;
+      uint32_t entry = n * per_cluster + i;
+
+      if (fat32_direntry_is_last(direntry)) {
+        index->end = entry;
+        ended      = true;
+        break;
+      }
+
+      if (fat32_direntry_is_free(direntry)) {
+        if (run_length == 0) {
+          run_first = entry;
+        }
+        ++run_length;
+        continue;
+      }
+
+      if (run_length != 0) {
+        if (!fat32_dir_index_insert(index, index->count,
+                                    run_first, run_length)) {
+          fat32_cluster_cache_put(fs->cluster_cache, data, false);
+          ret = FE_ERRNO;
+          goto cleanup;
+        }
+        run_length = 0;
+      }
+
+      /* the same entries a directory iterator yields */
+      if (fat32_direntry_is_directory(direntry) ||
+          fat32_direntry_is_file(direntry)) {
+        if (!fat32_dir_names_prepare(index)) {
+          fat32_cluster_cache_put(fs->cluster_cache, data, false);
+          ret = FE_ERRNO;
+          goto cleanup;
+        }
+
+        fat32_dir_names_add(index, direntry->name);
+      }
+    }
+
+    fat32_cluster_cache_put(fs->cluster_cache, data, false);
+  }
+
+  /* deleted entries right before the end marker */
+  if (run_length != 0 &&
+      !fat32_dir_index_insert(index, index->count, run_first, run_length)) {
+    ret = FE_ERRNO;
+    goto cleanup;
+  }
+
+  *result = index;
+  return FE_OK;
+
+cleanup:
+  fat32_dir_index_free(index);
+  return ret;
+}
+
+struct fat32_dir_cache_t *
+fat32_dir_cache_create(size_t size)
+{
+  struct fat32_dir_cache_t *cache = malloc(sizeof(struct fat32_dir_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->indexes = hash_table_create(size,
+                                     fat32_dir_cluster_hash,
+                                     fat32_dir_cluster_equal,
+                                     fat32_dir_cluster_cloner, NULL,
+                                     free, fat32_dir_index_free);
+  if (cache->indexes == NULL) {
+    free(cache);
+    return NULL;
+  }
+
+  int ret = pthread_mutex_init(&cache->lock, NULL);
+  if (ret != 0) {
+    hash_table_free(cache->indexes);
+    free(cache);
+
+    errno = ret;
+    return NULL;
+  }
+
+  return cache;
+}
+
+void
+fat32_dir_cache_free(struct fat32_dir_cache_t *cache)
+{
+  hash_table_free(cache->indexes);
+
+  assert( pthread_mutex_destroy(&cache->lock) == 0 );
+  free(cache);
+}
+
+void
+fat32_dir_cache_lock(struct fat32_dir_cache_t *cache)
+{
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+}
+
+void
+fat32_dir_cache_unlock(struct fat32_dir_cache_t *cache)
+{
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+enum fat32_error_t
+fat32_dir_cache_get(struct fat32_dir_cache_t *cache,
+                    const struct fat32_fs_t *fs,
+                    const struct fat32_extent_map_t *map,
+                    struct fat32_dir_index_t **index)
+{
+  struct fat32_dir_index_t *result =
+    hash_table_lookup(cache->indexes, &map->first_cluster);
+
+  if (result == NULL) {
+    enum fat32_error_t ret = fat32_dir_index_build(fs, map, &result);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    if (hash_table_insert(cache->indexes,
+                          &result->first_cluster, result) == NULL) {
+      fat32_dir_index_free(result);
+      return FE_ERRNO;
+    }
+  }
+
+  *index = result;
+
+  return FE_OK;
+}
+
+struct fat32_dir_index_t *
+fat32_dir_cache_lookup(struct fat32_dir_cache_t *cache,
+                       uint32_t first_cluster)
+{
+  return hash_table_lookup(cache->indexes, &first_cluster);
+}
+
+void
+fat32_dir_cache_invalidate(struct fat32_dir_cache_t *cache,
+                           uint32_t first_cluster)
+{
+  hash_table_delete(cache->indexes, &first_cluster);
+}
+
+bool
+fat32_dir_index_contains(const struct fat32_dir_index_t *index,
+                         const uint8_t *name)
+{
+  struct fat32_dir_name_t folded;
+  fat32_dir_name_fold(name, &folded);
+
+  return fat32_dir_names_find(index, &folded) != index->names_capacity;
+}
+
+enum fat32_error_t
+fat32_dir_index_reserve(struct fat32_dir_index_t *index, uint32_t count,
+                        const uint8_t *name, uint32_t *entry)
+{
+  /* the only step which can fail goes first to leave the index intact */
+  if (!fat32_dir_names_prepare(index)) {
+    return FE_ERRNO;
+  }
+
+  if (count <= index->longest) {
+    uint32_t longest = 0;
+
+    for (uint32_t i = 0; i < index->count; ++i) {
+      struct fat32_dir_run_t *run = &index->runs[i];
+
+      if (run->length < count) {
+        if (run->length > longest) {
+          longest = run->length;
+        }
+        continue;
+      }
+
+      *entry       = run->first;
+      run->first  += count;
+      run->length -= count;
+      if (run->length == 0) {
+        memmove(run, run + 1,
+                (index->count - i - 1) * sizeof(struct fat32_dir_run_t));
+        --index->count;
+      }
+
+      fat32_dir_names_add(index, name);
+      return FE_OK;
+    }
+
+    /* no run is long enough so the exact bound is known now */
+    index->longest = longest;
+  }
+
+  if (index->entries - index->end < count) {
+    return FE_FS_IS_FULL;
+  }
+
+  *entry      = index->end;
+  index->end += count;
+
+  fat32_dir_names_add(index, name);
+  return FE_OK;
+}
+
+void
+fat32_dir_index_grow(struct fat32_dir_index_t *index, uint32_t entries)
+{
+  index->entries += entries;
+}
+
+bool
+fat32_dir_index_release(struct fat32_dir_index_t *index, uint32_t entry,
+                        uint32_t count, const uint8_t *name)
+{
+  assert( entry + count <= index->end );
+
+  fat32_dir_names_remove(index, name);
+
+  /* looking for the first run which starts after the released one */
+  uint32_t low  = 0;
+  uint32_t high = index->count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+
+    if (index->runs[middle].first < entry) {
+      low  = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  struct fat32_dir_run_t *previous = (low != 0) ? &index->runs[low - 1] : NULL;
+  struct fat32_dir_run_t *next     =
+    (low != index->count) ? &index->runs[low] : NULL;
+
+  bool joins_previous =
+    (previous != NULL && previous->first + previous->length == entry);
+  bool joins_next     = (next != NULL && entry + count == next->first);
+
+  struct fat32_dir_run_t *run;
+  if (joins_previous && joins_next) {
+    previous->length += count + next->length;
+    memmove(next, next + 1,
+            (index->count - low - 1) * sizeof(struct fat32_dir_run_t));
+    --index->count;
+    run = previous;
+  } else if (joins_previous) {
+    previous->length += count;
+    run = previous;
+  } else if (joins_next) {
+    next->first   = entry;
+    next->length += count;
+    run = next;
+  } else {
+    return fat32_dir_index_insert(index, low, entry, count);
+  }
+
+  if (run->length > index->longest) {
+    index->longest = run->length;
+  }
+
+  return true;
+}
@@ -9,15 +9,20 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "utils/files.h"
 
+#include "fat32/cluster_cache.h"
+
 #define EXTERN_INLINE_DEFINITIONS
 #include "fat32/direntry.h"
 
@@ -95,35 +100,22 @@ fat32_direntry_short_name(const struct fat32_direntry_t *direntry)
 }
 
 enum fat32_error_t
-fat32_direntry_mark_free(int fd, off_t offset)
+fat32_direntry_mark_free(struct fat32_cluster_cache_t *cache, off_t offset)
 {
   const off_t inner_offset = offsetof(struct fat32_direntry_t, name[0]);
   offset += inner_offset;
 
-  if (lseek(fd, offset, SEEK_SET) == (off_t) -1) {
-    return FE_ERRNO;
-  }
-
-  ssize_t nwritten = xwrite(fd, &EMPTY, sizeof(uint8_t));
-  if (nwritten == -1) {
-    /* As sizeof(typeof(EMPTY)) is 1 we can assume that nothing is written when
-     * error occurs */
-    return FE_ERRNO;
-  }
-
-  return FE_OK;
+  return fat32_cluster_cache_write(cache, offset, &EMPTY, sizeof(uint8_t));
 }
 
 enum fat32_error_t
 fat32_direntry_flush(const struct fat32_direntry_t *direntry,
-                     int fd, off_t offset)
+                     struct fat32_cluster_cache_t *cache, off_t offset)
 {
-  if (lseek(fd, offset, SEEK_SET) == (off_t) -1) {
-    return FE_ERRNO;
-  }
-
-  ssize_t nwritten = xwrite(fd, direntry, sizeof(struct fat32_direntry_t));
-  if (nwritten == -1) {
+  enum fat32_error_t ret =
+    fat32_cluster_cache_write(cache, offset,
+                              direntry, sizeof(struct fat32_direntry_t));
+  if (ret != FE_OK) {
     return FE_FS_INCONSISTENT;
   }
 
@@ -132,12 +124,13 @@ fat32_direntry_flush(const struct fat32_direntry_t *direntry,
 
 enum fat32_error_t
 fat32_direntry_make_empty(struct fat32_direntry_t *direntry,
-                          int fd, off_t offset)
+                          struct fat32_cluster_cache_t *cache,
+                          off_t offset)
 {
   assert( fat32_direntry_is_file(direntry) );
 
   direntry->file_size = 0;
-  return fat32_direntry_flush(direntry, fd, offset);
+  return fat32_direntry_flush(direntry, cache, offset);
 }
 
 bool
@@ -148,3 +141,132 @@ fat32_direntry_is_dot(const struct fat32_direntry_t *direntry)
 
   return dot || dotdot;
 }
+
+/// characters other than letters and digits allowed in short names
+static const char SHORT_NAME_SPECIALS[] = "$%'-_@~`!(){}^#&";
+
+/**
+ * Converts a part of the name to upper case padding it with spaces.
+ *
+ * @param[out] dst  Destination in the short name.
+ * @param      src  A part of the name.
+ * @param      size Size of the part.
+ * @param      max  Maximum size of the part.
+ *
+ * @return @em false if the part can't be stored in the short name. @em errno
+ *         is set appropriately.
+ */
+static bool
+fat32_direntry_short_name_part(uint8_t *dst, const char *src,
+                               size_t size, size_t max)
+{
+  if (size > max) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  for (size_t i = 0; i < size; ++i) {
+    unsigned char c = src[i];
+
+    if (!isascii(c) ||
+        !(isalnum(c) || (c != '\0' && strchr(SHORT_NAME_SPECIALS, c)))) {
+      errno = EINVAL;
+      return false;
+    }
+
+    dst[i] = toupper(c);
+  }
+
+  memset(dst + size, SPACE, max - size);
+
+  return true;
+}
+
+/**
+ * Sets creation, modification and access times of the directory entry to
+ * the current time.
+ *
+ * @param direntry Directory entry.
+ */
+static void
+fat32_direntry_touch(struct fat32_direntry_t *direntry)
+{
+  time_t    now = time(NULL);
+  struct tm tm;
+
+  localtime_r(&now, &tm);
+
+  /* dates before 1980 can't be represented */
+  if (tm.tm_year < 80) {
+    tm.tm_year = 80;
+  }
+
+  fat32_date_t date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) |
+    tm.tm_mday;
+  fat32_time_t daytime = (tm.tm_hour << 11) | (tm.tm_min << 5) |
+    (tm.tm_sec / 2);
+
+  direntry->creation_time_tenth = (tm.tm_sec % 2) * 100;
+  direntry->creation_time       = daytime;
+  direntry->creation_date       = date;
+  direntry->access_date         = date;
+  direntry->write_time          = daytime;
+  direntry->write_date          = date;
+}
+
+bool
+fat32_direntry_init(struct fat32_direntry_t *direntry, const char *name,
+                    fat32_direntry_attr_t attr, uint32_t cluster)
+{
+  memset(direntry, 0, sizeof(struct fat32_direntry_t));
+
+  const char *dot  = strrchr(name, '.');
+  size_t      size = strlen(name);
+  size_t      base = (dot != NULL) ? (size_t) (dot - name) : size;
+
+  /* names like ".profile" have no base name and names like "name." would
+   * not match their short names */
+  if (base == 0 || base + 1 == size) {
+    errno = EINVAL;
+    return false;
+  }
+
+  if (!fat32_direntry_short_name_part(direntry->name, name, base,
+                                      FAT32_DIRENTRY_BASE_NAME_SIZE)) {
+    return false;
+  }
+
+  const char *ext      = (dot != NULL) ? dot + 1 : name + size;
+  size_t      ext_size = name + size - ext;
+  if (!fat32_direntry_short_name_part(direntry->name +
+                                      FAT32_DIRENTRY_BASE_NAME_SIZE,
+                                      ext, ext_size,
+                                      FAT32_DIRENTRY_EXTENSION_SIZE)) {
+    return false;
+  }
+
+  direntry->attr             = attr;
+  direntry->first_cluster_hi = cluster >> 16;
+  direntry->first_cluster_lo = cluster & 0xffff;
+  fat32_direntry_touch(direntry);
+
+  return true;
+}
+
+void
+fat32_direntry_init_dot(struct fat32_direntry_t *direntry, bool dotdot,
+                        uint32_t cluster)
+{
+  memset(direntry, 0, sizeof(struct fat32_direntry_t));
+  memset(direntry->name, SPACE, FAT32_DIRENTRY_NAME_SIZE);
+
+  direntry->name[0] = '.';
+  if (dotdot) {
+    direntry->name[1] = '.';
+  }
+
+  direntry->attr             = FAT32_DIRENTRY_DIRECTORY;
+  direntry->first_cluster_hi = cluster >> 16;
+  direntry->first_cluster_lo = cluster & 0xffff;
+  fat32_direntry_touch(direntry);
+}
@@ -9,6 +9,7 @@
  */
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "utils/files.h"
 
@@ -34,11 +35,28 @@ fat32_diriter_create(const struct fat32_fs_object_t *fs_object,
   diriter->fs           = fs_object->fs;
   diriter->cluster      = fat32_fs_object_first_cluster(fs_object);
   diriter->offset       = 0;
+  diriter->first_cluster = diriter->cluster;
+  diriter->entry        = 0;
+  diriter->data         = NULL;
   diriter->list_dots    = list_dots;
 
   return diriter;
 }
 
+/**
+ * Returns the current cluster pinned by the iterator to the cluster cache.
+ *
+ * @param diriter Directory iterator.
+ */
+static void
+fat32_diriter_release(struct fat32_diriter_t *diriter)
+{
+  if (diriter->data != NULL) {
+    fat32_cluster_cache_put(diriter->fs->cluster_cache, diriter->data, false);
+    diriter->data = NULL;
+  }
+}
+
 /**
  * Checks whether directory entry is of interest for ::fat32_diriter_next.
  *
@@ -82,6 +100,7 @@ fat32_diriter_next(struct fat32_diriter_t    *diriter,
   do {
     if (diriter->offset == diriter->fs->cluster_size) {
       diriter->offset = 0;
+      fat32_diriter_release(diriter);
 
       uint32_t cluster = diriter->cluster;
       fat32_fat_entry_t entry;
@@ -109,29 +128,34 @@ fat32_diriter_next(struct fat32_diriter_t    *diriter,
     off_t cluster_offset = fat32_cluster_to_offset(fs->bpb, diriter->cluster);
     offset               = cluster_offset + diriter->offset;
 
-    if (lseek(fs->fd, offset, SEEK_SET) == (off_t) -1) {
-      return FE_ERRNO;
-    }
-
-    int nread = xread(fs->fd, &direntry, sizeof(struct fat32_direntry_t));
-    if (nread == -1) {
-      return FE_ERRNO;
-    } else if (nread < sizeof(struct fat32_direntry_t)) {
-      return FE_INVALID_DEV;
+    if (diriter->data == NULL) {
+      enum fat32_error_t ret =
+        fat32_cluster_cache_get(fs->cluster_cache, diriter->cluster,
+                                true, &diriter->data);
+      if (ret != FE_OK) {
+        diriter->data = NULL;
+        return ret;
+      }
     }
 
+    memcpy(&direntry, diriter->data + diriter->offset,
+           sizeof(struct fat32_direntry_t));
     diriter->offset += sizeof(struct fat32_direntry_t);
+    diriter->entry  += 1;
 
   } while (!suitable_direntry(&direntry, diriter->list_dots));
 
   if (fat32_direntry_is_last(&direntry)) {
     diriter->cluster = 0;
+    fat32_diriter_release(diriter);
     return FE_OK;
   }
 
   /* TODO: long names */
   char *direntry_name = fat32_direntry_short_name(&direntry);
-  *fs_object = fat32_fs_object_direntry(fs, &direntry, direntry_name, offset);
+  *fs_object = fat32_fs_object_direntry(fs, &direntry, direntry_name, offset,
+                                        diriter->first_cluster,
+                                        diriter->entry - 1);
   free(direntry_name);
 
   return FE_OK;
@@ -140,5 +164,6 @@ fat32_diriter_next(struct fat32_diriter_t    *diriter,
 void
 fat32_diriter_free(struct fat32_diriter_t *diriter)
 {
+  fat32_diriter_release(diriter);
   free(diriter);
 }
@@ -0,0 +1,383 @@
+/**
+ * @file   extent_map.c
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:02:05 2026
+ *
+ * @brief  Extent maps implementation.
+ *
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "hash_table.h"
+
+#include "fat32/bpb.h"
+#include "fat32/extent_map.h"
+
+/// Cache of extent maps.
+struct fat32_extent_cache_t {
+  pthread_mutex_t      lock;    /**< lock protecting the cache and reference
+                                   counters of all the maps */
+  struct hash_table_t *maps;    /**< up to date maps indexed by the first
+                                   cluster of a chain */
+  uint64_t             invalidations; /**< a number of invalidations done;
+                                         a map built while it changed may
+                                         be outdated */
+};
+
+/**
+ * Hash function on cluster numbers.
+ *
+ * @param cluster A pointer to cluster number.
+ *
+ * @return Hash value.
+ */
+static unsigned int
+fat32_extent_cluster_hash(const void *cluster)
+{
+  return *((const uint32_t *) cluster);
+}
+
+/**
+ * Equality function on cluster numbers.
+ *
+ * @param a A pointer to cluster number.
+ * @param b A pointer to cluster number.
+ *
+ * @return Result of comparison.
+ */
+static bool
+fat32_extent_cluster_equal(const void *a, const void *b)
+{
+  return *((const uint32_t *) a) == *((const uint32_t *) b);
+}
+
+/**
+ * Cloner for cluster numbers to use with hash tables.
+ *
+ * @param cluster A pointer to cluster number.
+ *
+ * @return Allocated copy. NULL on error.
+ */
+static void *
+fat32_extent_cluster_cloner(const void *cluster)
+{
+  uint32_t *result = malloc(sizeof(uint32_t));
+  if (result == NULL) {
+    return NULL;
+  }
+
+  *result = *((const uint32_t *) cluster);
+
+  return result;
+}
+
+/**
+ * Frees an extent map.
+ *
+ * @param map Map to free.
+ */
+static void
+fat32_extent_map_free(struct fat32_extent_map_t *map)
+{
+  free(map->extents);
+  free(map);
+}
+
+/**
+ * Builds an extent map walking the cluster chain a run of adjacent clusters
+ * at a time. A chain longer than the number of clusters on the volume must
+ * be cyclic and is reported as invalid.
+ *
+ * @param      fat           FAT object.
+ * @param      first_cluster The first cluster of the chain.
+ * @param[out] result        Built map is stored here on success.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ */
+static enum fat32_error_t
+fat32_extent_map_build(const struct fat32_fat_t *fat,
+                       uint32_t first_cluster,
+                       struct fat32_extent_map_t **result)
+{
+  struct fat32_extent_map_t *map;
+  uint32_t                   capacity = 0;
+  enum fat32_error_t         ret      = FE_ERRNO;
+
+  map = malloc(sizeof(struct fat32_extent_map_t));
+  if (map == NULL) {
+    return FE_ERRNO;
+  }
+
+  map->first_cluster = first_cluster;
+  map->extents       = NULL;
+  map->count         = 0;
+  map->clusters      = 0;
+  map->refs          = 0;
+  map->stale         = false;
+
+  /* zero first cluster means empty file */
+  uint32_t cluster = first_cluster;
+  while (cluster != 0) {
+    fat32_fat_entry_t entry;
+    uint32_t          length;
+
+    /* physically contiguous run becomes an extent at once */
+    ret = fat32_fat_get_run(fat, cluster, &length, &entry);
+    if (ret != FE_OK) {
+      goto cleanup;
+    }
+
+    struct fat32_extent_t *last =
+      (map->count == 0) ? NULL : &map->extents[map->count - 1];
+
+    if (last != NULL && last->physical + last->length == cluster) {
+      last->length += length;
+    } else {
+      if (map->count == capacity) {
+        capacity = (capacity == 0) ? 8 : capacity * 2;
+
+        struct fat32_extent_t *extents =
+          realloc(map->extents, capacity * sizeof(struct fat32_extent_t));
+        if (extents == NULL) {
+          ret = FE_ERRNO;
+          goto cleanup;
+        }
+        map->extents = extents;
+      }
+
+      struct fat32_extent_t *extent = &map->extents[map->count++];
+      extent->logical  = map->clusters;
+      extent->physical = cluster;
+      extent->length   = length;
+    }
+    map->clusters += length;
+
+    if (map->clusters > fat->clusters_end - FAT32_MIN_CLUSTER_NUMBER) {
+      ret = FE_INVALID_FS;
+      goto cleanup;
+    }
+
+    if (fat32_fat_entry_is_null(entry)) {
+      break;
+    }
+
+    if (fat32_fat_entry_is_bad(entry) || fat32_fat_entry_is_free(entry)) {
+      ret = FE_INVALID_FS;
+      goto cleanup;
+    }
+
+    cluster = fat32_fat_entry_to_cluster(entry);
+  }
+
+  *result = map;
+  return FE_OK;
+
+cleanup:
+  fat32_extent_map_free(map);
+  return ret;
+}
+
+struct fat32_extent_cache_t *
+fat32_extent_cache_create(size_t size)
+{
+  struct fat32_extent_cache_t *cache =
+    malloc(sizeof(struct fat32_extent_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->invalidations = 0;
+  cache->maps          = hash_table_create(size,
+                                           fat32_extent_cluster_hash,
+                                           fat32_extent_cluster_equal,
+                                           fat32_extent_cluster_cloner, NULL,
+                                           free, NULL);
+  if (cache->maps == NULL) {
+    free(cache);
+    return NULL;
+  }
+
+  int ret = pthread_mutex_init(&cache->lock, NULL);
+  if (ret != 0) {
+    hash_table_free(cache->maps);
+    free(cache);
+
+    errno = ret;
+    return NULL;
+  }
+
+  return cache;
+}
+
+void
+fat32_extent_cache_free(struct fat32_extent_cache_t *cache)
+{
+  /* By the time of the call all the references must have been dropped and
+   * therefore all the maps must have been freed. */
+  hash_table_free(cache->maps);
+
+  assert( pthread_mutex_destroy(&cache->lock) == 0 );
+  free(cache);
+}
+
+/**
+ * Drops a reference to the map. Must be called with cache lock held.
+ *
+ * @param cache Cache.
+ * @param map   Map.
+ */
+static void
+fat32_extent_cache_release_locked(struct fat32_extent_cache_t *cache,
+                                  struct fat32_extent_map_t *map)
+{
+  assert( map->refs > 0 );
+
+  if (--map->refs == 0) {
+    if (!map->stale) {
+      hash_table_delete(cache->maps, &map->first_cluster);
+    }
+
+    fat32_extent_map_free(map);
+  }
+}
+
+enum fat32_error_t
+fat32_extent_cache_get(struct fat32_extent_cache_t *cache,
+                       const struct fat32_fat_t *fat,
+                       uint32_t first_cluster,
+                       struct fat32_extent_map_t **slot,
+                       struct fat32_extent_map_t **map)
+{
+  enum fat32_error_t ret = FE_OK;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  if (*slot == NULL || (*slot)->stale) {
+    struct fat32_extent_map_t *fresh =
+      hash_table_lookup(cache->maps, &first_cluster);
+
+    if (fresh == NULL) {
+      struct fat32_extent_map_t *built;
+      uint64_t                   invalidations = cache->invalidations;
+
+      /* reading FAT must not stall users of the other maps */
+      assert( pthread_mutex_unlock(&cache->lock) == 0 );
+      ret = fat32_extent_map_build(fat, first_cluster, &built);
+      assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+      if (ret != FE_OK) {
+        goto unlock;
+      }
+
+      /* another thread could have built the map meanwhile */
+      fresh = hash_table_lookup(cache->maps, &first_cluster);
+      if (fresh != NULL) {
+        fat32_extent_map_free(built);
+      } else {
+        /* the chain could have changed while it was being read */
+        if (invalidations != cache->invalidations) {
+          fat32_extent_map_free(built);
+
+          ret = fat32_extent_map_build(fat, first_cluster, &built);
+          if (ret != FE_OK) {
+            goto unlock;
+          }
+        }
+
+        if (hash_table_insert(cache->maps, &first_cluster, built) == NULL) {
+          fat32_extent_map_free(built);
+          ret = FE_ERRNO;
+          goto unlock;
+        }
+        fresh = built;
+      }
+    }
+
+    ++fresh->refs;
+    if (*slot != NULL) {
+      fat32_extent_cache_release_locked(cache, *slot);
+    }
+    *slot = fresh;
+  }
+
+  ++(*slot)->refs;
+  *map = *slot;
+
+unlock:
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
+}
+
+void
+fat32_extent_cache_release(struct fat32_extent_cache_t *cache,
+                           struct fat32_extent_map_t *map)
+{
+  if (map == NULL) {
+    return;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+  fat32_extent_cache_release_locked(cache, map);
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+void
+fat32_extent_cache_invalidate(struct fat32_extent_cache_t *cache,
+                              uint32_t first_cluster)
+{
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  struct fat32_extent_map_t *map =
+    hash_table_lookup(cache->maps, &first_cluster);
+  if (map != NULL) {
+    /* the map is freed when the last reference to it is dropped */
+    map->stale = true;
+    hash_table_delete(cache->maps, &first_cluster);
+  }
+
+  /* maps being built without the lock may already miss the change */
+  ++cache->invalidations;
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+}
+
+bool
+fat32_extent_map_lookup(const struct fat32_extent_map_t *map,
+                        uint32_t logical, uint32_t *physical, uint32_t *run)
+{
+  if (logical >= map->clusters) {
+    return false;
+  }
+
+  /* looking for the last extent which starts not after @em logical */
+  uint32_t low  = 0;
+  uint32_t high = map->count;
+  while (high - low > 1) {
+    uint32_t middle = low + (high - low) / 2;
+
+    if (map->extents[middle].logical <= logical) {
+      low  = middle;
+    } else {
+      high = middle;
+    }
+  }
+
+  const struct fat32_extent_t *extent = &map->extents[low];
+  uint32_t                     shift  = logical - extent->logical;
+
+  *physical = extent->physical + shift;
+  if (run != NULL) {
+    *run = extent->length - shift;
+  }
+
+  return true;
+}
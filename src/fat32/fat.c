@@ -7,197 +7,2291 @@
  *
  *
  */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "utils/files.h"
 #include "utils/log.h"
 
-#include "fat32/fs.h"
-#include "fat32/fat.h"
-#include "fat32/utils.h"
+#include "fat32/fs.h"
+#include "fat32/fat.h"
+#include "fat32/utils.h"
+
+/// a FAT sector stored in the cache
+struct fat32_fat_cache_entry_t {
+  uint32_t sector;              /**< a number of the sector counted from the
+                                   beginning of FAT */
+  bool     valid;               /**< indicates whether entry holds some
+                                   sector's data */
+  bool     dirty;               /**< sector has been modified in memory and
+                                   must be written back to the device */
+  bool     ra_mark;             /**< sector starts a readahead window; the
+                                   next window is requested when it's
+                                   accessed */
+  uint8_t *data;                /**< sector's contents */
+
+  struct fat32_fat_cache_entry_t *lru_prev;  /**< more recently used entry */
+  struct fat32_fat_cache_entry_t *lru_next;  /**< less recently used entry */
+  struct fat32_fat_cache_entry_t *hash_next; /**< next entry in the same
+                                                hash bucket */
+};
+
+/// Cache of FAT sectors.
+struct fat32_fat_cache_t {
+  pthread_mutex_t lock;         /**< lock protecting the whole cache */
+
+  size_t   size;                /**< a number of sectors in the cache */
+  struct fat32_fat_cache_entry_t  *entries; /**< all the entries */
+  uint8_t *data;                /**< memory for sectors' contents */
+
+  struct fat32_fat_cache_entry_t **buckets; /**< hash table indexed by
+                                               sector number */
+  uint32_t buckets_mask;        /**< number of buckets minus one */
+
+  struct fat32_fat_cache_entry_t  *lru_head; /**< most recently used entry */
+  struct fat32_fat_cache_entry_t  *lru_tail; /**< least recently used entry
+                                                which is evicted first */
+
+  fat32_fat_entry_t *table;     /**< The whole FAT if it has been preloaded
+                                   at mount time. In this case no sectors
+                                   are held in @em entries. NULL
+                                   otherwise. */
+  uint32_t table_entries;       /**< a number of entries in @em table */
+  size_t   table_mapped;        /**< a size of memory mapping holding
+                                   @em table */
+  size_t   table_offset;        /**< an offset of @em table in the
+                                   mapping */
+  bool     table_huge;          /**< @em table is backed by huge pages */
+  bool     table_file;          /**< @em table is a private mapping of the
+                                   image file */
+  uint8_t *table_dirty;         /**< bitmap of modified sectors of
+                                   @em table */
+
+  uint32_t ra_window;           /**< a number of sectors read ahead after a
+                                   cache miss. Zero if readahead is
+                                   disabled. */
+  pthread_t ra_thread;          /**< thread doing readahead */
+  pthread_cond_t ra_wakeup;     /**< signalled when readahead is requested
+                                   or must be stopped */
+  pthread_cond_t ra_done;       /**< broadcasted when readahead window has
+                                   been inserted into the cache */
+  bool     ra_stop;             /**< readahead thread must exit */
+  bool     ra_queued;           /**< a window is waiting to be read */
+  uint32_t ra_start;            /**< the first sector of queued window */
+  uint32_t ra_end;              /**< a sector following queued window */
+  bool     ra_busy;             /**< a window is being read */
+  uint32_t ra_busy_start;       /**< the first sector of window being read */
+  uint32_t ra_busy_end;         /**< a sector following window being read */
+  bool     ra_stale;            /**< a sector of the window being read has
+                                   been written back; the window may hold
+                                   its old copy and is dropped */
+  uint8_t *ra_buffer;           /**< buffer to read windows into */
+};
+
+/// maximum number of sectors passed to a single vectored write
+#define FAT32_FAT_MAX_IOV 256
+
+/// a bit of FAT[1] entry which is set when the volume is unmounted cleanly
+static const fat32_fat_entry_t FAT32_FAT_CLEAN_SHUTDOWN = 0x08000000;
+
+/**
+ * Creates a FAT cache.
+ *
+ * @param size             A number of sectors to hold.
+ * @param bytes_per_sector A size of a sector.
+ *
+ * @return New cache. NULL on error. Error is specified using @em errno.
+ */
+static struct fat32_fat_cache_t *
+fat32_fat_cache_create(size_t size, uint32_t bytes_per_sector);
+
+/**
+ * Creates a FAT cache holding the whole active FAT in a contiguous table.
+ * The table is read from the device at once.
+ *
+ * @param fat FAT object. #fat32_fat_t::dev and #fat32_fat_t::bpb fields must
+ *            have been set.
+ *
+ * @return New cache. NULL on error. Error is specified using @em errno.
+ */
+static struct fat32_fat_cache_t *
+fat32_fat_cache_preload(const struct fat32_fat_t *fat);
+
+/**
+ * Frees memory held by the cache. Modified sectors are not written back.
+ *
+ * @param cache Cache to free.
+ */
+static void
+fat32_fat_cache_free(struct fat32_fat_cache_t *cache);
+
+/**
+ * Requests a readahead window starting at the specified sector. Must be
+ * called with cache lock held.
+ *
+ * @param fat    FAT object.
+ * @param sector The first sector of the window.
+ */
+static void
+fat32_fat_readahead(const struct fat32_fat_t *fat, uint32_t sector);
+
+/**
+ * Waits until the sector being read ahead is inserted into the cache. Must
+ * be called with cache lock held which is released while waiting. So it
+ * can't be used in the middle of operations relying on cache lock.
+ *
+ * @param fat    FAT object.
+ * @param sector Sector number.
+ */
+static void
+fat32_fat_readahead_wait(const struct fat32_fat_t *fat, uint32_t sector);
+
+/**
+ * Returns a cache entry holding the specified sector reading it from the
+ * device if needed. Entry becomes the most recently used one. Must be called
+ * with cache lock held.
+ *
+ * @param      fat    FAT object.
+ * @param      sector A number of the sector counted from the beginning of FAT.
+ * @param[out] entry  Cache entry is stored here on success.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO @li data can't be read from underlying device
+ *                  @li evicted sector can't be written back
+ * @retval FE_INVALID_DEV underlying device file ended prematurely
+ */
+static enum fat32_error_t
+fat32_fat_cache_get(const struct fat32_fat_t *fat, uint32_t sector,
+                    struct fat32_fat_cache_entry_t **entry);
+
+/**
+ * Writes a range of FAT sectors to one of the FATs on the device. A window
+ * being read ahead which overlaps the range is marked stale. Must be called
+ * with cache lock held.
+ *
+ * @param fat    FAT object.
+ * @param copy   Zero-based number of FAT to write to.
+ * @param sector The first sector of the range counted from the beginning of
+ *               FAT.
+ * @param iov    Buffers holding sectors' contents. The array is not modified.
+ * @param iovcnt A number of buffers. Must not exceed #FAT32_FAT_MAX_IOV.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+static enum fat32_error_t
+fat32_fat_write_sectors(const struct fat32_fat_t *fat, uint8_t copy,
+                        uint32_t sector, const struct iovec *iov, int iovcnt);
+
+/**
+ * Returns the range of FATs that must be updated when FAT is modified.
+ *
+ * @param      fat   FAT object.
+ * @param[out] first The first FAT to update.
+ * @param[out] end   A number following the last FAT to update.
+ */
+static void
+fat32_fat_copies(const struct fat32_fat_t *fat, uint8_t *first, uint8_t *end);
+
+/**
+ * Writes a modified sector back to the device. Must be called with cache lock
+ * held.
+ *
+ * @param fat   FAT object.
+ * @param entry Cache entry.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+static enum fat32_error_t
+fat32_fat_cache_write_back(const struct fat32_fat_t *fat,
+                           struct fat32_fat_cache_entry_t *entry);
+
+/**
+ * Returns a pointer to the FAT entry corresponding to the specified cluster
+ * inside the cached sector. Must be called with cache lock held.
+ *
+ * @param      fat     FAT object.
+ * @param      cluster Cluster number.
+ * @param[out] entry   A pointer to the FAT entry is stored here on success.
+ * @param[out] sector  Cache entry holding the sector is stored here. Can be
+ *                     NULL.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_fat_entry_pointer(const struct fat32_fat_t *fat, uint32_t cluster,
+                        fat32_fat_entry_t **entry,
+                        struct fat32_fat_cache_entry_t **sector);
+
+/**
+ * Builds the bitmap of free clusters reading the whole FAT, counts free
+ * and bad clusters. FAT is split into ranges scanned by
+ * several threads. It is read in big chunks directly from the device
+ * bypassing the cache unless it has been preloaded.
+ *
+ * @param fat FAT object.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO @li memory allocation error
+ *                  @li IO error
+ * @retval FE_INVALID_DEV underlying device file ended prematurely
+ */
+static enum fat32_error_t
+fat32_fat_build_free_map(struct fat32_fat_t *fat);
+
+/**
+ * Builds the bitmap of free clusters if it has not been built at mount
+ * time. Modified cached sectors are written to the device before that as
+ * the bitmap is built from the data read directly from the device. Must be
+ * called with cache lock held.
+ *
+ * @param fat FAT object.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_fat_free_map_ensure(struct fat32_fat_t *fat);
+
+/**
+ * Marks a sector holding an entry of the cluster as modified. Must be called
+ * with cache lock held.
+ *
+ * @param fat     FAT object.
+ * @param cluster Cluster number.
+ * @param sector  Cache entry returned by ::fat32_fat_entry_pointer.
+ */
+static void
+fat32_fat_mark_dirty(const struct fat32_fat_t *fat, uint32_t cluster,
+                     struct fat32_fat_cache_entry_t *sector);
+
+/**
+ * Sets or clears clean shutdown bit in FAT[1] and writes it to the device
+ * immediately.
+ *
+ * @param fat   FAT object.
+ * @param clean Desired state of the bit.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_fat_set_volume_clean(struct fat32_fat_t *fat, bool clean);
+
+/// a part of FAT scanned by a single thread while building free clusters
+/// bitmap
+struct fat32_fat_scan_range_t {
+  const struct fat32_fat_t *fat; /**< FAT object */
+  uint32_t  first;              /**< the first cluster of the range */
+  uint32_t  end;                /**< a number following the last cluster of
+                                   the range */
+  uint32_t  free_count;         /**< a number of free clusters found */
+  uint32_t  bad_count;          /**< a number of bad clusters found */
+  enum fat32_error_t ret;       /**< the result of scanning */
+  int       error;              /**< @em errno value if @em ret is
+                                   #FE_ERRNO */
+};
+
+/**
+ * Marks free clusters among consecutive FAT entries in the bitmap of free
+ * clusters, counts them and bad clusters.
+ *
+ * @param range   Range being scanned. Its counters are updated.
+ * @param entries FAT entries.
+ * @param first   Cluster number corresponding to the first entry.
+ * @param count   A number of entries.
+ */
+static void
+fat32_fat_scan_entries(struct fat32_fat_scan_range_t *range,
+                       const fat32_fat_entry_t *entries,
+                       uint32_t first, uint32_t count);
+
+/**
+ * Scans a range of FAT. Used as a thread function by
+ * ::fat32_fat_build_free_map. FAT is read by big chunks with positioned
+ * reads unless it has been preloaded.
+ *
+ * @param arg Range to scan (#fat32_fat_scan_range_t).
+ *
+ * @return Always NULL. The result is stored in the range.
+ */
+static void *
+fat32_fat_scan_range(void *arg);
+
+/**
+ * Finds the first free cluster in the given range using the bitmap of free
+ * clusters. The bitmap is scanned a word at a time.
+ *
+ * @param free_map Bitmap of free clusters.
+ * @param from     The first cluster number to check.
+ * @param to       A number following the last cluster number to check.
+ *
+ * @return A number of free cluster or @em to if there is no free cluster in
+ *         the range.
+ */
+static uint32_t
+fat32_fat_free_map_search(const uint64_t *free_map,
+                          uint32_t from, uint32_t to);
+
+/**
+ * Finds the first used cluster in the given range using the bitmap of free
+ * clusters.
+ *
+ * @param free_map Bitmap of free clusters.
+ * @param from     The first cluster number to check.
+ * @param to       A number following the last cluster number to check.
+ *
+ * @return A number of used cluster or @em to if all clusters in the range
+ *         are free.
+ */
+static uint32_t
+fat32_fat_used_map_search(const uint64_t *free_map,
+                          uint32_t from, uint32_t to);
+
+/**
+ * The same as ::fat32_fat_set_entry but must be called with cache lock held.
+ *
+ * @param fat     FAT object.
+ * @param cluster Cluster number.
+ * @param entry   Desired FAT entry value.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_fat_set_entry_locked(const struct fat32_fat_t *fat,
+                           uint32_t cluster, fat32_fat_entry_t entry);
+
+/**
+ * Frees clusters linked by ::fat32_fat_allocate_chain before it failed and
+ * makes the extended chain end where it used to. The partial chain ends
+ * with the end of chain mark, at an entry which is still free or at the
+ * cluster whose entry could not be written. The latter is not touched. Must
+ * be called with cache lock held.
+ *
+ * @param fat      FAT object.
+ * @param previous The last cluster of the extended chain or zero.
+ * @param first    The first cluster of the partial chain.
+ * @param failed   The cluster whose entry could not be written.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_fat_free_partial_chain_locked(const struct fat32_fat_t *fat,
+                                    uint32_t previous, uint32_t first,
+                                    uint32_t failed);
+
+/**
+ * Sets a FAT entry of the cluster to the specified value. Only the memory
+ * copy of FAT sector is changed.
+ *
+ * @param fat     FAT object.
+ * @param cluster Cluster number.
+ * @param entry   Desired FAT entry value.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_fat_set_entry(const struct fat32_fat_t *fat,
+                    uint32_t cluster, fat32_fat_entry_t entry);
+
+enum fat32_error_t
+fat32_fat_init(struct fat32_fat_t *fat,
+               const struct fat32_fs_t *fs,
+               const struct fat32_fs_params_t *params)
+{
+  fat->dev               = &fs->dev;
+  fat->bpb               = fs->bpb;
+  fat->fs_info           = fs->fs_info;
+  fat->free_map          = NULL;
+  fat->reserved          = 0;
+  fat->inconsistent      = false;
+  fat->free_cluster_hint = FAT32_MIN_CLUSTER_NUMBER;
+
+  fat->bytes_per_sector_log =
+    fat32_highest_bit_number(fs->bpb->bytes_per_sector);
+  fat->first_sector         = fs->bpb->reserved_sectors_count +
+    fat32_bpb_active_fat(fs->bpb) * fs->bpb->fat_size;
+
+  /* FAT of a mapped image is accessed in place whether preloading is asked
+   * for or not */
+  if (params->fat_preload || fat->dev->map != NULL) {
+    fat->cache = fat32_fat_cache_preload(fat);
+  } else {
+    fat->cache = fat32_fat_cache_create(params->fat_cache_size,
+                                        fs->bpb->bytes_per_sector);
+  }
+  if (fat->cache == NULL) {
+    return FE_ERRNO;
+  }
+
+  /* the thread is started by ::fat32_fat_readahead_start later */
+  fat->readahead = (fat->cache->table == NULL) ? params->fat_readahead : 0;
+
+  enum fat32_error_t ret = FE_OK;
+
+  /* clusters which are not described by FAT can't be used even if BPB
+   * says that they exist */
+  uint32_t fat_entries  = (uint32_t)
+    (((uint64_t) fs->bpb->fat_size * fs->bpb->bytes_per_sector) /
+     sizeof(fat32_fat_entry_t));
+  fat->clusters_end     =
+    fat32_bpb_clusters_count(fs->bpb) + FAT32_MIN_CLUSTER_NUMBER;
+  if (fat->clusters_end > fat_entries) {
+    fat->clusters_end = fat_entries;
+  }
+
+  fat32_fat_entry_t *entry;
+  ret = fat32_fat_entry_pointer(fat, 1, &entry, NULL);
+  if (ret != FE_OK) {
+    goto cleanup;
+  }
+
+  /* FSInfo can be trusted only if the volume has been unmounted cleanly;
+   * otherwise free clusters must be counted by reading the whole FAT */
+  struct fat32_fs_info_t *fs_info = fs->fs_info;
+  bool                    clean   = (*entry & FAT32_FAT_CLEAN_SHUTDOWN) &&
+    fs_info->last_free_count <= fat->clusters_end - FAT32_MIN_CLUSTER_NUMBER;
+
+  if (clean) {
+    log_info("Volume was unmounted cleanly. Using free clusters count "
+             "from FSInfo: %" PRIu32, fs_info->last_free_count);
+
+    if (fs_info->free_cluster_hint >= FAT32_MIN_CLUSTER_NUMBER &&
+        fs_info->free_cluster_hint < fat->clusters_end) {
+      fat->free_cluster_hint = fs_info->free_cluster_hint;
+    }
+  } else {
+    log_info("Volume was not unmounted cleanly. Scanning FAT.");
+  }
+
+  /* preloaded FAT is scanned in memory so there's no point to postpone it;
+   * mapped FAT is not read until it's needed though */
+  if (!clean || (fat->cache->table != NULL && !fat->cache->table_file)) {
+    ret = fat32_fat_build_free_map(fat);
+    if (ret != FE_OK) {
+      goto cleanup;
+    }
+  }
+
+  /* the bit stays cleared until the volume is unmounted */
+  ret = fat32_fat_set_volume_clean(fat, false);
+  if (ret != FE_OK) {
+    goto cleanup;
+  }
+
+  return FE_OK;
+
+cleanup:
+  free(fat->free_map);
+  fat32_fat_cache_free(fat->cache);
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fat_finalize(struct fat32_fat_t *fat)
+{
+  fat32_fat_readahead_stop(fat);
+
+  if (fat32_fat_sync(fat) != FE_OK) {
+    return FE_ERRNO;
+  }
+
+  /* free clusters count is always exact while FAT is in use */
+  fat->fs_info->free_cluster_hint = fat->free_cluster_hint;
+  if (fat32_fs_info_write(fat->dev, fat->bpb, fat->fs_info) != FE_OK) {
+    return FE_ERRNO;
+  }
+
+  /* FAT and FSInfo are consistent by now so the volume can be marked clean
+   * unless clusters may have been lost while it was in use */
+  if (!fat->inconsistent && fat32_fat_set_volume_clean(fat, true) != FE_OK) {
+    return FE_ERRNO;
+  }
+
+  fat32_fat_cache_free(fat->cache);
+  free(fat->free_map);
+
+  return FE_OK;
+}
+
+/**
+ * Writes modified sectors of preloaded FAT to the device. Must be called with
+ * cache lock held.
+ *
+ * @param fat        FAT object.
+ * @param first_copy The first FAT to write to.
+ * @param end_copy   A number following the last FAT to write to.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+static enum fat32_error_t
+fat32_fat_sync_table(const struct fat32_fat_t *fat,
+                     uint8_t first_copy, uint8_t end_copy)
+{
+  const struct fat32_bpb_t *bpb   = fat->bpb;
+  struct fat32_fat_cache_t *cache = fat->cache;
+
+  for (uint8_t copy = first_copy; copy < end_copy; ++copy) {
+    uint32_t sector = 0;
+
+    /* adjacent modified sectors are written by a single call */
+    while (sector < bpb->fat_size) {
+      if (!(cache->table_dirty[sector / 8] & (1 << (sector % 8)))) {
+        ++sector;
+        continue;
+      }
+
+      uint32_t count = 1;
+      while (sector + count < bpb->fat_size &&
+             (cache->table_dirty[(sector + count) / 8] &
+              (1 << ((sector + count) % 8)))) {
+        ++count;
+      }
+
+      struct iovec iov = {
+        .iov_base = (uint8_t *) cache->table +
+                    (size_t) sector * bpb->bytes_per_sector,
+        .iov_len  = (size_t) count * bpb->bytes_per_sector
+      };
+
+      enum fat32_error_t ret =
+        fat32_fat_write_sectors(fat, copy, sector, &iov, 1);
+      if (ret != FE_OK) {
+        return ret;
+      }
+
+      sector += count;
+    }
+  }
+
+  memset(cache->table_dirty, 0, (bpb->fat_size + 7) / 8);
+
+  return FE_OK;
+}
+
+/**
+ * Compares cache entries by sector number. Used to sort modified entries
+ * before writing them out.
+ *
+ * @param a A pointer to a pointer to the first entry.
+ * @param b A pointer to a pointer to the second entry.
+ *
+ * @return Negative, zero or positive value as required by @em qsort.
+ */
+static int
+fat32_fat_cache_entry_compare(const void *a, const void *b)
+{
+  uint32_t x = (*(struct fat32_fat_cache_entry_t * const *) a)->sector;
+  uint32_t y = (*(struct fat32_fat_cache_entry_t * const *) b)->sector;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Writes modified cached sectors to the device. Sectors are sorted and
+ * adjacent ones are passed to a single vectored write. Must be called with
+ * cache lock held.
+ *
+ * @param fat        FAT object.
+ * @param first_copy The first FAT to write to.
+ * @param end_copy   A number following the last FAT to write to.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ */
+static enum fat32_error_t
+fat32_fat_sync_entries(const struct fat32_fat_t *fat,
+                       uint8_t first_copy, uint8_t end_copy)
+{
+  struct fat32_fat_cache_t        *cache = fat->cache;
+  enum fat32_error_t               ret   = FE_OK;
+  struct fat32_fat_cache_entry_t **dirty =
+    malloc(cache->size * sizeof(struct fat32_fat_cache_entry_t *));
+  size_t                           count = 0;
+
+  if (dirty == NULL) {
+    return FE_ERRNO;
+  }
+
+  for (size_t i = 0; i < cache->size; ++i) {
+    struct fat32_fat_cache_entry_t *entry = &cache->entries[i];
+
+    if (entry->valid && entry->dirty) {
+      dirty[count++] = entry;
+    }
+  }
+
+  qsort(dirty, count, sizeof(struct fat32_fat_cache_entry_t *),
+        fat32_fat_cache_entry_compare);
+
+  for (uint8_t copy = first_copy; copy < end_copy; ++copy) {
+    size_t i = 0;
+
+    while (i < count) {
+      struct iovec iov[FAT32_FAT_MAX_IOV];
+      int          iovcnt = 0;
+
+      do {
+        iov[iovcnt].iov_base = dirty[i + iovcnt]->data;
+        iov[iovcnt].iov_len  = fat->bpb->bytes_per_sector;
+        ++iovcnt;
+      } while (i + iovcnt < count && iovcnt < FAT32_FAT_MAX_IOV &&
+               dirty[i + iovcnt]->sector == dirty[i]->sector + iovcnt);
+
+      ret = fat32_fat_write_sectors(fat, copy, dirty[i]->sector, iov, iovcnt);
+      if (ret != FE_OK) {
+        goto cleanup;
+      }
+
+      i += iovcnt;
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    dirty[i]->dirty = false;
+  }
+
+cleanup:
+  free(dirty);
+
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fat_sync(struct fat32_fat_t *fat)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+  enum fat32_error_t        ret;
+  uint8_t                   first_copy;
+  uint8_t                   end_copy;
+
+  fat32_fat_copies(fat, &first_copy, &end_copy);
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  if (cache->table != NULL) {
+    ret = fat32_fat_sync_table(fat, first_copy, end_copy);
+  } else {
+    ret = fat32_fat_sync_entries(fat, first_copy, end_copy);
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
+}
+
+/// a size in bytes of entry in file allocation table
+static const uint8_t  FAT32_FAT_ENTRY_SIZE = sizeof(fat32_fat_entry_t);
+
+struct fat32_fat_cache_t *
+fat32_fat_cache_create(size_t size, uint32_t bytes_per_sector)
+{
+  struct fat32_fat_cache_t *cache = malloc(sizeof(struct fat32_fat_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  /* at least one sector is always needed */
+  if (size == 0) {
+    size = 1;
+  }
+
+  uint32_t buckets = 1;
+  while (buckets < 2 * size) {
+    buckets <<= 1;
+  }
+
+  cache->table        = NULL;
+  cache->table_file   = false;
+  cache->table_dirty  = NULL;
+  cache->ra_window    = 0;
+  cache->ra_queued    = false;
+  cache->ra_busy      = false;
+  cache->ra_stale     = false;
+  cache->ra_buffer    = NULL;
+  cache->size         = size;
+  cache->buckets_mask = buckets - 1;
+  cache->entries      = calloc(size, sizeof(struct fat32_fat_cache_entry_t));
+  cache->buckets      = calloc(buckets,
+                               sizeof(struct fat32_fat_cache_entry_t *));
+  cache->data         = fat32_dev_alloc(size * bytes_per_sector);
+
+  if (cache->entries == NULL || cache->buckets == NULL ||
+      cache->data == NULL) {
+    goto cleanup;
+  }
+
+  int ret = pthread_mutex_init(&cache->lock, NULL);
+  if (ret != 0) {
+    /* as pthread functions does not set errno we do it manually to keep
+       interface uniform
+    */
+    errno = ret;
+    goto cleanup;
+  }
+
+  /* initially all the entries are invalid and linked into LRU list in
+   * arbitrary order */
+  for (size_t i = 0; i < size; ++i) {
+    struct fat32_fat_cache_entry_t *entry = &cache->entries[i];
+
+    entry->valid    = false;
+    entry->dirty    = false;
+    entry->ra_mark  = false;
+    entry->data     = cache->data + i * bytes_per_sector;
+    entry->lru_prev = (i == 0) ? NULL : &cache->entries[i - 1];
+    entry->lru_next = (i == size - 1) ? NULL : &cache->entries[i + 1];
+  }
+
+  cache->lru_head = &cache->entries[0];
+  cache->lru_tail = &cache->entries[size - 1];
+
+  return cache;
+
+cleanup:
+  free(cache->entries);
+  free(cache->buckets);
+  free(cache->data);
+  free(cache);
+
+  return NULL;
+}
+
+/// huge page size used to round up the size of preloaded FAT mapping
+static const size_t FAT32_FAT_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+struct fat32_fat_cache_t *
+fat32_fat_cache_preload(const struct fat32_fat_t *fat)
+{
+  const struct fat32_bpb_t *bpb   = fat->bpb;
+  size_t                    size  =
+    (size_t) bpb->fat_size * bpb->bytes_per_sector;
+  struct fat32_fat_cache_t *cache = malloc(sizeof(struct fat32_fat_cache_t));
+  struct timespec           start;
+  struct timespec           end;
+
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  cache->size          = 0;
+  cache->entries       = NULL;
+  cache->buckets       = NULL;
+  cache->data          = NULL;
+  cache->lru_head      = NULL;
+  cache->lru_tail      = NULL;
+  cache->ra_window     = 0;
+  cache->ra_queued     = false;
+  cache->ra_busy       = false;
+  cache->ra_stale      = false;
+  cache->ra_buffer     = NULL;
+  cache->table_entries = size / FAT32_FAT_ENTRY_SIZE;
+  cache->table_dirty   = calloc((bpb->fat_size + 7) / 8, 1);
+  if (cache->table_dirty == NULL) {
+    free(cache);
+    return NULL;
+  }
+
+  off_t offset = fat32_sector_to_offset(bpb, fat->first_sector);
+
+  cache->table_offset = 0;
+  cache->table_file   = false;
+
+  if (fat32_dev_map(fat->dev, offset, size) != NULL) {
+    /* FAT of an image file is mapped privately: pages are shared with the
+     * page cache until they are modified and modifications reach the file
+     * only when they are synchronized as usual */
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    cache->table_offset = (fat->dev->base + offset) & (page - 1);
+    cache->table_mapped = size + cache->table_offset;
+    cache->table_huge   = false;
+    cache->table_file   = true;
+
+    uint8_t *mapping = mmap(NULL, cache->table_mapped,
+                            PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                            fat->dev->fd,
+                            fat->dev->base + offset - cache->table_offset);
+    if (mapping == MAP_FAILED) {
+      cache->table = MAP_FAILED;
+      goto cleanup;
+    }
+
+    cache->table = (fat32_fat_entry_t *) (mapping + cache->table_offset);
+
+    /* FAT is mostly walked forward and it's needed all the time */
+    madvise(mapping, cache->table_mapped, MADV_SEQUENTIAL);
+    madvise(mapping, cache->table_mapped, MADV_WILLNEED);
+  } else {
+    /* huge pages are tried first; if none are reserved in the system then
+     * we fall back to ordinary pages hinting the kernel to use transparent
+     * huge pages */
+    cache->table_mapped = (size + FAT32_FAT_HUGE_PAGE_SIZE - 1) &
+                          ~(FAT32_FAT_HUGE_PAGE_SIZE - 1);
+    cache->table_huge   = true;
+    cache->table        = mmap(NULL, cache->table_mapped,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                               -1, 0);
+    if (cache->table == MAP_FAILED) {
+      cache->table_huge = false;
+      cache->table      = mmap(NULL, cache->table_mapped,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (cache->table == MAP_FAILED) {
+        goto cleanup;
+      }
+
+      /* this is only a hint so errors are ignored */
+      madvise(cache->table, cache->table_mapped, MADV_HUGEPAGE);
+    }
+
+    enum fat32_error_t error = fat32_dev_read(fat->dev, cache->table,
+                                              size, offset);
+    if (error == FE_INVALID_DEV) {
+      /* there is no better way to indicate that the device is too small */
+      errno = EIO;
+      goto cleanup;
+    } else if (error != FE_OK) {
+      goto cleanup;
+    }
+  }
+
+  int ret = pthread_mutex_init(&cache->lock, NULL);
+  if (ret != 0) {
+    errno = ret;
+    goto cleanup;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed = (end.tv_sec - start.tv_sec) * 1e3 +
+                   (end.tv_nsec - start.tv_nsec) / 1e6;
+  if (cache->table_file) {
+    log_info("FAT mapped from the image in %.3f ms: %zu bytes",
+             elapsed, size);
+  } else {
+    log_info("FAT preloaded in %.3f ms: %zu bytes in %zu bytes of %s pages",
+             elapsed, size, cache->table_mapped,
+             cache->table_huge ? "huge" : "ordinary");
+  }
+
+  return cache;
+
+cleanup:
+  if (cache->table != MAP_FAILED) {
+    munmap((uint8_t *) cache->table - cache->table_offset,
+           cache->table_mapped);
+  }
+  free(cache->table_dirty);
+  free(cache);
+
+  return NULL;
+}
+
+void
+fat32_fat_cache_free(struct fat32_fat_cache_t *cache)
+{
+  assert( pthread_mutex_destroy(&cache->lock) == 0 );
+
+  if (cache->table != NULL) {
+    munmap((uint8_t *) cache->table - cache->table_offset,
+           cache->table_mapped);
+    free(cache->table_dirty);
+  }
+
+  free(cache->entries);
+  free(cache->buckets);
+  free(cache->data);
+  free(cache->ra_buffer);
+  free(cache);
+}
+
+/**
+ * Makes a cache entry the most recently used one.
+ *
+ * @param cache Cache.
+ * @param entry Entry.
+ */
+static void
+fat32_fat_cache_touch(struct fat32_fat_cache_t *cache,
+                      struct fat32_fat_cache_entry_t *entry)
+{
+  if (cache->lru_head == entry) {
+    return;
+  }
+
+  /* unlinking */
+  entry->lru_prev->lru_next = entry->lru_next;
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->lru_tail = entry->lru_prev;
+  }
+
+  entry->lru_prev           = NULL;
+  entry->lru_next           = cache->lru_head;
+  cache->lru_head->lru_prev = entry;
+  cache->lru_head           = entry;
+}
+
+/**
+ * Removes an entry from the hash table of the cache.
+ *
+ * @param cache Cache.
+ * @param entry Valid cache entry.
+ */
+static void
+fat32_fat_cache_unhash(struct fat32_fat_cache_t *cache,
+                       struct fat32_fat_cache_entry_t *entry)
+{
+  struct fat32_fat_cache_entry_t **p =
+    &cache->buckets[entry->sector & cache->buckets_mask];
+
+  while (*p != entry) {
+    p = &(*p)->hash_next;
+  }
+
+  *p = entry->hash_next;
+}
+
+void
+fat32_fat_copies(const struct fat32_fat_t *fat, uint8_t *first, uint8_t *end)
+{
+  const struct fat32_bpb_t *bpb = fat->bpb;
+
+  if (fat32_bpb_fat_mirroring(bpb)) {
+    *first = 0;
+    *end   = bpb->fats_count;
+  } else {
+    *first = fat32_bpb_active_fat(bpb);
+    *end   = *first + 1;
+  }
+}
+
+enum fat32_error_t
+fat32_fat_write_sectors(const struct fat32_fat_t *fat, uint8_t copy,
+                        uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+  const struct fat32_bpb_t *bpb    = fat->bpb;
+  struct fat32_fat_cache_t *cache  = fat->cache;
+  off_t                     offset =
+    fat32_sector_to_offset(bpb, bpb->reserved_sectors_count +
+                                copy * bpb->fat_size + sector);
+
+  if (cache->ra_busy) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      size += iov[i].iov_len;
+    }
+
+    /* the window may have been read before the write so its copy of the
+     * sector is outdated whether the write is an eviction or a sync */
+    uint32_t end = sector + size / bpb->bytes_per_sector;
+    if (sector < cache->ra_busy_end && end > cache->ra_busy_start) {
+      cache->ra_stale = true;
+    }
+  }
+
+  return fat32_dev_writev(fat->dev, iov, iovcnt, offset);
+}
+
+enum fat32_error_t
+fat32_fat_cache_write_back(const struct fat32_fat_t *fat,
+                           struct fat32_fat_cache_entry_t *entry)
+{
+  struct iovec iov = {
+    .iov_base = entry->data,
+    .iov_len  = fat->bpb->bytes_per_sector
+  };
+  uint8_t      first_copy;
+  uint8_t      end_copy;
+
+  fat32_fat_copies(fat, &first_copy, &end_copy);
+
+  for (uint8_t copy = first_copy; copy < end_copy; ++copy) {
+    enum fat32_error_t ret =
+      fat32_fat_write_sectors(fat, copy, entry->sector, &iov, 1);
+    if (ret != FE_OK) {
+      return ret;
+    }
+  }
+
+  entry->dirty = false;
+
+  return FE_OK;
+}
+
+/**
+ * Looks for a sector in the cache. Must be called with cache lock held.
+ *
+ * @param cache  Cache.
+ * @param sector Sector number.
+ *
+ * @return Cache entry or NULL if sector is not cached.
+ */
+static struct fat32_fat_cache_entry_t *
+fat32_fat_cache_lookup(const struct fat32_fat_cache_t *cache, uint32_t sector)
+{
+  struct fat32_fat_cache_entry_t *entry =
+    cache->buckets[sector & cache->buckets_mask];
+
+  while (entry != NULL && entry->sector != sector) {
+    entry = entry->hash_next;
+  }
+
+  return entry;
+}
+
+/**
+ * Frees the least recently used entry writing it back if needed. Must be
+ * called with cache lock held.
+ *
+ * @param      fat   FAT object.
+ * @param[out] entry Invalid entry which can be filled with new sector.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO evicted sector can't be written back
+ */
+static enum fat32_error_t
+fat32_fat_cache_evict(const struct fat32_fat_t *fat,
+                      struct fat32_fat_cache_entry_t **result)
+{
+  struct fat32_fat_cache_t       *cache = fat->cache;
+  struct fat32_fat_cache_entry_t *entry = cache->lru_tail;
+
+  if (entry->valid) {
+    if (entry->dirty) {
+      enum fat32_error_t ret = fat32_fat_cache_write_back(fat, entry);
+      if (ret != FE_OK) {
+        return ret;
+      }
+    }
+
+    fat32_fat_cache_unhash(cache, entry);
+    entry->valid = false;
+  }
+
+  *result = entry;
+  return FE_OK;
+}
+
+/**
+ * Makes an entry filled with sector's data valid and the most recently used
+ * one. Must be called with cache lock held.
+ *
+ * @param cache  Cache.
+ * @param entry  Entry returned by ::fat32_fat_cache_evict.
+ * @param sector Sector number.
+ */
+static void
+fat32_fat_cache_insert(struct fat32_fat_cache_t *cache,
+                       struct fat32_fat_cache_entry_t *entry, uint32_t sector)
+{
+  struct fat32_fat_cache_entry_t **bucket =
+    &cache->buckets[sector & cache->buckets_mask];
+
+  entry->sector    = sector;
+  entry->valid     = true;
+  entry->dirty     = false;
+  entry->ra_mark   = false;
+  entry->hash_next = *bucket;
+  *bucket          = entry;
+
+  fat32_fat_cache_touch(cache, entry);
+}
+
+enum fat32_error_t
+fat32_fat_cache_get(const struct fat32_fat_t *fat, uint32_t sector,
+                    struct fat32_fat_cache_entry_t **result)
+{
+  struct fat32_fat_cache_t       *cache = fat->cache;
+  struct fat32_fat_cache_entry_t *entry = fat32_fat_cache_lookup(cache, sector);
+
+  if (entry != NULL) {
+    fat32_fat_cache_touch(cache, entry);
+
+    /* chain walk has reached readahead window: requesting the next one */
+    if (entry->ra_mark) {
+      entry->ra_mark = false;
+      fat32_fat_readahead(fat, sector + cache->ra_window);
+    }
+
+    *result = entry;
+    return FE_OK;
+  }
+
+  /* cache miss: evicting least recently used sector */
+  enum fat32_error_t ret = fat32_fat_cache_evict(fat, &entry);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  const struct fat32_bpb_t *bpb    = fat->bpb;
+  off_t                     offset =
+    fat32_sector_to_offset(bpb, fat->first_sector + sector);
+
+  ret = fat32_dev_read(fat->dev, entry->data, bpb->bytes_per_sector, offset);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  fat32_fat_cache_insert(cache, entry, sector);
+
+  /* chains mostly go forward so following sectors will be needed soon */
+  if (fat32_fat_cache_lookup(cache, sector + 1) == NULL) {
+    fat32_fat_readahead(fat, sector + 1);
+  }
+
+  *result = entry;
+  return FE_OK;
+}
+
+/**
+ * Readahead thread function.
+ *
+ * @param arg FAT object.
+ *
+ * @return Always NULL.
+ */
+static void *
+fat32_fat_readahead_thread(void *arg)
+{
+  const struct fat32_fat_t *fat   = arg;
+  struct fat32_fat_cache_t *cache = fat->cache;
+  uint32_t                  bps   = fat->bpb->bytes_per_sector;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  while (true) {
+    while (!cache->ra_stop && !cache->ra_queued) {
+      assert( pthread_cond_wait(&cache->ra_wakeup, &cache->lock) == 0 );
+    }
+
+    if (cache->ra_stop) {
+      break;
+    }
+
+    uint32_t start = cache->ra_start;
+    uint32_t end   = cache->ra_end;
+
+    cache->ra_queued     = false;
+    cache->ra_busy       = true;
+    cache->ra_busy_start = start;
+    cache->ra_busy_end   = end;
+    cache->ra_stale      = false;
+
+    assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+    /* the whole window is read by a single call without holding the lock */
+    off_t offset = fat32_sector_to_offset(fat->bpb,
+                                          fat->first_sector + start);
+    enum fat32_error_t ret =
+      fat32_dev_read(fat->dev, cache->ra_buffer,
+                     (size_t) (end - start) * bps, offset);
+
+    assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+    /* failed readahead is not an error: sectors will be read on demand; a
+     * sector written back meanwhile may have its old copy in the buffer so
+     * the rest of the window is dropped */
+    uint32_t count = (ret == FE_OK) ? end - start : 0;
+    for (uint32_t i = 0; i < count && !cache->ra_stale; ++i) {
+      struct fat32_fat_cache_entry_t *entry;
+
+      /* sectors read or modified in the meantime must not be replaced */
+      if (fat32_fat_cache_lookup(cache, start + i) != NULL) {
+        continue;
+      }
+
+      if (fat32_fat_cache_evict(fat, &entry) != FE_OK) {
+        break;
+      }
+
+      memcpy(entry->data, cache->ra_buffer + (size_t) i * bps, bps);
+      fat32_fat_cache_insert(cache, entry, start + i);
+      entry->ra_mark = (i == 0);
+    }
+
+    cache->ra_busy = false;
+    assert( pthread_cond_broadcast(&cache->ra_done) == 0 );
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return NULL;
+}
+
+void
+fat32_fat_readahead(const struct fat32_fat_t *fat, uint32_t sector)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+  uint32_t                  end   = sector + cache->ra_window;
+
+  if (cache->ra_window == 0 || sector >= fat->bpb->fat_size) {
+    return;
+  }
+
+  if (end > fat->bpb->fat_size) {
+    end = fat->bpb->fat_size;
+  }
+
+  /* the window is being read already */
+  if (cache->ra_busy &&
+      sector >= cache->ra_busy_start && sector < cache->ra_busy_end) {
+    return;
+  }
+
+  /* only the latest request is kept */
+  cache->ra_queued = true;
+  cache->ra_start  = sector;
+  cache->ra_end    = end;
+
+  assert( pthread_cond_signal(&cache->ra_wakeup) == 0 );
+}
+
+void
+fat32_fat_readahead_wait(const struct fat32_fat_t *fat, uint32_t sector)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+
+  while (fat32_fat_cache_lookup(cache, sector) == NULL &&
+         ((cache->ra_busy &&
+           sector >= cache->ra_busy_start && sector < cache->ra_busy_end) ||
+          (cache->ra_queued &&
+           sector >= cache->ra_start && sector < cache->ra_end))) {
+    assert( pthread_cond_wait(&cache->ra_done, &cache->lock) == 0 );
+  }
+}
+
+enum fat32_error_t
+fat32_fat_readahead_start(struct fat32_fat_t *fat)
+{
+  struct fat32_fat_cache_t *cache  = fat->cache;
+  uint32_t                  window = fat->readahead;
+  int                       ret;
+
+  if (cache->ra_window != 0) {
+    return FE_OK;
+  }
+
+  /* the window must fit into the cache together with the sector which
+   * triggered readahead */
+  if (window >= cache->size) {
+    window = cache->size - 1;
+  }
+
+  if (window == 0) {
+    return FE_OK;
+  }
+
+  cache->ra_buffer =
+    fat32_dev_alloc((size_t) window * fat->bpb->bytes_per_sector);
+  if (cache->ra_buffer == NULL) {
+    return FE_ERRNO;
+  }
+
+  cache->ra_stop   = false;
+  cache->ra_queued = false;
+  cache->ra_busy   = false;
+
+  ret = pthread_cond_init(&cache->ra_wakeup, NULL);
+  if (ret != 0) {
+    goto free_buffer;
+  }
+
+  ret = pthread_cond_init(&cache->ra_done, NULL);
+  if (ret != 0) {
+    goto destroy_wakeup;
+  }
+
+  ret = pthread_create(&cache->ra_thread, NULL,
+                       fat32_fat_readahead_thread, fat);
+  if (ret != 0) {
+    goto destroy_done;
+  }
+
+  cache->ra_window = window;
+
+  return FE_OK;
+
+destroy_done:
+  pthread_cond_destroy(&cache->ra_done);
+destroy_wakeup:
+  pthread_cond_destroy(&cache->ra_wakeup);
+free_buffer:
+  free(cache->ra_buffer);
+  cache->ra_buffer = NULL;
+
+  errno = ret;
+  return FE_ERRNO;
+}
+
+void
+fat32_fat_readahead_stop(struct fat32_fat_t *fat)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+
+  if (cache->ra_window == 0) {
+    return;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+  cache->ra_stop = true;
+  assert( pthread_cond_signal(&cache->ra_wakeup) == 0 );
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  assert( pthread_join(cache->ra_thread, NULL) == 0 );
+
+  pthread_cond_destroy(&cache->ra_done);
+  pthread_cond_destroy(&cache->ra_wakeup);
+  free(cache->ra_buffer);
+  cache->ra_buffer = NULL;
+  cache->ra_window = 0;
+}
+
+enum fat32_error_t
+fat32_fat_entry_pointer(const struct fat32_fat_t *fat, uint32_t cluster,
+                        fat32_fat_entry_t **entry,
+                        struct fat32_fat_cache_entry_t **sector)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+
+  if (cache->table != NULL) {
+    if (cluster >= cache->table_entries) {
+      return FE_INVALID_FS;
+    }
+
+    *entry = &cache->table[cluster];
+    if (sector != NULL) {
+      *sector = NULL;
+    }
+
+    return FE_OK;
+  }
+
+  /* an offset of the entry in a FAT corresponding to @em cluster */
+  uint32_t entry_fat_offset    = cluster * FAT32_FAT_ENTRY_SIZE;
+  uint32_t entry_sector        =
+    entry_fat_offset >> fat->bytes_per_sector_log;
+  uint32_t entry_sector_offset =
+    entry_fat_offset & (fat->bpb->bytes_per_sector - 1);
+
+  struct fat32_fat_cache_entry_t *cache_entry;
+  enum fat32_error_t ret = fat32_fat_cache_get(fat, entry_sector,
+                                               &cache_entry);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  *entry = (fat32_fat_entry_t *) (cache_entry->data + entry_sector_offset);
+  if (sector != NULL) {
+    *sector = cache_entry;
+  }
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_fat_get_entry(const struct fat32_fat_t *fat,
+                    uint32_t cluster, fat32_fat_entry_t *entry)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+  fat32_fat_entry_t        *p;
+
+  if (cache->table != NULL) {
+    /* preloaded FAT is read without locking as aligned 32-bit entries are
+     * always updated atomically */
+    if (cluster >= cache->table_entries) {
+      return FE_INVALID_FS;
+    }
+
+    *entry = cache->table[cluster];
+    return FE_OK;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  /* it's cheaper to wait for the sector being read ahead than to read it
+   * once more */
+  fat32_fat_readahead_wait(fat, (cluster * FAT32_FAT_ENTRY_SIZE) >>
+                                fat->bytes_per_sector_log);
+
+  enum fat32_error_t ret = fat32_fat_entry_pointer(fat, cluster, &p, NULL);
+  if (ret == FE_OK) {
+    *entry = *p;
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fat_get_nth_entry(const struct fat32_fat_t *fat,
+                        uint32_t cluster, uint32_t n,
+                        fat32_fat_entry_t *entry)
+{
+  *entry     = cluster;
+  uint32_t i = 0;
+  while (i < n) {
+    uint32_t length;
+
+    /* physically contiguous parts of the chain are skipped at once */
+    enum fat32_error_t ret = fat32_fat_get_run(fat, cluster, &length, entry);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    if (n - i < length) {
+      *entry = cluster + (n - i);
+      return FE_OK;
+    }
+    i += length - 1;
+
+    if (fat32_fat_entry_is_null(*entry)) {
+      return FE_CLUSTER_CHAIN_ENDED;
+    }
+
+    cluster = fat32_fat_entry_to_cluster(*entry);
+    if (fat32_fat_entry_is_bad(*entry) ||
+        fat32_fat_entry_is_free(*entry)) {
+      return FE_INVALID_FS;
+    }
+    ++i;
+  }
+
+  return FE_OK;
+}
+
+/// end of cluster chain mark
+static const fat32_fat_entry_t FAT32_FAT_ENTRY_EOC = 0x0ffffff8;
+
+/// one of the possible FAT entry values which marks cluster as free
+static const fat32_fat_entry_t FAT32_FAT_ENTRY_EMPTY = 0x00000000;
+bool
+fat32_fat_entry_is_null(fat32_fat_entry_t entry)
+{
+  return entry >= FAT32_FAT_ENTRY_EOC;
+}
+
+/// mask that matches 28-bits in 32-bit fat entry which are actually are
+/// used
+static const fat32_fat_entry_t FAT32_FAT_ENTRY_MASK = 0x0fffffff;
+
+/// bad cluster fat entry mark
+static const uint32_t FAT32_FAT_ENTRY_BAD           = 0x0ffffff7;
+bool
+fat32_fat_entry_is_bad(fat32_fat_entry_t entry)
+{
+  return (entry & FAT32_FAT_ENTRY_MASK) == FAT32_FAT_ENTRY_BAD;
+}
+
+uint32_t
+fat32_fat_entry_to_cluster(fat32_fat_entry_t entry)
+{
+  return (uint32_t) (entry & FAT32_FAT_ENTRY_MASK);
+}
+
+/**
+ * Counts leading FAT entries each pointing to the cluster following its own
+ * one, i.e. entries[i] == cluster + i + 1.
+ *
+ * @param entries FAT entries.
+ * @param count   A number of entries.
+ * @param cluster Cluster number corresponding to the first entry.
+ *
+ * @return A number of matching entries.
+ */
+static uint32_t
+fat32_fat_run_length(const fat32_fat_entry_t *entries, uint32_t count,
+                     uint32_t cluster)
+{
+  uint32_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i mask     = _mm256_set1_epi32(FAT32_FAT_ENTRY_MASK);
+  const __m256i step     = _mm256_set1_epi32(8);
+  __m256i       expected = _mm256_setr_epi32(cluster + 1, cluster + 2,
+                                             cluster + 3, cluster + 4,
+                                             cluster + 5, cluster + 6,
+                                             cluster + 7, cluster + 8);
+
+  for (; i + 8 <= count; i += 8) {
+    __m256i values =
+      _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (entries + i)),
+                       mask);
+    int equal = _mm256_movemask_ps(
+      _mm256_castsi256_ps(_mm256_cmpeq_epi32(values, expected)));
+
+    if (equal != 0xff) {
+      return i + __builtin_ctz(~equal);
+    }
+
+    expected = _mm256_add_epi32(expected, step);
+  }
+#elif defined(__SSE2__)
+  const __m128i mask     = _mm_set1_epi32(FAT32_FAT_ENTRY_MASK);
+  const __m128i step     = _mm_set1_epi32(4);
+  __m128i       expected = _mm_setr_epi32(cluster + 1, cluster + 2,
+                                          cluster + 3, cluster + 4);
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i values =
+      _mm_and_si128(_mm_loadu_si128((const __m128i *) (entries + i)), mask);
+    int equal = _mm_movemask_ps(
+      _mm_castsi128_ps(_mm_cmpeq_epi32(values, expected)));
+
+    if (equal != 0xf) {
+      return i + __builtin_ctz(~equal);
+    }
+
+    expected = _mm_add_epi32(expected, step);
+  }
+#endif
+
+  /* the tail or everything if there are no vector instructions */
+  for (; i < count; ++i) {
+    if ((entries[i] & FAT32_FAT_ENTRY_MASK) != cluster + i + 1) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+enum fat32_error_t
+fat32_fat_get_run(const struct fat32_fat_t *fat, uint32_t cluster,
+                  uint32_t *length, fat32_fat_entry_t *entry)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+
+  if (cluster >= fat->clusters_end) {
+    return FE_INVALID_FS;
+  }
+
+  if (cache->table != NULL) {
+    /* the last cluster can't point to the next one */
+    uint32_t count   = fat->clusters_end - cluster - 1;
+    uint32_t matched = fat32_fat_run_length(cache->table + cluster,
+                                            count, cluster);
+
+    *length = matched + 1;
+    *entry  = cache->table[cluster + matched];
+    return FE_OK;
+  }
+
+  enum fat32_error_t ret   = FE_OK;
+  uint32_t           bps   = fat->bpb->bytes_per_sector;
+  uint32_t           start = cluster;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  /* the run is followed a sector at a time */
+  while (true) {
+    fat32_fat_entry_t *p;
+
+    fat32_fat_readahead_wait(fat, (cluster * FAT32_FAT_ENTRY_SIZE) >>
+                                  fat->bytes_per_sector_log);
+
+    ret = fat32_fat_entry_pointer(fat, cluster, &p, NULL);
+    if (ret != FE_OK) {
+      break;
+    }
+
+    uint32_t count   =
+      (bps - ((cluster * FAT32_FAT_ENTRY_SIZE) & (bps - 1))) /
+      FAT32_FAT_ENTRY_SIZE;
+    bool     last    = (fat->clusters_end - cluster - 1 < count);
+    if (last) {
+      count = fat->clusters_end - cluster - 1;
+    }
+
+    uint32_t matched = fat32_fat_run_length(p, count, cluster);
+
+    cluster += matched;
+    if (matched < count || last) {
+      *length = cluster - start + 1;
+      *entry  = p[matched];
+      break;
+    }
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
+}
+
+bool
+fat32_fat_entry_is_free(fat32_fat_entry_t entry)
+{
+  return (entry & FAT32_FAT_ENTRY_MASK) == 0;
+}
+
+uint32_t
+fat32_fat_free_map_search(const uint64_t *free_map,
+                          uint32_t from, uint32_t to)
+{
+  if (from >= to) {
+    return to;
+  }
+
+  uint32_t index = from / 64;
+  uint64_t word  = free_map[index] & (~((uint64_t) 0) << (from % 64));
+
+  while (word == 0) {
+    if (++index >= (to + 63) / 64) {
+      return to;
+    }
+
+    word = free_map[index];
+  }
+
+  uint32_t cluster = index * 64 + __builtin_ctzll(word);
+
+  return (cluster < to) ? cluster : to;
+}
+
+enum fat32_error_t
+fat32_fat_find_free_cluster(struct fat32_fat_t *fat, uint32_t *cluster)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+  uint32_t                  end   = fat->clusters_end;
+  uint32_t                  hint  = fat->free_cluster_hint;
+  enum fat32_error_t        ret   = FE_FS_IS_FULL;
+
+  if (hint < FAT32_MIN_CLUSTER_NUMBER || hint >= end) {
+    hint = FAT32_MIN_CLUSTER_NUMBER;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  ret = fat32_fat_free_map_ensure(fat);
+  if (ret != FE_OK) {
+    goto unlock;
+  }
+  ret = FE_FS_IS_FULL;
+
+  uint32_t candidate = fat32_fat_free_map_search(fat->free_map, hint, end);
+  if (candidate == end) {
+    candidate = fat32_fat_free_map_search(fat->free_map,
+                                          FAT32_MIN_CLUSTER_NUMBER, hint);
+    if (candidate == hint) {
+      candidate = end;
+    }
+  }
+
+  if (candidate != end) {
+    fat->free_cluster_hint = candidate;
+    *cluster               = candidate;
+    ret                    = FE_OK;
+  }
+
+unlock:
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
+}
+
+uint32_t
+fat32_fat_used_map_search(const uint64_t *free_map,
+                          uint32_t from, uint32_t to)
+{
+  if (from >= to) {
+    return to;
+  }
+
+  uint32_t index = from / 64;
+  uint64_t word  = ~free_map[index] & (~((uint64_t) 0) << (from % 64));
+
+  while (word == 0) {
+    if (++index >= (to + 63) / 64) {
+      return to;
+    }
+
+    word = ~free_map[index];
+  }
+
+  uint32_t cluster = index * 64 + __builtin_ctzll(word);
+
+  return (cluster < to) ? cluster : to;
+}
 
 /**
- * Finds an offset of the FAT entry corresponding to the specified cluster
- * on the device.
+ * Looks for a run of free clusters for ::fat32_fat_allocate_run in the given
+ * range. Must be called with cache lock held.
  *
- * @param fat     FAT object.
- * @param cluster Cluster number.
+ * @param      fat    FAT object.
+ * @param      from   The first cluster number to check.
+ * @param      to     A number following the last cluster number to check.
+ * @param      wanted Desired run length.
+ * @param[out] best   The longest run found so far. Updated if longer run is
+ *                    found in the range.
  *
- * @return Offset.
+ * @return @em true if a run of at least @em wanted clusters is found.
  */
-static off_t
-fat32_fat_entry_offset(const struct fat32_fat_t *fat, uint32_t cluster);
+static bool
+fat32_fat_find_run_in_range(const struct fat32_fat_t *fat,
+                            uint32_t from, uint32_t to, uint32_t wanted,
+                            struct fat32_fat_run_t *best)
+{
+  uint32_t start = fat32_fat_free_map_search(fat->free_map, from, to);
+
+  while (start < to) {
+    uint32_t end = fat32_fat_used_map_search(fat->free_map, start, to);
+
+    if (end - start > best->length) {
+      best->start  = start;
+      best->length = end - start;
+
+      if (best->length >= wanted) {
+        best->length = wanted;
+        return true;
+      }
+    }
+
+    start = fat32_fat_free_map_search(fat->free_map, end, to);
+  }
+
+  return false;
+}
 
 /**
- * Sets a FAT entry of the cluster to the specified value.
+ * The same as ::fat32_fat_allocate_run but must be called with cache lock
+ * held.
  *
- * @param fat     FAT object.
- * @param cluster Cluster number.
- * @param entry   Desired FAT entry value.
+ * @param      fat    FAT object.
+ * @param      wanted Desired number of clusters.
+ * @param      near   A cluster after which the run is preferred to start.
+ * @param[out] run    Found run.
  *
  * @retval FE_OK
- * @retval FE_ERRNO
+ * @retval FE_FS_IS_FULL
  */
 static enum fat32_error_t
-fat32_fat_set_entry(const struct fat32_fat_t *fat,
-                    uint32_t cluster, fat32_fat_entry_t entry);
-
-enum fat32_error_t
-fat32_fat_init(struct fat32_fat_t *fat,
-               const struct fat32_fs_t *fs)
+fat32_fat_allocate_run_locked(struct fat32_fat_t *fat,
+                              uint32_t wanted, uint32_t near,
+                              struct fat32_fat_run_t *run)
 {
-  int fd = dup(fs->fd);
-  if (fd < 0) {
-    return FE_ERRNO;
+  uint32_t end  = fat->clusters_end;
+  uint32_t hint = fat->free_cluster_hint;
+
+  run->start  = 0;
+  run->length = 0;
+
+  if (wanted == 0) {
+    return FE_OK;
   }
 
-  fat->fd                = fd;
-  fat->bpb               = fs->bpb;
-  fat->fs_info           = fs->fs_info;
-  /* we set a hint to the minimum possible cluster number as opposite to
-   * free cluster hint from fsinfo because the latter can contain incorrect
-   * information */
-  fat->free_cluster_hint = FAT32_MIN_CLUSTER_NUMBER;
+  /* continuing the chain physically is always the best choice */
+  if (near >= FAT32_MIN_CLUSTER_NUMBER && near + 1 < end) {
+    uint32_t run_end = fat32_fat_used_map_search(fat->free_map, near + 1, end);
 
-  fat->bytes_per_sector_log =
-    fat32_highest_bit_number(fs->bpb->bytes_per_sector);
+    if (run_end > near + 1) {
+      run->start  = near + 1;
+      run->length = run_end - run->start;
+      if (run->length > wanted) {
+        run->length = wanted;
+      }
 
-  return FE_OK;
-}
+      return FE_OK;
+    }
+  }
 
-enum fat32_error_t
-fat32_fat_finalize(struct fat32_fat_t *fat)
-{
-  if (xclose(fat->fd) < 0) {
-    return FE_ERRNO;
+  if (hint < FAT32_MIN_CLUSTER_NUMBER || hint >= end) {
+    hint = FAT32_MIN_CLUSTER_NUMBER;
   }
 
-  return FE_OK;
-}
+  /* next fit: the first run which is long enough starting from the hint;
+   * if there is no such run the longest one is used */
+  if (!fat32_fat_find_run_in_range(fat, hint, end, wanted, run)) {
+    fat32_fat_find_run_in_range(fat, FAT32_MIN_CLUSTER_NUMBER, hint,
+                                wanted, run);
+  }
 
-/// a size in bytes of entry in file allocation table
-static const uint8_t  FAT32_FAT_ENTRY_SIZE = sizeof(fat32_fat_entry_t);
+  return (run->length == 0) ? FE_FS_IS_FULL : FE_OK;
+}
 
-off_t
-fat32_fat_entry_offset(const struct fat32_fat_t *fat, uint32_t cluster)
+enum fat32_error_t
+fat32_fat_allocate_run(struct fat32_fat_t *fat, uint32_t wanted,
+                       uint32_t near, struct fat32_fat_run_t *run)
 {
-  /* an offset of the entry in a FAT corresponding to @em cluster */
-  uint32_t entry_fat_offset    = cluster * FAT32_FAT_ENTRY_SIZE;
-  uint32_t entry_sector        =
-    fat->bpb->reserved_sectors_count +
-    (entry_fat_offset / fat->bpb->bytes_per_sector);
-  uint32_t entry_sector_offset = entry_fat_offset % fat->bpb->bytes_per_sector;
+  struct fat32_fat_cache_t *cache = fat->cache;
 
-  return fat32_sector_offset_to_offset(fat->bpb,
-                                       entry_sector,
-                                       entry_sector_offset);
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+  enum fat32_error_t ret = fat32_fat_free_map_ensure(fat);
+  if (ret == FE_OK) {
+    ret = fat32_fat_allocate_run_locked(fat, wanted, near, run);
+  }
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
 }
 
 enum fat32_error_t
-fat32_fat_get_entry(const struct fat32_fat_t *fat,
-                    uint32_t cluster, fat32_fat_entry_t *entry)
+fat32_fat_free_partial_chain_locked(const struct fat32_fat_t *fat,
+                                    uint32_t previous, uint32_t first,
+                                    uint32_t failed)
 {
-  off_t offset = fat32_fat_entry_offset(fat, cluster);
+  enum fat32_error_t ret;
 
-  off_t ret = lseek(fat->fd, offset, SEEK_SET);
-  if (ret == (off_t) -1) {
-    return FE_ERRNO;
+  if (previous != 0 && previous != failed) {
+    ret = fat32_fat_set_entry_locked(fat, previous, FAT32_FAT_ENTRY_EOC);
+    if (ret != FE_OK) {
+      return ret;
+    }
   }
 
-  ssize_t nread = xread(fat->fd, entry, FAT32_FAT_ENTRY_SIZE);
-  if (nread >= 0) {
-    if (nread < FAT32_FAT_ENTRY_SIZE) {
-      return FE_INVALID_DEV;
+  uint32_t cluster = first;
+  while (cluster >= FAT32_MIN_CLUSTER_NUMBER && cluster < fat->clusters_end &&
+         cluster != failed) {
+    fat32_fat_entry_t *p;
+
+    ret = fat32_fat_entry_pointer(fat, cluster, &p, NULL);
+    if (ret != FE_OK) {
+      return ret;
     }
-  } else {
-    return FE_ERRNO;
+
+    fat32_fat_entry_t entry = *p;
+    if (fat32_fat_entry_is_free(entry)) {
+      break;
+    }
+
+    ret = fat32_fat_set_entry_locked(fat, cluster, FAT32_FAT_ENTRY_EMPTY);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    if (fat32_fat_entry_is_null(entry)) {
+      break;
+    }
+
+    cluster = fat32_fat_entry_to_cluster(entry);
   }
 
   return FE_OK;
 }
 
 enum fat32_error_t
-fat32_fat_get_nth_entry(const struct fat32_fat_t *fat,
-                        uint32_t cluster, uint32_t n,
-                        fat32_fat_entry_t *entry)
+fat32_fat_allocate_chain(struct fat32_fat_t *fat, uint32_t count,
+                         uint32_t reserved, uint32_t previous,
+                         uint32_t *first, uint32_t *extents)
 {
-  *entry     = cluster;
-  uint32_t i = 0;
-  while (i < n) {
-    enum fat32_error_t ret = fat32_fat_get_entry(fat, cluster, entry);
+  struct fat32_fat_cache_t *cache  = fat->cache;
+  enum fat32_error_t        ret    = FE_OK;
+  uint32_t                  last   = previous;
+  uint32_t                  failed = 0;
+
+  *first   = 0;
+  *extents = 0;
+
+  if (count == 0) {
+    return FE_OK;
+  }
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  ret = fat32_fat_free_map_ensure(fat);
+  if (ret != FE_OK) {
+    goto unlock;
+  }
+
+  assert( reserved <= count && reserved <= fat->reserved );
+
+  /* clusters reserved for someone else can't be taken */
+  if (fat->fs_info->last_free_count - (fat->reserved - reserved) < count) {
+    ret = FE_FS_IS_FULL;
+    goto unlock;
+  }
+
+  while (count > 0) {
+    struct fat32_fat_run_t run;
+
+    ret = fat32_fat_allocate_run_locked(fat, count, last, &run);
     if (ret != FE_OK) {
-      return ret;
+      /* can't happen as free clusters count has been checked */
+      goto unlock;
     }
 
-    if (fat32_fat_entry_is_null(*entry)) {
-      return FE_CLUSTER_CHAIN_ENDED;
+    if (last == 0 || last + 1 != run.start) {
+      ++*extents;
     }
 
-    cluster = fat32_fat_entry_to_cluster(*entry);
-    if (fat32_fat_entry_is_bad(*entry) ||
-        fat32_fat_entry_is_free(*entry)) {
-      return FE_INVALID_FS;
+    if (*first == 0) {
+      *first = run.start;
     }
-    ++i;
+
+    /* linking the run to the chain and its clusters to each other */
+    if (last != 0) {
+      ret = fat32_fat_set_entry_locked(fat, last, run.start);
+      if (ret != FE_OK) {
+        failed = last;
+        goto inconsistent;
+      }
+    }
+
+    uint32_t run_end = run.start + run.length;
+    for (uint32_t cluster = run.start; cluster < run_end - 1; ++cluster) {
+      ret = fat32_fat_set_entry_locked(fat, cluster, cluster + 1);
+      if (ret != FE_OK) {
+        failed = cluster;
+        goto inconsistent;
+      }
+    }
+
+    /* the last cluster is marked as the end of the chain right away so that
+     * it's not found free by the next search */
+    ret = fat32_fat_set_entry_locked(fat, run_end - 1, FAT32_FAT_ENTRY_EOC);
+    if (ret != FE_OK) {
+      failed = run_end - 1;
+      goto inconsistent;
+    }
+
+    last                   = run_end - 1;
+    count                 -= run.length;
+    fat->free_cluster_hint = run_end;
   }
 
-  return FE_OK;
+  fat->reserved -= reserved;
+
+  goto unlock;
+
+inconsistent:
+  /* The caller doesn't reference the clusters linked so far so they would
+   * be lost. The end of an earlier run which could not be linked to the next
+   * one can't be freed as its entry can't be written. If anything is lost
+   * the next mount has to scan FAT. */
+  if ((failed == last && last != previous) ||
+      fat32_fat_free_partial_chain_locked(fat, previous, *first,
+                                          failed) != FE_OK) {
+    fat->inconsistent = true;
+  }
+
+  ret = FE_FS_INCONSISTENT;
+
+unlock:
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
 }
 
-/// end of cluster chain mark
-static const fat32_fat_entry_t FAT32_FAT_ENTRY_EOC = 0x0ffffff8;
-bool
-fat32_fat_entry_is_null(fat32_fat_entry_t entry)
+uint32_t
+fat32_fat_free_clusters(const struct fat32_fat_t *fat)
 {
-  return entry >= FAT32_FAT_ENTRY_EOC;
+  struct fat32_fat_cache_t *cache = fat->cache;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+  uint32_t free = fat->fs_info->last_free_count - fat->reserved;
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return free;
 }
 
-/// mask that matches 28-bits in 32-bit fat entry which are actually are
-/// used
-static const fat32_fat_entry_t FAT32_FAT_ENTRY_MASK = 0x0fffffff;
+enum fat32_error_t
+fat32_fat_reserve(struct fat32_fat_t *fat, uint32_t count)
+{
+  struct fat32_fat_cache_t *cache = fat->cache;
+  enum fat32_error_t        ret   = FE_OK;
 
-/// bad cluster fat entry mark
-static const uint32_t FAT32_FAT_ENTRY_BAD           = 0x0ffffff7;
-bool
-fat32_fat_entry_is_bad(fat32_fat_entry_t entry)
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  if (fat->fs_info->last_free_count - fat->reserved < count) {
+    ret = FE_FS_IS_FULL;
+  } else {
+    fat->reserved += count;
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  return ret;
+}
+
+void
+fat32_fat_unreserve(struct fat32_fat_t *fat, uint32_t count)
 {
-  return (entry & FAT32_FAT_ENTRY_MASK) == FAT32_FAT_ENTRY_BAD;
+  struct fat32_fat_cache_t *cache = fat->cache;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  assert( count <= fat->reserved );
+  fat->reserved -= count;
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
 }
 
-uint32_t
-fat32_fat_entry_to_cluster(fat32_fat_entry_t entry)
+void
+fat32_fat_scan_entries(struct fat32_fat_scan_range_t *range,
+                       const fat32_fat_entry_t *entries,
+                       uint32_t first, uint32_t count)
 {
-  return (uint32_t) (entry & FAT32_FAT_ENTRY_MASK);
+  uint64_t *free_map = range->fat->free_map;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t          cluster = first + i;
+    fat32_fat_entry_t entry   = entries[i] & FAT32_FAT_ENTRY_MASK;
+
+    if (cluster < FAT32_MIN_CLUSTER_NUMBER) {
+      continue;
+    }
+
+    if (entry == 0) {
+      free_map[cluster / 64] |= (uint64_t) 1 << (cluster % 64);
+      ++range->free_count;
+    } else if (entry == FAT32_FAT_ENTRY_BAD) {
+      ++range->bad_count;
+    }
+  }
 }
 
-bool
-fat32_fat_entry_is_free(fat32_fat_entry_t entry)
+/// a number of bytes of FAT read at once while building free clusters bitmap
+static const size_t FAT32_FAT_SCAN_CHUNK = 256 * 1024;
+
+/// maximum number of threads scanning FAT simultaneously
+static const uint32_t FAT32_FAT_SCAN_MAX_THREADS = 8;
+
+/// minimum number of FAT bytes worth scanning by a separate thread
+static const size_t FAT32_FAT_SCAN_MIN_RANGE = 4 * 1024 * 1024;
+
+void *
+fat32_fat_scan_range(void *arg)
 {
-  return (entry & FAT32_FAT_ENTRY_MASK) == 0;
+  struct fat32_fat_scan_range_t *range = arg;
+  const struct fat32_fat_t      *fat   = range->fat;
+
+  if (fat->cache->table != NULL) {
+    fat32_fat_scan_entries(range, fat->cache->table + range->first,
+                           range->first, range->end - range->first);
+    return NULL;
+  }
+
+  fat32_fat_entry_t *buffer = fat32_dev_alloc(FAT32_FAT_SCAN_CHUNK);
+  uint32_t           chunk  = FAT32_FAT_SCAN_CHUNK / sizeof(fat32_fat_entry_t);
+  off_t              offset =
+    fat32_sector_to_offset(fat->bpb, fat->first_sector);
+
+  if (buffer == NULL) {
+    range->ret   = FE_ERRNO;
+    range->error = errno;
+    return NULL;
+  }
+
+  for (uint32_t first = range->first;
+       first < range->end && range->ret == FE_OK; first += chunk) {
+    uint32_t count = (range->end - first < chunk) ? range->end - first : chunk;
+    size_t   size  = count * sizeof(fat32_fat_entry_t);
+
+    /* positioned reads let threads share the device */
+    enum fat32_error_t ret =
+      fat32_dev_read(fat->dev, buffer, size,
+                     offset + (off_t) first * sizeof(fat32_fat_entry_t));
+    if (ret != FE_OK) {
+      range->ret   = ret;
+      range->error = errno;
+    } else {
+      fat32_fat_scan_entries(range, buffer, first, count);
+    }
+  }
+
+  free(buffer);
+
+  return NULL;
 }
 
 enum fat32_error_t
-fat32_fat_find_free_cluster(struct fat32_fat_t *fat, uint32_t *cluster)
+fat32_fat_build_free_map(struct fat32_fat_t *fat)
+{
+  uint32_t           end = fat->clusters_end;
+  enum fat32_error_t ret = FE_OK;
+  struct timespec    start_time;
+  struct timespec    end_time;
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  fat->free_map = calloc((end + 63) / 64, sizeof(uint64_t));
+  if (fat->free_map == NULL) {
+    return FE_ERRNO;
+  }
+
+  /* preloaded FAT is scanned by a single thread as it's already in memory */
+  uint32_t threads = 1;
+  if (fat->cache->table == NULL) {
+    long   cpus   = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t ranges = ((size_t) end * sizeof(fat32_fat_entry_t)) /
+                    FAT32_FAT_SCAN_MIN_RANGE;
+
+    threads = (cpus > 0) ? cpus : 1;
+    if (threads > FAT32_FAT_SCAN_MAX_THREADS) {
+      threads = FAT32_FAT_SCAN_MAX_THREADS;
+    }
+    if (threads > ranges) {
+      threads = (ranges > 0) ? ranges : 1;
+    }
+  }
+
+  struct fat32_fat_scan_range_t ranges[threads];
+  pthread_t                     ids[threads];
+  bool                          started[threads];
+
+  /* ranges are aligned on bitmap words so that threads never modify the
+   * same word and on device blocks so that direct I/O can be used */
+  uint32_t step = ((end / threads + 1023) / 1024) * 1024;
+
+  for (uint32_t i = 0; i < threads; ++i) {
+    struct fat32_fat_scan_range_t *range = &ranges[i];
+
+    range->fat        = fat;
+    range->first      = (i * step < end) ? i * step : end;
+    range->end        = (i == threads - 1 || (i + 1) * step > end) ?
+                        end : (i + 1) * step;
+    range->free_count = 0;
+    range->bad_count  = 0;
+    range->ret        = FE_OK;
+    range->error      = 0;
+
+    /* the last range is scanned by the calling thread */
+    started[i] = (i != threads - 1) &&
+      pthread_create(&ids[i], NULL, fat32_fat_scan_range, range) == 0;
+    if (!started[i]) {
+      fat32_fat_scan_range(range);
+    }
+  }
+
+  uint32_t free_count = 0;
+  uint32_t bad_count  = 0;
+
+  for (uint32_t i = 0; i < threads; ++i) {
+    if (started[i]) {
+      assert( pthread_join(ids[i], NULL) == 0 );
+    }
+
+    if (ranges[i].ret != FE_OK && ret == FE_OK) {
+      ret   = ranges[i].ret;
+      errno = ranges[i].error;
+    }
+
+    free_count += ranges[i].free_count;
+    bad_count  += ranges[i].bad_count;
+  }
+
+  if (ret != FE_OK) {
+    free(fat->free_map);
+    fat->free_map = NULL;
+    return ret;
+  }
+
+  fat->fs_info->last_free_count = free_count;
+
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  log_info("FAT scanned in %.3f ms by %" PRIu32 " thread(s): "
+           "%" PRIu32 " free and %" PRIu32 " bad clusters",
+           (end_time.tv_sec - start_time.tv_sec) * 1e3 +
+           (end_time.tv_nsec - start_time.tv_nsec) / 1e6,
+           threads, free_count, bad_count);
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_fat_free_map_ensure(struct fat32_fat_t *fat)
 {
-  uint32_t candidate = fat->free_cluster_hint;
-  uint32_t total     =
-    fat32_bpb_clusters_count(fat->bpb) + FAT32_MIN_CLUSTER_NUMBER;
+  if (fat->free_map != NULL) {
+    return FE_OK;
+  }
+
+  if (fat->cache->table == NULL) {
+    uint8_t first_copy;
+    uint8_t end_copy;
 
-  while (candidate < total) {
-    fat32_fat_entry_t  entry;
-    enum fat32_error_t ret = fat32_fat_get_entry(fat, candidate, &entry);
+    fat32_fat_copies(fat, &first_copy, &end_copy);
+
+    enum fat32_error_t ret =
+      fat32_fat_sync_entries(fat, first_copy, end_copy);
     if (ret != FE_OK) {
       return ret;
     }
+  }
 
-    if (fat32_fat_entry_is_free(entry)) {
-      fat->free_cluster_hint = candidate;
-      return candidate;
+  log_info("Building free clusters bitmap.");
+
+  return fat32_fat_build_free_map(fat);
+}
+
+void
+fat32_fat_mark_dirty(const struct fat32_fat_t *fat, uint32_t cluster,
+                     struct fat32_fat_cache_entry_t *sector)
+{
+  if (sector != NULL) {
+    sector->dirty = true;
+  } else {
+    uint32_t number = (cluster * FAT32_FAT_ENTRY_SIZE) >>
+                      fat->bytes_per_sector_log;
+
+    fat->cache->table_dirty[number / 8] |= 1 << (number % 8);
+  }
+}
+
+enum fat32_error_t
+fat32_fat_set_volume_clean(struct fat32_fat_t *fat, bool clean)
+{
+  struct fat32_fat_cache_t       *cache = fat->cache;
+  struct fat32_fat_cache_entry_t *sector;
+  fat32_fat_entry_t              *entry;
+
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+
+  enum fat32_error_t ret = fat32_fat_entry_pointer(fat, 1, &entry, &sector);
+  if (ret == FE_OK) {
+    if (clean) {
+      *entry |= FAT32_FAT_CLEAN_SHUTDOWN;
+    } else {
+      *entry &= ~FAT32_FAT_CLEAN_SHUTDOWN;
     }
 
-    ++candidate;
+    fat32_fat_mark_dirty(fat, 1, sector);
+  }
+
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
+
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  ret = fat32_fat_sync(fat);
+  if (ret != FE_OK) {
+    return ret;
   }
-  return FE_FS_IS_FULL;
+
+  /* the bit must reach the disk before any other modification does */
+  return fat32_dev_sync(fat->dev);
 }
 
 
@@ -205,24 +2299,49 @@ enum fat32_error_t
 fat32_fat_set_entry(const struct fat32_fat_t *fat,
                     uint32_t cluster, fat32_fat_entry_t entry)
 {
-  off_t offset = fat32_fat_entry_offset(fat, cluster);
+  struct fat32_fat_cache_t *cache = fat->cache;
 
-  off_t ret = lseek(fat->fd, offset, SEEK_SET);
-  if (ret == (off_t) -1) {
-    return FE_ERRNO;
-  }
+  assert( pthread_mutex_lock(&cache->lock) == 0 );
+  enum fat32_error_t ret = fat32_fat_set_entry_locked(fat, cluster, entry);
+  assert( pthread_mutex_unlock(&cache->lock) == 0 );
 
-  ssize_t nwritten = xwrite(fat->fd, &entry, FAT32_FAT_ENTRY_SIZE);
-  if (nwritten == -1) {
-    return FE_ERRNO;
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fat_set_entry_locked(const struct fat32_fat_t *fat,
+                           uint32_t cluster, fat32_fat_entry_t entry)
+{
+  struct fat32_fat_cache_entry_t *sector;
+  fat32_fat_entry_t              *p;
+
+  enum fat32_error_t ret = fat32_fat_entry_pointer(fat, cluster, &p, &sector);
+  if (ret == FE_OK) {
+    bool was_free = fat32_fat_entry_is_free(*p);
+    bool is_free  = fat32_fat_entry_is_free(entry);
+
+    /* the high 4 bits of FAT32 entry are reserved and must be preserved */
+    *p = (*p & ~FAT32_FAT_ENTRY_MASK) | (entry & FAT32_FAT_ENTRY_MASK);
+
+    if (was_free != is_free && cluster < fat->clusters_end) {
+      /* the bitmap may be not built yet if FSInfo has been trusted */
+      if (fat->free_map != NULL) {
+        fat->free_map[cluster / 64] ^= (uint64_t) 1 << (cluster % 64);
+      }
+
+      if (is_free) {
+        ++fat->fs_info->last_free_count;
+      } else {
+        --fat->fs_info->last_free_count;
+      }
+    }
+
+    fat32_fat_mark_dirty(fat, cluster, sector);
   }
 
-  return FE_OK;
+  return ret;
 }
 
-/// one of the possible FAT entry values which marks cluster as free
-static const fat32_fat_entry_t FAT32_FAT_ENTRY_EMPTY = 0x00000000;
-
 enum fat32_error_t
 fat32_fat_mark_cluster_chain_free(struct fat32_fat_t *fat, uint32_t cluster)
 {
@@ -239,9 +2358,9 @@ fat32_fat_mark_cluster_chain_free(struct fat32_fat_t *fat, uint32_t cluster)
       }
 
       fat32_fat_entry_t next = fat32_fat_entry_to_cluster(entry);
-      if (fat32_fat_set_entry(fat,
-                              cluster, FAT32_FAT_ENTRY_EMPTY) == FE_ERRNO) {
-        return FE_FS_INCONSISTENT;
+      ret = fat32_fat_set_entry(fat, cluster, FAT32_FAT_ENTRY_EMPTY);
+      if (ret != FE_OK) {
+        return (ret == FE_ERRNO) ? FE_FS_INCONSISTENT : ret;
       }
       cluster = next;
 
@@ -257,7 +2376,7 @@ fat32_fat_mark_cluster_chain_free(struct fat32_fat_t *fat, uint32_t cluster)
 enum fat32_error_t
 fat32_fat_mark_cluster_last(struct fat32_fat_t *fat, uint32_t cluster)
 {
-  if (fat32_fat_set_entry(fat, cluster, FAT32_FAT_ENTRY_EOC) == FE_ERRNO) {
+  if (fat32_fat_set_entry(fat, cluster, FAT32_FAT_ENTRY_EOC) != FE_OK) {
     return FE_FS_INCONSISTENT;
   }
 
@@ -9,8 +9,13 @@
  *
  *
  */
+#include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "fat32/dev.h"
+#include "fat32/fat.h"
 #include "fat32/file_info.h"
 
 void *
@@ -20,8 +25,140 @@ fat32_file_info_cloner(const void *file_info)
   if (result == NULL) {
     return NULL;
   }
-  result->refs    = 1;
-  result->deleted = false;
+  result->refs             = 1;
+  result->deleted          = false;
+  result->direntry         = NULL;
+  result->direntry_dirty   = false;
+  result->initialized      = 0;
+  result->delayed_first    = 0;
+  result->delayed_count    = 0;
+  result->delayed_capacity = 0;
+  result->delayed_buffers  = 0;
+  result->delayed          = NULL;
+
+  int ret = pthread_rwlock_init(&result->lock, NULL);
+  if (ret != 0) {
+    free(result);
+    errno = ret;
+    return NULL;
+  }
 
   return result;
 }
+
+void
+fat32_file_info_free(void *file_info)
+{
+  struct fat32_file_info_t *info = file_info;
+
+  fat32_file_info_delayed_clear(info);
+  free(info->delayed);
+  free(info->direntry);
+  pthread_rwlock_destroy(&info->lock);
+  free(info);
+}
+
+uint8_t *
+fat32_file_info_delayed_get(struct fat32_file_info_t *file_info,
+                            struct fat32_fat_t *fat,
+                            uint32_t cluster_size, uint32_t logical)
+{
+  assert( logical >= file_info->delayed_first );
+
+  uint32_t index = logical - file_info->delayed_first;
+
+  if (index >= file_info->delayed_capacity) {
+    uint32_t capacity = (file_info->delayed_capacity == 0) ?
+      16 : file_info->delayed_capacity;
+    while (capacity <= index) {
+      capacity *= 2;
+    }
+
+    uint8_t **delayed = realloc(file_info->delayed,
+                                capacity * sizeof(uint8_t *));
+    if (delayed == NULL) {
+      return NULL;
+    }
+
+    file_info->delayed          = delayed;
+    file_info->delayed_capacity = capacity;
+  }
+
+  /* holes get clusters on flush as well */
+  if (index >= file_info->delayed_count &&
+      fat32_fat_reserve(fat, index + 1 - file_info->delayed_count) != FE_OK) {
+    errno = ENOSPC;
+    return NULL;
+  }
+
+  /* clusters skipped by the write are holes filled with zeros */
+  while (file_info->delayed_count <= index) {
+    file_info->delayed[file_info->delayed_count++] = NULL;
+  }
+
+  if (file_info->delayed[index] == NULL) {
+    /* aligned buffers are written to the device without bouncing */
+    uint8_t *data = fat32_dev_alloc(cluster_size);
+    if (data == NULL) {
+      return NULL;
+    }
+
+    memset(data, 0, cluster_size);
+    file_info->delayed[index] = data;
+    ++file_info->delayed_buffers;
+  }
+
+  return file_info->delayed[index];
+}
+
+bool
+fat32_file_info_delayed_read(const struct fat32_file_info_t *file_info,
+                             uint32_t logical, void *buffer,
+                             uint32_t offset, uint32_t size)
+{
+  if (logical < file_info->delayed_first ||
+      logical - file_info->delayed_first >= file_info->delayed_count) {
+    return false;
+  }
+
+  const uint8_t *data = file_info->delayed[logical - file_info->delayed_first];
+
+  if (data != NULL) {
+    memcpy(buffer, data + offset, size);
+  } else {
+    memset(buffer, 0, size);
+  }
+
+  return true;
+}
+
+void
+fat32_file_info_delayed_truncate(struct fat32_file_info_t *file_info,
+                                 struct fat32_fat_t *fat, uint32_t clusters)
+{
+  uint32_t count = (clusters > file_info->delayed_first) ?
+    clusters - file_info->delayed_first : 0;
+
+  for (uint32_t i = count; i < file_info->delayed_count; ++i) {
+    if (file_info->delayed[i] != NULL) {
+      free(file_info->delayed[i]);
+      --file_info->delayed_buffers;
+    }
+  }
+
+  if (count < file_info->delayed_count) {
+    fat32_fat_unreserve(fat, file_info->delayed_count - count);
+    file_info->delayed_count = count;
+  }
+}
+
+void
+fat32_file_info_delayed_clear(struct fat32_file_info_t *file_info)
+{
+  for (uint32_t i = 0; i < file_info->delayed_count; ++i) {
+    free(file_info->delayed[i]);
+  }
+
+  file_info->delayed_count   = 0;
+  file_info->delayed_buffers = 0;
+}
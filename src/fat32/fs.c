@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 
 #include <sys/types.h>
@@ -23,8 +24,33 @@
 #include "fat32/diriter.h"
 #include "fat32/fs_object.h"
 #include "fat32/fh.h"
+#include "fat32/extent_map.h"
+#include "fat32/dir_index.h"
 #include "fat32/file_info.h"
+#include "fat32/partition.h"
 #include "utils/files.h"
+#include "utils/log.h"
+
+/**
+ * Flushes a file which is still open when the file system is closed. Used
+ * as a visitor of #fat32_fs_t::fh_table.
+ *
+ * @param fh        File handle. Unused.
+ * @param fs_object File system object of the handle.
+ * @param ok        Set to @em false if the file can't be flushed.
+ */
+static void
+fat32_fs_flush_open_file(void *fh, void *fs_object, void *ok)
+{
+  (void) fh;
+
+  struct fat32_fs_object_t *object = fs_object;
+
+  if (object->file_info != NULL &&
+      fat32_fs_object_flush(object, true) != FE_OK) {
+    *(bool *) ok = false;
+  }
+}
 
 /**
  * Frees all resources allocated for the file system.
@@ -33,17 +59,57 @@
  *
  * @return 0 on success, -1 otherwise
  */
-static inline int
+static int
 fat32_fs_cleanup(struct fat32_fs_t* fs)
 {
   if (fs != NULL) {
-    /* trying to close file descriptor first in order to give
+    /* FUSE destroys the file system without releasing files which are still
+     * open so their data and directory entries kept in memory are written
+     * here; if any of them fails clusters may be lost and the volume is left
+     * dirty */
+    if (fs->fh_table != NULL && fs->fat != NULL &&
+        fs->cluster_cache != NULL) {
+      bool ok = true;
+      hash_table_foreach(fs->fh_table, fat32_fs_flush_open_file, &ok);
+
+      if (!ok) {
+        log_error("Unable to flush files open on unmount");
+        fs->fat->inconsistent = true;
+      }
+    }
+
+    /* modified clusters are written back before FAT which references them */
+    if (fs->cluster_cache != NULL) {
+      if (fat32_cluster_cache_sync(fs->cluster_cache) != FE_OK) {
+        return -1;
+      }
+
+      uint64_t hits;
+      uint64_t misses;
+      fat32_cluster_cache_stats(fs->cluster_cache, &hits, &misses);
+      log_info("Cluster cache: %" PRIu64 " hits, %" PRIu64 " misses",
+               hits, misses);
+
+      fat32_cluster_cache_free(fs->cluster_cache);
+      fs->cluster_cache = NULL;
+    }
+
+    /* FAT is finalized before the device is closed because it writes
+       modified sectors back to the device using BPB and FSInfo */
+    if (fs->fat != NULL) {
+      if (fat32_fat_finalize(fs->fat) != FE_OK) {
+        return -1;
+      }
+      free(fs->fat);
+      fs->fat = NULL;
+    }
+
+    /* FAT is finalized first because it writes modified sectors back to
        possibility to retry on error to the user
     */
-    if (fs->fd != -1) {
-      int ret = xclose(fs->fd);
-      if (ret != 0) {
-        return ret;
+    if (fs->dev.fd != -1) {
+      if (fat32_dev_close(&fs->dev) != FE_OK) {
+        return -1;
       }
     }
 
@@ -65,13 +131,6 @@ fat32_fs_cleanup(struct fat32_fs_t* fs)
       free(fs->fs_info);
     }
 
-    if (fs->fat != NULL) {
-      if (fat32_fat_finalize(fs->fat) != FE_OK) {
-        return -1;
-      }
-      free(fs->fat);
-    }
-
     if (fs->file_table != NULL) {
       hash_table_free(fs->file_table);
     }
@@ -84,6 +143,16 @@ fat32_fs_cleanup(struct fat32_fs_t* fs)
       fat32_fh_allocator_free(fs->fh_allocator);
     }
 
+    /* freed after file handles table because open fs objects hold
+       references to extent maps */
+    if (fs->extent_cache != NULL) {
+      fat32_extent_cache_free(fs->extent_cache);
+    }
+
+    if (fs->dir_cache != NULL) {
+      fat32_dir_cache_free(fs->dir_cache);
+    }
+
     free(fs);
   }
 
@@ -102,8 +171,6 @@ fat32_fs_open(const char *path, const struct fat32_fs_params_t *params,
   pthread_mutex_t        *lock;
   enum fat32_error_t      error = FE_ERRNO;
 
-  int fd;
-
   fs = (struct fat32_fs_t *) malloc(sizeof(struct fat32_fs_t));
   if (fs == NULL) {
     goto open_fs_error;
@@ -111,13 +178,17 @@ fat32_fs_open(const char *path, const struct fat32_fs_params_t *params,
 
   *result = fs;
 
-  fs->fd           = -1;
+  fs->dev.fd       = -1;
   fs->bpb          = NULL;
   fs->fs_info      = NULL;
   fs->write_lock   = NULL;
   fs->fat          = NULL;
+  fs->file_table   = NULL;
   fs->fh_table     = NULL;
   fs->fh_allocator = NULL;
+  fs->extent_cache = NULL;
+  fs->cluster_cache = NULL;
+  fs->dir_cache    = NULL;
 
   lock = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
   if (lock == NULL) {
@@ -151,51 +222,75 @@ fat32_fs_open(const char *path, const struct fat32_fs_params_t *params,
   fs->fs_info = fs_info;
 
   fat = (struct fat32_fat_t *) malloc(sizeof(struct fat32_fat_t));
-  if (bpb == NULL) {
+  if (fat == NULL) {
     goto open_device_cleanup;
   }
-  fs->fat = fat;
 
-  fd = xopen(path, O_RDWR);
-  if (fd < 0) {
+  if (fat32_dev_open(&fs->dev, path, params->dev_direct) != FE_OK) {
     goto open_device_cleanup;
   }
-  fs->fd = fd;
 
-  if (fstat(fd, &dev_stat) < 0) {
+  if (fstat(fs->dev.fd, &dev_stat) < 0) {
     goto open_device_cleanup;
   }
 
-  if (!S_ISBLK(dev_stat.st_mode)) {
-    /* provided file is not a block device */
+  if (!S_ISBLK(dev_stat.st_mode) && !S_ISREG(dev_stat.st_mode)) {
+    /* provided file is neither a block device nor an image file */
     error = FE_NONBLOCK_DEV;
     goto open_device_cleanup;
   }
 
   enum fat32_error_t op_status;
-  op_status = fat32_bpb_read(fd, fs->bpb);
+
+  /* the file system is looked for inside of a whole disk */
+  off_t base = params->dev_offset;
+  off_t size = 0;
+  if (params->partition != 0) {
+    op_status = fat32_partition_find(&fs->dev, params->partition,
+                                     &base, &size);
+    if (op_status != FE_OK) {
+      error = op_status;
+      goto open_device_cleanup;
+    }
+
+    log_info("Partition %" PRIu32 " starts at %jd and takes %jd bytes",
+             params->partition, (intmax_t) base, (intmax_t) size);
+  }
+
+  if (base != 0 || size != 0) {
+    if (fat32_dev_set_window(&fs->dev, base, size) != FE_OK) {
+      goto open_device_cleanup;
+    }
+  }
+  op_status = fat32_bpb_read(&fs->dev, fs->bpb);
   if (op_status != FE_OK) {
     error = op_status;
     goto open_device_cleanup;
   }
 
-  op_status = fat32_fs_info_read(fd, bpb, fs->fs_info);
+  op_status = fat32_fs_info_read(&fs->dev, bpb, fs->fs_info);
   if (op_status != FE_OK) {
     error = op_status;
     goto open_device_cleanup;
   }
 
-  op_status = fat32_fat_init(fs->fat, fs);
+  op_status = fat32_fat_init(fat, fs, params);
   if (op_status != FE_OK) {
+    /* fat is not set in fs yet so that cleanup code does not try to
+     * finalize it */
+    free(fat);
+
     error = op_status;
     goto open_device_cleanup;
   }
+  fs->fat = fat;
 
   fs->file_table =
     hash_table_create(params->file_table_size,
-                      hash_table_string_hash, hash_table_string_equal,
+                      hash_table_string_case_hash,
+                      hash_table_string_case_equal,
                       (cloner_t) strdup, fat32_file_info_cloner,
-                      free, free);
+                      free, fat32_file_info_free);
   if (fs->file_table == NULL) {
     goto open_device_cleanup;
   }
@@ -214,8 +309,31 @@ fat32_fs_open(const char *path, const struct fat32_fs_params_t *params,
     goto open_device_cleanup;
   }
 
+  fs->extent_cache = fat32_extent_cache_create(params->extent_table_size);
+  if (fs->extent_cache == NULL) {
+    goto open_device_cleanup;
+  }
+
+  fs->dir_cache = fat32_dir_cache_create(params->dir_table_size);
+  if (fs->dir_cache == NULL) {
+    goto open_device_cleanup;
+  }
+
   fs->cluster_size = fat32_bpb_cluster_size(bpb);
 
+  fs->cluster_cache =
+    fat32_cluster_cache_create(&fs->dev, bpb,
+                               params->cluster_cache_size / fs->cluster_size);
+  if (fs->cluster_cache == NULL) {
+    goto open_device_cleanup;
+  }
+
+  fs->readahead_max = params->readahead / fs->cluster_size;
+  if (fs->readahead_max >
+      fat32_cluster_cache_prefetch_limit(fs->cluster_cache)) {
+    fs->readahead_max = fat32_cluster_cache_prefetch_limit(fs->cluster_cache);
+  }
+
   return FE_OK;
 
  open_device_cleanup:
@@ -236,6 +354,24 @@ fat32_fs_close(struct fat32_fs_t *fs)
   }
 }
 
+enum fat32_error_t
+fat32_fs_start(struct fat32_fs_t *fs)
+{
+  enum fat32_error_t ret = fat32_fat_readahead_start(fs->fat);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  return fat32_cluster_cache_prefetch_start(fs->cluster_cache);
+}
+
+void
+fat32_fs_stop(struct fat32_fs_t *fs)
+{
+  fat32_cluster_cache_prefetch_stop(fs->cluster_cache);
+  fat32_fat_readahead_stop(fs->fat);
+}
+
 enum fat32_error_t
 fat32_fs_read_cluster(const struct fat32_fs_t *fs, void *buffer,
                       uint32_t cluster)
@@ -244,20 +380,15 @@ fat32_fs_read_cluster(const struct fat32_fs_t *fs, void *buffer,
     return FE_INVALID_CLUSTER;
   }
 
-  off_t    offset = fat32_cluster_to_offset(fs->bpb, cluster);
-  uint32_t cluster_size = fs->cluster_size;
-
-  if (lseek(fs->fd, offset, SEEK_CUR) == (off_t) -1) {
-    return FE_ERRNO;
+  uint8_t *data;
+  enum fat32_error_t ret = fat32_cluster_cache_get(fs->cluster_cache, cluster,
+                                                   true, &data);
+  if (ret != FE_OK) {
+    return ret;
   }
 
-  /* TODO: synchronization */
-  int nread = xread(fs->fd, buffer, cluster_size);
-  if (nread == -1) {
-    return FE_ERRNO;
-  } else if (nread < cluster_size) {
-    return FE_INVALID_DEV;
-  }
+  memcpy(buffer, data, fs->cluster_size);
+  fat32_cluster_cache_put(fs->cluster_cache, data, false);
 
   return FE_OK;
 }
@@ -294,6 +425,13 @@ fat32_fs_get_object(const struct fat32_fs_t *fs,
   }
 
   while (token != NULL) {
+    /* files have no children */
+    if (!fat32_fs_object_is_directory(parent_object)) {
+      *fs_object  = NULL;
+      return_code = FE_OK;
+      goto cleanup;
+    }
+
     diriter = fat32_diriter_create(parent_object, true);
 
     if (diriter == NULL) {
@@ -320,7 +458,8 @@ fat32_fs_get_object(const struct fat32_fs_t *fs,
           goto cleanup;
         }
 
-        if (strcmp(token, child->name) == 0) {
+        /* names are stored in upper case and matched regardless of it */
+        if (strcasecmp(token, child->name) == 0) {
           break;
         }
 
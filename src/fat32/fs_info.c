@@ -58,38 +58,35 @@ fat32_fs_info_verbose_info(const struct fat32_fs_info_t *fs_info)
 }
 
 enum fat32_error_t
-fat32_fs_info_read(int fd, const struct fat32_bpb_t *bpb,
+fat32_fs_info_read(const struct fat32_dev_t *dev,
+                   const struct fat32_bpb_t *bpb,
                    struct fat32_fs_info_t *fs_info)
 {
   off_t fs_info_offset = fat32_sector_to_offset(bpb, bpb->fs_info_sector);
-  off_t old_offset     = lseek(fd, 0, SEEK_CUR);
-
-  if (old_offset == (off_t) -1) {
-    return FE_ERRNO;
-  }
-
-  off_t new_offset     = lseek(fd, fs_info_offset, SEEK_SET);
-  if (new_offset != fs_info_offset) {
-    return FE_ERRNO;
-  }
 
   /* @todo endianness */
-  ssize_t nread = xread(fd, fs_info, sizeof(struct fat32_fs_info_t));
-  if (nread >= 0) {
-    if (nread < sizeof(struct fat32_fs_info_t)) {
-      return FE_INVALID_DEV;
-    }
-  } else {
-    return FE_ERRNO;
+  enum fat32_error_t ret =
+    fat32_dev_read(dev, fs_info, sizeof(struct fat32_fs_info_t),
+                   fs_info_offset);
+  if (ret != FE_OK) {
+    return ret;
   }
 
   if (!fat32_fs_info_check_validity(fs_info)) {
     return FE_INVALID_FS;
   }
 
-  if (lseek(fd, old_offset, SEEK_SET) == (off_t) -1) {
-    return FE_ERRNO;
-  }
-
   return FE_OK;
 }
+
+enum fat32_error_t
+fat32_fs_info_write(const struct fat32_dev_t *dev,
+                    const struct fat32_bpb_t *bpb,
+                    const struct fat32_fs_info_t *fs_info)
+{
+  off_t fs_info_offset = fat32_sector_to_offset(bpb, bpb->fs_info_sector);
+
+  /* @todo endianness */
+  return fat32_dev_write(dev, fs_info, sizeof(struct fat32_fs_info_t),
+                         fs_info_offset);
+}
@@ -10,12 +10,16 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #define EXTERN_INLINE_DEFINITIONS
 #include "fat32/fs_object.h"
 #undef  EXTERN_INLINE_DEFINITIONS
 
+#include "fat32/dir_index.h"
 #include "fat32/diriter.h"
+#include "fat32/utils.h"
 
 struct fat32_fs_object_t *
 fat32_fs_object_root_dir(const struct fat32_fs_t *fs)
@@ -29,9 +33,16 @@ fat32_fs_object_root_dir(const struct fat32_fs_t *fs)
 
   fs_object->type     = FAT32_FS_OBJECT_ROOT_DIR;
   fs_object->name     = NULL;
-  fs_object->direntry = NULL;
-  fs_object->fs       = fs;
-  fs_object->offset   = 0;
+  fs_object->direntry   = NULL;
+  fs_object->fs         = fs;
+  fs_object->offset     = 0;
+  fs_object->dir_cluster = 0;
+  fs_object->dir_entry  = 0;
+  fs_object->extent_map = NULL;
+  fs_object->read_end   = 0;
+  fs_object->ra_window  = 0;
+  fs_object->ra_next    = 0;
+  fs_object->file_info  = NULL;
 
   return fs_object;
 }
@@ -39,7 +50,8 @@ fat32_fs_object_root_dir(const struct fat32_fs_t *fs)
 struct fat32_fs_object_t *
 fat32_fs_object_direntry(const struct fat32_fs_t       *fs,
                          const struct fat32_direntry_t *direntry,
-                         const char *name, off_t offset)
+                         const char *name, off_t offset,
+                         uint32_t dir_cluster, uint32_t dir_entry)
 {
   struct fat32_fs_object_t *fs_object;
 
@@ -54,10 +66,17 @@ fat32_fs_object_direntry(const struct fat32_fs_t       *fs,
     fs_object->type   = FAT32_FS_OBJECT_FILE;
   }
 
-  fs_object->name     = NULL;
-  fs_object->direntry = NULL;
-  fs_object->fs       = fs;
-  fs_object->offset   = offset;
+  fs_object->name       = NULL;
+  fs_object->direntry   = NULL;
+  fs_object->fs         = fs;
+  fs_object->offset     = offset;
+  fs_object->dir_cluster = dir_cluster;
+  fs_object->dir_entry  = dir_entry;
+  fs_object->extent_map = NULL;
+  fs_object->read_end   = 0;
+  fs_object->ra_window  = 0;
+  fs_object->ra_next    = 0;
+  fs_object->file_info  = NULL;
 
   fs_object->name     = strdup(name);
   if (fs_object->name == NULL) {
@@ -86,10 +105,14 @@ fat32_fs_object_free(struct fat32_fs_object_t *fs_object)
     free(fs_object->name);
   }
 
-  if (fs_object->direntry != NULL) {
+  /* direntry of an open file is shared by all its instances */
+  if (fs_object->direntry != NULL && fs_object->file_info == NULL) {
     free(fs_object->direntry);
   }
 
+  fat32_extent_cache_release(fs_object->fs->extent_cache,
+                             fs_object->extent_map);
+
   free(fs_object);
 }
 
@@ -109,6 +132,581 @@ fat32_fs_object_first_cluster(const struct fat32_fs_object_t *fs_object)
   }
 }
 
+enum fat32_error_t
+fat32_fs_object_extent_map(struct fat32_fs_object_t *fs_object,
+                           struct fat32_extent_map_t **map)
+{
+  const struct fat32_fs_t *fs = fs_object->fs;
+
+  return fat32_extent_cache_get(fs->extent_cache, fs->fat,
+                                fat32_fs_object_first_cluster(fs_object),
+                                &fs_object->extent_map, map);
+}
+
+enum fat32_error_t
+fat32_fs_object_attach(struct fat32_fs_object_t *fs_object,
+                       struct fat32_file_info_t *file_info)
+{
+  assert( fat32_fs_object_is_file(fs_object) );
+  assert( fs_object->file_info == NULL );
+
+  if (file_info->direntry != NULL) {
+    free(fs_object->direntry);
+    fs_object->direntry  = file_info->direntry;
+    fs_object->file_info = file_info;
+
+    return FE_OK;
+  }
+
+  /* everything past the chain is going to be kept in memory */
+  struct fat32_extent_map_t *map;
+  enum fat32_error_t         ret = fat32_fs_object_extent_map(fs_object, &map);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  file_info->delayed_first = map->clusters;
+  fat32_extent_cache_release(fs_object->fs->extent_cache, map);
+
+  file_info->initialized = fat32_fs_object_size(fs_object);
+  file_info->direntry    = fs_object->direntry;
+  fs_object->file_info = file_info;
+
+  return FE_OK;
+}
+
+/**
+ * Drops clusters of the object from the cluster cache. Must be called before
+ * the clusters are freed so that their cached contents are never written
+ * over clusters reused by someone else.
+ *
+ * @param fs_object File system object.
+ * @param first     A number of the first cluster in the chain to drop.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ */
+static enum fat32_error_t
+fat32_fs_object_forget_clusters(struct fat32_fs_object_t *fs_object,
+                                uint32_t first)
+{
+  const struct fat32_fs_t   *fs = fs_object->fs;
+  struct fat32_extent_map_t *map;
+
+  enum fat32_error_t ret = fat32_fs_object_extent_map(fs_object, &map);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  uint32_t physical;
+  uint32_t run;
+  for (uint32_t n = first;
+       fat32_extent_map_lookup(map, n, &physical, &run); n += run) {
+    fat32_cluster_cache_invalidate(fs->cluster_cache, physical, run);
+  }
+
+  fat32_extent_cache_release(fs->extent_cache, map);
+
+  return FE_OK;
+}
+
+/**
+ * Writes clusters of the chain by one request per physically contiguous run.
+ *
+ * @param fs_object File system object.
+ * @param logical   A number of the first cluster in the chain to write.
+ * @param count     A number of clusters to write.
+ * @param data      Data of the clusters. NULL elements as well as NULL
+ *                  array itself stand for clusters filled with zeros.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ */
+static enum fat32_error_t
+fat32_fs_object_write_clusters(struct fat32_fs_object_t *fs_object,
+                               uint32_t logical, uint32_t count,
+                               uint8_t *const *data)
+{
+  const struct fat32_fs_t   *fs    = fs_object->fs;
+  uint32_t                   csize = fs->cluster_size;
+  struct fat32_extent_map_t *map;
+  enum fat32_error_t         ret;
+
+  uint8_t *zeros = calloc(1, csize);
+  if (zeros == NULL) {
+    return FE_ERRNO;
+  }
+
+  ret = fat32_fs_object_extent_map(fs_object, &map);
+  if (ret != FE_OK) {
+    free(zeros);
+    return ret;
+  }
+
+  for (uint32_t i = 0; i < count; ) {
+    struct iovec iov[FAT32_DEV_BATCH_SIZE];
+    uint32_t     physical;
+    uint32_t     run;
+
+    if (!fat32_extent_map_lookup(map, logical + i, &physical, &run)) {
+      ret = FE_INVALID_FS;
+      break;
+    }
+
+    if (run > count - i) {
+      run = count - i;
+    }
+    if (run > FAT32_DEV_BATCH_SIZE) {
+      run = FAT32_DEV_BATCH_SIZE;
+    }
+
+    for (uint32_t j = 0; j < run; ++j) {
+      uint8_t *cluster = (data != NULL) ? data[i + j] : NULL;
+
+      iov[j].iov_base = (cluster != NULL) ? cluster : zeros;
+      iov[j].iov_len  = csize;
+    }
+
+    ret = fat32_dev_writev(&fs->dev, iov, run,
+                           fat32_cluster_to_offset(fs->bpb, physical));
+    if (ret != FE_OK) {
+      break;
+    }
+
+    i += run;
+  }
+
+  fat32_extent_cache_release(fs->extent_cache, map);
+  free(zeros);
+
+  return ret;
+}
+
+/**
+ * Appends clusters to the chain of the open file. Must be called with the
+ * lock of the file taken for writing. Data kept in memory must be written
+ * to the appended clusters by the caller.
+ *
+ * @param fs_object File system object attached to the open file.
+ * @param count     A number of clusters to append.
+ * @param reserved  Whether the clusters have been reserved for data kept in
+ *                  memory.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ * @retval FE_FS_IS_FULL      nothing is allocated
+ * @retval FE_FS_INCONSISTENT
+ */
+static enum fat32_error_t
+fat32_fs_object_append_clusters(struct fat32_fs_object_t *fs_object,
+                                uint32_t count, bool reserved)
+{
+  const struct fat32_fs_t   *fs        = fs_object->fs;
+  struct fat32_file_info_t  *file_info = fs_object->file_info;
+  struct fat32_extent_map_t *map;
+  enum fat32_error_t         ret;
+
+  uint32_t previous = 0;
+  if (file_info->delayed_first != 0) {
+    ret = fat32_fs_object_extent_map(fs_object, &map);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    bool found = fat32_extent_map_lookup(map, file_info->delayed_first - 1,
+                                         &previous, NULL);
+    fat32_extent_cache_release(fs->extent_cache, map);
+
+    if (!found) {
+      return FE_INVALID_FS;
+    }
+  }
+
+  /* all the clusters are allocated at once so that they get as few extents
+   * as possible */
+  uint32_t first;
+  uint32_t extents;
+  ret = fat32_fat_allocate_chain(fs->fat, count, reserved ? count : 0,
+                                 previous, &first, &extents);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  fat32_extent_cache_invalidate(fs->extent_cache,
+                                fat32_fs_object_first_cluster(fs_object));
+
+  if (previous == 0) {
+    fs_object->direntry->first_cluster_hi = first >> 16;
+    fs_object->direntry->first_cluster_lo = first & 0xffff;
+  }
+  file_info->direntry_dirty = true;
+
+  file_info->delayed_first += count;
+
+  return FE_OK;
+}
+
+/**
+ * Allocates clusters for the data of the open file kept in memory and
+ * writes it there. Must be called with the lock of the file taken for
+ * writing.
+ *
+ * @param fs_object File system object attached to the open file.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ * @retval FE_FS_IS_FULL
+ * @retval FE_FS_INCONSISTENT
+ */
+static enum fat32_error_t
+fat32_fs_object_allocate_delayed(struct fat32_fs_object_t *fs_object)
+{
+  struct fat32_file_info_t *file_info = fs_object->file_info;
+  uint32_t                  logical   = file_info->delayed_first;
+  uint32_t                  count     = file_info->delayed_count;
+
+  if (count == 0) {
+    return FE_OK;
+  }
+
+  enum fat32_error_t ret = fat32_fs_object_append_clusters(fs_object, count,
+                                                           true);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  ret = fat32_fs_object_write_clusters(fs_object, logical, count,
+                                       file_info->delayed);
+
+  /* clusters are in the chain already so data which has not been written
+   * is lost anyway */
+  fat32_file_info_delayed_clear(file_info);
+
+  return ret;
+}
+
+/**
+ * Writes the directory entry of the open file if it has been modified. Must
+ * be called with the lock of the file taken for writing.
+ *
+ * @param fs_object File system object attached to the open file.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_FS_INCONSISTENT
+ */
+static enum fat32_error_t
+fat32_fs_object_write_direntry(struct fat32_fs_object_t *fs_object)
+{
+  struct fat32_file_info_t *file_info = fs_object->file_info;
+
+  if (!file_info->direntry_dirty) {
+    return FE_OK;
+  }
+
+  enum fat32_error_t ret =
+    fat32_direntry_flush(fs_object->direntry, fs_object->fs->cluster_cache,
+                         fs_object->offset);
+  if (ret == FE_OK) {
+    file_info->direntry_dirty = false;
+  }
+
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fs_object_zero_range(struct fat32_fs_object_t *fs_object,
+                           uint32_t from, uint32_t to)
+{
+  const struct fat32_fs_t   *fs        = fs_object->fs;
+  struct fat32_file_info_t  *file_info = fs_object->file_info;
+  uint32_t                   csize     = fs->cluster_size;
+  uint8_t                   *zeros     = NULL;
+  struct fat32_extent_map_t *map;
+
+  /* clusters which are neither allocated nor kept in memory are zeros */
+  uint64_t end = (uint64_t) (file_info->delayed_first +
+                             file_info->delayed_count) * csize;
+  if (to > end) {
+    to = end;
+  }
+
+  if (from >= to) {
+    return FE_OK;
+  }
+
+  enum fat32_error_t ret = fat32_fs_object_extent_map(fs_object, &map);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  while (from < to) {
+    uint32_t n       = from / csize;
+    uint32_t coffset = from % csize;
+    uint32_t piece   = (csize - coffset > to - from) ?
+      to - from : csize - coffset;
+    uint32_t physical;
+    uint32_t run;
+
+    if (!fat32_extent_map_lookup(map, n, &physical, &run)) {
+      /* clusters kept in memory are created zeroed and never written ones
+       * are not kept at all */
+      if (n - file_info->delayed_first < file_info->delayed_count &&
+          file_info->delayed[n - file_info->delayed_first] != NULL) {
+        memset(file_info->delayed[n - file_info->delayed_first] + coffset, 0,
+               piece);
+      }
+
+      from += piece;
+      continue;
+    }
+
+    if (piece == csize) {
+      uint32_t whole = (to - from) / csize;
+      if (whole > run) {
+        whole = run;
+      }
+
+      ret = fat32_fs_object_write_clusters(fs_object, n, whole, NULL);
+      if (ret != FE_OK) {
+        break;
+      }
+
+      /* cached clusters must not keep old data */
+      fat32_cluster_cache_invalidate(fs->cluster_cache, physical, whole);
+
+      from += whole * csize;
+      continue;
+    }
+
+    if (zeros == NULL) {
+      zeros = calloc(1, csize);
+      if (zeros == NULL) {
+        ret = FE_ERRNO;
+        break;
+      }
+    }
+
+    ret = fat32_cluster_cache_write(fs->cluster_cache,
+                                    fat32_cluster_to_offset(fs->bpb,
+                                                            physical) +
+                                    coffset, zeros, piece);
+    if (ret != FE_OK) {
+      break;
+    }
+
+    from += piece;
+  }
+
+  fat32_extent_cache_release(fs->extent_cache, map);
+  free(zeros);
+
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fs_object_flush(struct fat32_fs_object_t *fs_object, bool direntry)
+{
+  struct fat32_file_info_t *file_info = fs_object->file_info;
+
+  assert( file_info != NULL );
+
+  assert( pthread_rwlock_wrlock(&file_info->lock) == 0 );
+
+  /* the size must not reach the device before the clusters it covers are
+   * zeroed */
+  uint32_t           size = fat32_fs_object_size(fs_object);
+  enum fat32_error_t ret  =
+    fat32_fs_object_zero_range(fs_object, file_info->initialized, size);
+  if (ret != FE_OK) {
+    goto unlock;
+  }
+  file_info->initialized = size;
+
+  ret = fat32_fs_object_allocate_delayed(fs_object);
+  if (!direntry) {
+    goto unlock;
+  }
+
+  /* the size is written even if data is not so that allocated clusters are
+   * not lost */
+  enum fat32_error_t flush_ret = fat32_fs_object_write_direntry(fs_object);
+  if (ret == FE_OK) {
+    ret = flush_ret;
+  }
+
+unlock:
+  assert( pthread_rwlock_unlock(&file_info->lock) == 0 );
+
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fs_object_preallocate(struct fat32_fs_object_t *fs_object,
+                            uint32_t end, bool keep_size)
+{
+  const struct fat32_fs_t  *fs        = fs_object->fs;
+  struct fat32_file_info_t *file_info = fs_object->file_info;
+  uint32_t                  csize     = fs->cluster_size;
+  uint32_t                  clusters  = (uint32_t)
+    (((uint64_t) end + csize - 1) / csize);
+  enum fat32_error_t        ret;
+
+  assert( file_info != NULL );
+
+  assert( pthread_rwlock_wrlock(&file_info->lock) == 0 );
+
+  /* data kept in memory takes clusters right after the allocated ones */
+  ret = fat32_fs_object_allocate_delayed(fs_object);
+  if (ret != FE_OK) {
+    goto unlock;
+  }
+
+  uint32_t allocated = file_info->delayed_first;
+  if (clusters > allocated) {
+    /* the clusters are past the initialized data so they are read as zeros
+     * and need no writing */
+    ret = fat32_fs_object_append_clusters(fs_object, clusters - allocated,
+                                          false);
+    if (ret != FE_OK) {
+      goto unlock;
+    }
+  }
+
+  /* the directory entry is written on flush after the clusters are
+   * zeroed */
+  if (!keep_size && end > fat32_fs_object_size(fs_object)) {
+    fs_object->direntry->file_size = end;
+    file_info->direntry_dirty      = true;
+  }
+
+unlock:
+  assert( pthread_rwlock_unlock(&file_info->lock) == 0 );
+
+  return ret;
+}
+
+/**
+ * Frees clusters of the open file past its end. Must be called with the
+ * lock of the file taken for writing.
+ *
+ * @param fs_object File system object attached to the open file.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ * @retval FE_FS_INCONSISTENT
+ * @retval FE_FS_PARTIALLY_CONSISTENT
+ */
+static enum fat32_error_t
+fat32_fs_object_trim_locked(struct fat32_fs_object_t *fs_object)
+{
+  const struct fat32_fs_t  *fs        = fs_object->fs;
+  struct fat32_file_info_t *file_info = fs_object->file_info;
+  uint32_t                  csize     = fs->cluster_size;
+  uint32_t                  clusters  = (uint32_t)
+    (((uint64_t) fat32_fs_object_size(fs_object) + csize - 1) / csize);
+  uint32_t                  first     =
+    fat32_fs_object_first_cluster(fs_object);
+  uint32_t                  next;
+  enum fat32_error_t        ret;
+
+  fat32_file_info_delayed_truncate(file_info, fs->fat, clusters);
+
+  if (file_info->delayed_first <= clusters) {
+    return FE_OK;
+  }
+
+  ret = fat32_fs_object_forget_clusters(fs_object, clusters);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  if (clusters == 0) {
+    next = first;
+
+    fs_object->direntry->first_cluster_hi = 0;
+    fs_object->direntry->first_cluster_lo = 0;
+    file_info->direntry_dirty             = true;
+
+    /* the chain is freed only when nothing references it */
+    ret = fat32_fs_object_write_direntry(fs_object);
+    if (ret != FE_OK) {
+      return ret;
+    }
+  } else {
+    struct fat32_extent_map_t *map;
+    uint32_t                   last;
+    fat32_fat_entry_t          entry;
+
+    ret = fat32_fs_object_extent_map(fs_object, &map);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    bool found = fat32_extent_map_lookup(map, clusters - 1, &last, NULL);
+    fat32_extent_cache_release(fs->extent_cache, map);
+
+    if (!found) {
+      return FE_INVALID_FS;
+    }
+
+    ret = fat32_fat_get_entry(fs->fat, last, &entry);
+    if (ret != FE_OK) {
+      return ret;
+    }
+    next = fat32_fat_entry_to_cluster(entry);
+
+    ret = fat32_fat_mark_cluster_last(fs->fat, last);
+    if (ret != FE_OK) {
+      return ret;
+    }
+  }
+
+  fat32_extent_cache_invalidate(fs->extent_cache, first);
+  file_info->delayed_first = clusters;
+
+  ret = fat32_fat_mark_cluster_chain_free(fs->fat, next);
+  switch (ret) {
+  case FE_ERRNO:
+  case FE_FS_INCONSISTENT:
+  case FE_INVALID_FS:
+    /* the clusters are not referenced by the file anymore */
+    return FE_FS_PARTIALLY_CONSISTENT;
+  default:
+    return ret;
+  }
+}
+
+enum fat32_error_t
+fat32_fs_object_trim(struct fat32_fs_object_t *fs_object)
+{
+  struct fat32_file_info_t *file_info = fs_object->file_info;
+  enum fat32_error_t        ret       = FE_OK;
+
+  assert( file_info != NULL );
+
+  assert( pthread_rwlock_wrlock(&file_info->lock) == 0 );
+
+  /* data kept in memory is never dropped here */
+  if (file_info->delayed_count == 0) {
+    ret = fat32_fs_object_trim_locked(fs_object);
+  }
+
+  assert( pthread_rwlock_unlock(&file_info->lock) == 0 );
+
+  return ret;
+}
+
 void *
 fat32_fs_object_cloner(const void *fs_object)
 {
@@ -120,8 +718,18 @@ fat32_fs_object_cloner(const void *fs_object)
     return NULL;
   }
 
-  result->name     = NULL;
-  result->direntry = NULL;
+  result->type       = original->type;
+  result->fs         = original->fs;
+  result->offset     = original->offset;
+  result->dir_cluster = original->dir_cluster;
+  result->dir_entry  = original->dir_entry;
+  result->name       = NULL;
+  result->direntry   = NULL;
+  result->extent_map = NULL;
+  result->read_end   = 0;
+  result->ra_window  = 0;
+  result->ra_next    = 0;
+  result->file_info  = NULL;
 
   result->name = strdup(original->name);
   if (result->name == NULL) {
@@ -156,7 +764,8 @@ fat32_fs_object_mark_free(const struct fat32_fs_object_t *fs_object)
 {
   assert( !fat32_fs_object_is_root_directory(fs_object) );
 
-  return fat32_direntry_mark_free(fs_object->fs->fd, fs_object->offset);
+  return fat32_direntry_mark_free(fs_object->fs->cluster_cache,
+                                  fs_object->offset);
 }
 
 enum fat32_error_t
@@ -172,6 +781,9 @@ fat32_fs_object_is_empty_directory(const struct fat32_fs_object_t *fs_object,
 
   struct fat32_fs_object_t *child;
   enum fat32_error_t ret = fat32_diriter_next(diriter, &child);
+
+  /* iterator pins directory cluster in the cache so it must not leak */
+  fat32_diriter_free(diriter);
   if (ret != FE_OK) {
     return ret;
   }
@@ -189,17 +801,49 @@ fat32_fs_object_is_empty_directory(const struct fat32_fs_object_t *fs_object,
 enum fat32_error_t
 fat32_fs_object_delete(struct fat32_fs_object_t *fs_object)
 {
-  struct fat32_fat_t *fat = fs_object->fs->fat;
-  enum fat32_error_t  ret;
+  struct fat32_fat_t       *fat       = fs_object->fs->fat;
+  struct fat32_dir_cache_t *dir_cache = fs_object->fs->dir_cache;
+  enum fat32_error_t        ret;
+
+  bool empty = fat32_fs_object_is_file(fs_object) &&
+    fat32_fs_object_is_empty_file(fs_object);
+
+  if (!empty) {
+    ret = fat32_fs_object_forget_clusters(fs_object, 0);
+    if (ret != FE_OK) {
+      return ret;
+    }
+  }
 
   uint32_t cluster = fat32_fs_object_first_cluster(fs_object);
+
+  fat32_dir_cache_lock(dir_cache);
+
   ret = fat32_fs_object_mark_free(fs_object);
+  if (ret == FE_OK) {
+    struct fat32_dir_index_t *index =
+      fat32_dir_cache_lookup(dir_cache, fs_object->dir_cluster);
+    if (index != NULL &&
+        !fat32_dir_index_release(index, fs_object->dir_entry, 1,
+                                 fs_object->direntry->name)) {
+      fat32_dir_cache_invalidate(dir_cache, fs_object->dir_cluster);
+    }
+
+    /* the clusters can become another directory */
+    if (fat32_fs_object_is_directory(fs_object)) {
+      fat32_dir_cache_invalidate(dir_cache, cluster);
+    }
+  }
+
+  fat32_dir_cache_unlock(dir_cache);
+
   if (ret != FE_OK) {
     return ret;
   }
 
-  if (!(fat32_fs_object_is_file(fs_object) &&
-        fat32_fs_object_is_empty_file(fs_object))) {
+  if (!empty) {
+    fat32_extent_cache_invalidate(fs_object->fs->extent_cache, cluster);
+
     enum fat32_error_t ret = fat32_fat_mark_cluster_chain_free(fat, cluster);
     switch (ret) {
     case FE_OK:
@@ -222,95 +866,318 @@ fat32_fs_object_delete(struct fat32_fs_object_t *fs_object)
   return FE_OK;
 }
 
+/**
+ * Fills a cluster of a new directory. The cluster gets dot and dotdot
+ * entries unless it's appended to an existing directory. All the other
+ * entries are zeroed so that the first of them marks the end of directory.
+ *
+ * @param fs      File system.
+ * @param cluster Cluster to fill.
+ * @param dot     The first cluster of the new directory or zero if the
+ *                cluster is appended to an existing one.
+ * @param dotdot  The first cluster of the directory containing the new one.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ */
+static enum fat32_error_t
+fat32_fs_object_init_cluster(const struct fat32_fs_t *fs, uint32_t cluster,
+                             uint32_t dot, uint32_t dotdot)
+{
+  uint8_t *data;
+
+  /* the whole cluster is overwritten so it's not read */
+  enum fat32_error_t ret =
+    fat32_cluster_cache_get(fs->cluster_cache, cluster, false, &data);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  memset(data, 0, fs->cluster_size);
+
+  if (dot != 0) {
+    struct fat32_direntry_t *direntry = (struct fat32_direntry_t *) data;
+
+    fat32_direntry_init_dot(&direntry[0], false, dot);
+    fat32_direntry_init_dot(&direntry[1], true, dotdot);
+  }
+
+  fat32_cluster_cache_put(fs->cluster_cache, data, true);
+
+  return FE_OK;
+}
+
+/**
+ * Appends a cluster to the directory. Must be called with the lock of
+ * directory indexes held.
+ *
+ * @param directory File system object representing the directory.
+ * @param index     Index of the directory.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ * @retval FE_FS_IS_FULL
+ * @retval FE_FS_INCONSISTENT
+ */
+static enum fat32_error_t
+fat32_fs_object_grow_directory(struct fat32_fs_object_t *directory,
+                               struct fat32_dir_index_t *index)
+{
+  const struct fat32_fs_t   *fs = directory->fs;
+  struct fat32_extent_map_t *map;
+
+  enum fat32_error_t ret = fat32_fs_object_extent_map(directory, &map);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  uint32_t previous;
+  bool     found = fat32_extent_map_lookup(map, map->clusters - 1,
+                                           &previous, NULL);
+  fat32_extent_cache_release(fs->extent_cache, map);
+
+  if (!found) {
+    return FE_INVALID_FS;
+  }
+
+  uint32_t cluster;
+  uint32_t extents;
+  ret = fat32_fat_allocate_chain(fs->fat, 1, 0, previous, &cluster,
+                                 &extents);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  fat32_extent_cache_invalidate(fs->extent_cache,
+                                fat32_fs_object_first_cluster(directory));
+
+  /* the cluster is in the chain already */
+  ret = fat32_fs_object_init_cluster(fs, cluster, 0, 0);
+  if (ret != FE_OK) {
+    return FE_FS_INCONSISTENT;
+  }
+
+  fat32_dir_index_grow(index, fs->cluster_size /
+                              sizeof(struct fat32_direntry_t));
+
+  return FE_OK;
+}
+
+/**
+ * Writes a directory entry to an unused place in the directory. The
+ * directory is extended if it's full. The name is checked against the
+ * directory index under the same lock as the insertion so that concurrent
+ * creations of the name can't both succeed.
+ *
+ * @param directory File system object representing the directory.
+ * @param direntry  Directory entry to write.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO       @li the object already exists (@em errno is set to
+ *                            @em EEXIST)
+ *                        @li IO errors while working with device
+ * @retval FE_INVALID_DEV
+ * @retval FE_INVALID_FS
+ * @retval FE_FS_IS_FULL
+ * @retval FE_FS_INCONSISTENT
+ */
+static enum fat32_error_t
+fat32_fs_object_insert(struct fat32_fs_object_t *directory,
+                       const struct fat32_direntry_t *direntry)
+{
+  const struct fat32_fs_t   *fs          = directory->fs;
+  struct fat32_dir_cache_t  *dir_cache   = fs->dir_cache;
+  uint32_t                   first       =
+    fat32_fs_object_first_cluster(directory);
+  uint32_t                   per_cluster =
+    fs->cluster_size / sizeof(struct fat32_direntry_t);
+  struct fat32_extent_map_t *map         = NULL;
+  struct fat32_dir_index_t  *index;
+  uint32_t                   entry;
+  enum fat32_error_t         ret;
+
+  fat32_dir_cache_lock(dir_cache);
+
+  ret = fat32_fs_object_extent_map(directory, &map);
+  if (ret != FE_OK) {
+    goto unlock;
+  }
+
+  ret = fat32_dir_cache_get(dir_cache, fs, map, &index);
+  if (ret != FE_OK) {
+    goto unlock;
+  }
+
+  if (fat32_dir_index_contains(index, direntry->name)) {
+    fat32_dir_cache_unlock(dir_cache);
+    fat32_extent_cache_release(fs->extent_cache, map);
+
+    errno = EEXIST;
+    return FE_ERRNO;
+  }
+
+  ret = fat32_dir_index_reserve(index, 1, direntry->name, &entry);
+  if (ret == FE_FS_IS_FULL) {
+    fat32_extent_cache_release(fs->extent_cache, map);
+    map = NULL;
+
+    ret = fat32_fs_object_grow_directory(directory, index);
+    if (ret != FE_OK) {
+      goto unlock;
+    }
+
+    ret = fat32_fs_object_extent_map(directory, &map);
+    if (ret != FE_OK) {
+      goto unlock;
+    }
+
+    assert( fat32_dir_index_reserve(index, 1,
+                                    direntry->name, &entry) == FE_OK );
+  } else if (ret != FE_OK) {
+    goto unlock;
+  }
+
+  uint32_t physical;
+  if (!fat32_extent_map_lookup(map, entry / per_cluster, &physical, NULL)) {
+    ret = FE_INVALID_FS;
+    goto unlock;
+  }
+
+  off_t offset = fat32_cluster_to_offset(fs->bpb, physical) +
+    (entry % per_cluster) * sizeof(struct fat32_direntry_t);
+
+  ret = fat32_direntry_flush(direntry, fs->cluster_cache, offset);
+
+unlock:
+  /* the index is rebuilt from the directory itself the next time */
+  if (ret != FE_OK) {
+    fat32_dir_cache_invalidate(dir_cache, first);
+  }
+
+  fat32_dir_cache_unlock(dir_cache);
+  fat32_extent_cache_release(fs->extent_cache, map);
+
+  return ret;
+}
+
+enum fat32_error_t
+fat32_fs_object_create(struct fat32_fs_object_t *parent, const char *name,
+                       bool directory)
+{
+  assert( fat32_fs_object_is_directory(parent) );
+
+  const struct fat32_fs_t *fs      = parent->fs;
+  uint32_t                 cluster = 0;
+  struct fat32_direntry_t  direntry;
+  enum fat32_error_t       ret;
+  int                      error;
+
+  if (!fat32_direntry_init(&direntry, name,
+                           directory ?
+                           FAT32_DIRENTRY_DIRECTORY : FAT32_DIRENTRY_ARCHIVE,
+                           0)) {
+    return FE_ERRNO;
+  }
+
+  /* a directory gets its cluster before it's referenced */
+  if (directory) {
+    uint32_t extents;
+    ret = fat32_fat_allocate_chain(fs->fat, 1, 0, 0, &cluster, &extents);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    /* dotdot entry refers to the root directory by zero cluster */
+    uint32_t dotdot = fat32_fs_object_is_root_directory(parent) ?
+      0 : fat32_fs_object_first_cluster(parent);
+
+    ret = fat32_fs_object_init_cluster(fs, cluster, cluster, dotdot);
+    if (ret != FE_OK) {
+      goto free_cluster;
+    }
+
+    direntry.first_cluster_hi = cluster >> 16;
+    direntry.first_cluster_lo = cluster & 0xffff;
+  }
+
+  ret = fat32_fs_object_insert(parent, &direntry);
+  if (ret == FE_OK || !directory) {
+    return ret;
+  }
+
+free_cluster:
+  /* freeing the cluster must not clobber the reason of the failure */
+  error = errno;
+
+  fat32_cluster_cache_invalidate(fs->cluster_cache, cluster, 1);
+  if (fat32_fat_mark_cluster_chain_free(fs->fat, cluster) != FE_OK) {
+    return FE_FS_PARTIALLY_CONSISTENT;
+  }
+
+  errno = error;
+  return ret;
+}
+
 enum fat32_error_t
 fat32_fs_object_truncate(struct fat32_fs_object_t *fs_object,
                          uint32_t length)
 {
   assert( fat32_fs_object_is_file(fs_object) );
 
-  const struct fat32_fs_t *fs      = fs_object->fs;
-  struct fat32_fat_t      *fat     = fs->fat;
-  uint32_t                 csize   = fs->cluster_size;
-  uint32_t                 fsize   = fat32_fs_object_size(fs_object);
-  uint32_t                 cluster = fat32_fs_object_first_cluster(fs_object);
-  uint32_t                 next;
+  const struct fat32_fs_t  *fs        = fs_object->fs;
+  struct fat32_file_info_t *file_info = fs_object->file_info;
+  uint32_t                  csize     = fs->cluster_size;
+  uint32_t                  fsize     = fat32_fs_object_size(fs_object);
+  enum fat32_error_t        ret       = FE_OK;
 
   /* number of cluster needed for the resized file */
-  uint32_t clusters = (length + csize - 1) / csize;
+  uint32_t clusters = (uint32_t) (((uint64_t) length + csize - 1) / csize);
+
+  assert( file_info != NULL );
 
+  assert( pthread_rwlock_wrlock(&file_info->lock) == 0 );
 
   if (length < fsize) {
-    fat32_fat_entry_t entry;
-    enum fat32_error_t       ret;
-    if (clusters == 0) {
-      next = cluster;
-      ret = fat32_direntry_make_empty(fs_object->direntry, fs->fd,
-                                      fs_object->offset);
-      switch (ret) {
-      case FE_OK:
-        break;
-      case FE_ERRNO:
-      case FE_FS_INCONSISTENT:
-        return ret;
-      default:
-        assert( false );
-      }
-    } else {
-      ret = fat32_fat_get_nth_entry(fat, cluster, clusters - 1, &entry);
-      switch (ret) {
-      case FE_OK:
-        break;
-      case FE_ERRNO:
-      case FE_INVALID_DEV:
-      case FE_INVALID_FS:
-        return ret;
-      case FE_CLUSTER_CHAIN_ENDED:
-        /* by construction FE_CLUSTER_CHAIN_ENDED can't be returned */
-        return FE_INVALID_FS;
-      default:
-        assert( false );
-      }
-      cluster = fat32_fat_entry_to_cluster(entry);
-      ret     = fat32_fat_get_entry(fat, cluster, &entry);
-      switch (ret) {
-      case FE_OK:
-        break;
-      case FE_ERRNO:
-      case FE_INVALID_DEV:
-        return ret;
-      default:
-        assert( false );
-      }
-      next    = fat32_fat_entry_to_cluster(entry);
+    fs_object->direntry->file_size = length;
+    file_info->direntry_dirty      = true;
 
-      ret = fat32_fat_mark_cluster_last(fat, cluster);
-      switch (ret) {
-      case FE_OK:
-        break;
-      case FE_FS_INCONSISTENT:
-        return ret;
-      default:
-        assert( false );
-      }
+    if (file_info->initialized > length) {
+      file_info->initialized = length;
     }
 
-    ret = fat32_fat_mark_cluster_chain_free(fat, next);
-    switch (ret) {
-    case FE_OK:
-      return FE_OK;
-    case FE_ERRNO:
-    case FE_FS_INCONSISTENT:
-    case FE_INVALID_FS:
-      return FE_FS_PARTIALLY_CONSISTENT;
-    case FE_INVALID_DEV:
-      return FE_INVALID_DEV;
-    default:
-      assert( false );
+    /* clusters are freed only when the entry does not reference them */
+    ret = fat32_fs_object_write_direntry(fs_object);
+    if (ret == FE_OK) {
+      ret = fat32_fs_object_trim_locked(fs_object);
     }
   } else if (length > fsize) {
-    assert( false );
-  } else {
-    /* length == fsize */
-    return FE_OK;
+    /* data kept in memory takes clusters right after the allocated ones */
+    ret = fat32_fs_object_allocate_delayed(fs_object);
+    if (ret != FE_OK) {
+      goto unlock;
+    }
+
+    /* new clusters are past the initialized data; they are zeroed on flush
+     * unless they are written before */
+    if (clusters > file_info->delayed_first) {
+      ret = fat32_fs_object_append_clusters(fs_object,
+                                            clusters -
+                                            file_info->delayed_first,
+                                            false);
+      if (ret != FE_OK) {
+        goto unlock;
+      }
+    }
+
+    fs_object->direntry->file_size = length;
+    file_info->direntry_dirty      = true;
   }
+
+unlock:
+  assert( pthread_rwlock_unlock(&file_info->lock) == 0 );
+
+  return ret;
 }
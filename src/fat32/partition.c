@@ -0,0 +1,263 @@
+/**
+ * @file   partition.c
+ * @author agent <agent@local>
+ * @date   Fri Oct 16 09:37:42 2026
+ *
+ * @brief  Implementation of partition tables parsing.
+ *
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "endian.h"
+
+#include "utils/log.h"
+
+#include "fat32/partition.h"
+
+/// size of a sector MBR is stored in
+#define FAT32_MBR_SECTOR_SIZE 512
+
+/// an offset of the partition table in MBR
+#define FAT32_MBR_TABLE_OFFSET 446
+
+/// a number of primary partitions
+#define FAT32_MBR_PRIMARY_COUNT 4
+
+/// maximum number of logical partitions followed; protects against loops
+#define FAT32_MBR_MAX_LOGICAL 128
+
+/// MBR partition type of GPT protective partition
+static const uint8_t FAT32_MBR_TYPE_GPT = 0xee;
+
+/// GPT header signature
+static const char FAT32_GPT_SIGNATURE[8] = "EFI PART";
+
+/// Sector sizes GPT is looked for with. 512 byte sectors are used by the
+/// majority of disks, 4096 byte ones by 4Kn disks.
+static const uint32_t FAT32_GPT_SECTOR_SIZES[] = { 512, 4096 };
+
+/**
+ * Checks whether MBR partition type denotes an extended partition.
+ */
+static bool
+fat32_mbr_type_is_extended(uint8_t type)
+{
+  return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+/**
+ * Reads a partition table from MBR or EBR.
+ *
+ * @param      dev     Device.
+ * @param      offset  An offset of the sector.
+ * @param[out] entries Partition table.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_NO_PARTITION the sector has no boot signature
+ */
+static enum fat32_error_t
+fat32_mbr_read(const struct fat32_dev_t *dev, off_t offset,
+               struct fat32_mbr_entry_t entries[FAT32_MBR_PRIMARY_COUNT])
+{
+  uint8_t sector[FAT32_MBR_SECTOR_SIZE];
+
+  enum fat32_error_t ret = fat32_dev_read(dev, sector, sizeof(sector), offset);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  if (sector[510] != 0x55 || sector[511] != 0xaa) {
+    return FE_NO_PARTITION;
+  }
+
+  memcpy(entries, sector + FAT32_MBR_TABLE_OFFSET,
+         FAT32_MBR_PRIMARY_COUNT * sizeof(struct fat32_mbr_entry_t));
+
+  for (int i = 0; i < FAT32_MBR_PRIMARY_COUNT; ++i) {
+    entries[i].lba_first = le32toh(entries[i].lba_first);
+    entries[i].sectors   = le32toh(entries[i].sectors);
+  }
+
+  return FE_OK;
+}
+
+/**
+ * Finds a logical partition following the chain of EBRs.
+ *
+ * @param      dev      Device.
+ * @param      extended The first sector of the extended partition.
+ * @param      number   Logical partition number starting from zero.
+ * @param[out] offset   An offset of the partition.
+ * @param[out] size     Size of the partition.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_NO_PARTITION
+ */
+static enum fat32_error_t
+fat32_mbr_find_logical(const struct fat32_dev_t *dev, uint32_t extended,
+                       uint32_t number, off_t *offset, off_t *size)
+{
+  struct fat32_mbr_entry_t entries[FAT32_MBR_PRIMARY_COUNT];
+  uint32_t                 ebr = extended;
+
+  if (number >= FAT32_MBR_MAX_LOGICAL) {
+    return FE_NO_PARTITION;
+  }
+
+  for (uint32_t i = 0; ; ++i) {
+    enum fat32_error_t ret =
+      fat32_mbr_read(dev, (off_t) ebr * FAT32_MBR_SECTOR_SIZE, entries);
+    if (ret != FE_OK) {
+      return ret;
+    }
+
+    if (i == number) {
+      break;
+    }
+
+    /* the second entry links to the next EBR relative to the extended
+     * partition */
+    if (!fat32_mbr_type_is_extended(entries[1].type) ||
+        entries[1].lba_first == 0) {
+      return FE_NO_PARTITION;
+    }
+
+    ebr = extended + entries[1].lba_first;
+  }
+
+  if (entries[0].type == 0 || entries[0].sectors == 0) {
+    return FE_NO_PARTITION;
+  }
+
+  /* the first entry is relative to its EBR */
+  *offset = ((off_t) ebr + entries[0].lba_first) * FAT32_MBR_SECTOR_SIZE;
+  *size   = (off_t) entries[0].sectors * FAT32_MBR_SECTOR_SIZE;
+
+  return FE_OK;
+}
+
+/**
+ * Finds a partition in GPT.
+ *
+ * @param      dev    Device.
+ * @param      number Partition entry number starting from zero.
+ * @param[out] offset An offset of the partition.
+ * @param[out] size   Size of the partition.
+ *
+ * @retval FE_OK
+ * @retval FE_ERRNO
+ * @retval FE_INVALID_DEV
+ * @retval FE_NO_PARTITION
+ */
+static enum fat32_error_t
+fat32_gpt_find(const struct fat32_dev_t *dev, uint32_t number,
+               off_t *offset, off_t *size)
+{
+  struct fat32_gpt_header_t header;
+  uint32_t                  sector_size = 0;
+
+  /* the header is in the second sector whatever sector size is */
+  for (size_t i = 0; i < sizeof(FAT32_GPT_SECTOR_SIZES) / sizeof(uint32_t);
+       ++i) {
+    enum fat32_error_t ret = fat32_dev_read(dev, &header, sizeof(header),
+                                            FAT32_GPT_SECTOR_SIZES[i]);
+    if (ret == FE_INVALID_DEV) {
+      break;
+    } else if (ret != FE_OK) {
+      return ret;
+    }
+
+    if (memcmp(header.signature, FAT32_GPT_SIGNATURE,
+               sizeof(FAT32_GPT_SIGNATURE)) == 0) {
+      sector_size = FAT32_GPT_SECTOR_SIZES[i];
+      break;
+    }
+  }
+
+  if (sector_size == 0) {
+    log_warning("Protective MBR is found but GPT header is not.");
+    return FE_NO_PARTITION;
+  }
+
+  uint32_t entry_size = le32toh(header.entry_size);
+  if (number >= le32toh(header.entries_count) ||
+      entry_size < sizeof(struct fat32_gpt_entry_t)) {
+    return FE_NO_PARTITION;
+  }
+
+  struct fat32_gpt_entry_t entry;
+  off_t                    entry_offset =
+    (off_t) le64toh(header.entries_lba) * sector_size +
+    (off_t) number * entry_size;
+
+  enum fat32_error_t ret = fat32_dev_read(dev, &entry, sizeof(entry),
+                                          entry_offset);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  static const uint8_t unused[16];
+  uint64_t first = le64toh(entry.lba_first);
+  uint64_t last  = le64toh(entry.lba_last);
+
+  if (memcmp(entry.type_guid, unused, sizeof(unused)) == 0 || last < first) {
+    return FE_NO_PARTITION;
+  }
+
+  *offset = (off_t) first * sector_size;
+  *size   = (off_t) (last - first + 1) * sector_size;
+
+  return FE_OK;
+}
+
+enum fat32_error_t
+fat32_partition_find(const struct fat32_dev_t *dev, uint32_t number,
+                     off_t *offset, off_t *size)
+{
+  struct fat32_mbr_entry_t entries[FAT32_MBR_PRIMARY_COUNT];
+
+  if (number == 0) {
+    return FE_NO_PARTITION;
+  }
+
+  enum fat32_error_t ret = fat32_mbr_read(dev, 0, entries);
+  if (ret != FE_OK) {
+    return ret;
+  }
+
+  for (int i = 0; i < FAT32_MBR_PRIMARY_COUNT; ++i) {
+    if (entries[i].type == FAT32_MBR_TYPE_GPT) {
+      return fat32_gpt_find(dev, number - 1, offset, size);
+    }
+  }
+
+  if (number <= FAT32_MBR_PRIMARY_COUNT) {
+    const struct fat32_mbr_entry_t *entry = &entries[number - 1];
+
+    if (entry->type == 0 || entry->sectors == 0 ||
+        fat32_mbr_type_is_extended(entry->type)) {
+      return FE_NO_PARTITION;
+    }
+
+    *offset = (off_t) entry->lba_first * FAT32_MBR_SECTOR_SIZE;
+    *size   = (off_t) entry->sectors * FAT32_MBR_SECTOR_SIZE;
+
+    return FE_OK;
+  }
+
+  for (int i = 0; i < FAT32_MBR_PRIMARY_COUNT; ++i) {
+    if (fat32_mbr_type_is_extended(entries[i].type)) {
+      return fat32_mbr_find_logical(dev, entries[i].lba_first,
+                                    number - FAT32_MBR_PRIMARY_COUNT - 1,
+                                    offset, size);
+    }
+  }
+
+  return FE_NO_PARTITION;
+}
@@ -8,8 +8,10 @@
  *
  */
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "hash_table.h"
 
@@ -196,6 +198,20 @@ hash_table_lookup(struct hash_table_t *hash_table, const void *key)
   return list_lookup(list, key, hash_table->equal);
 }
 
+void
+hash_table_foreach(struct hash_table_t *hash_table,
+                   visitor_t visitor, void *arg)
+{
+  ssize_t size = hash_table->size;
+
+  for (size_t i = 0; i < size; ++i) {
+    for (struct list_t *list = hash_table->data[i];
+         list != NULL; list = list->next) {
+      visitor(list->key, list->value, arg);
+    }
+  }
+}
+
 void
 hash_table_delete(struct hash_table_t *hash_table, const void *key)
 {
@@ -227,6 +243,25 @@ hash_table_string_equal(const void *a, const void *b)
   return strcmp(a, b) == 0;
 }
 
+unsigned int
+hash_table_string_case_hash(const void *str)
+{
+  unsigned int hash = 0;
+
+  /* overflow is ignored */
+  for (const char *p = (const char *) str; *p != '\0'; ++p) {
+    hash = hash * 31 + (unsigned long int) toupper((unsigned char) *p);
+  }
+
+  return hash;
+}
+
+bool
+hash_table_string_case_equal(const void *a, const void *b)
+{
+  return strcasecmp(a, b) == 0;
+}
+
 
 void
 list_free(struct list_t *list,
@@ -47,7 +47,19 @@
                           "    -V   --version   print version\n" \
                           "\n"                                   \
                           "fusefat32 options:\n"                 \
-                          "    -o dev=STRING    a path to device to mount\n")
+                          "    -o dev=STRING    a path to device to mount\n" \
+                          "    -o fat_preload   load the whole FAT into memory\n" \
+                          "    -o fat_readahead=N  FAT sectors to read ahead " \
+                          "(default: 32)\n"                     \
+                          "    -o cache_size=N  cluster cache size in MiB " \
+                          "(default: 16)\n"                     \
+                          "    -o dev_direct    open device with O_DIRECT\n" \
+                          "    -o partition=N   mount N-th partition of " \
+                          "a whole disk\n"                      \
+                          "    -o offset=N      file system offset on the " \
+                          "device in bytes\n"                   \
+                          "    -o readahead=N   maximum file readahead in " \
+                          "KiB (default: 1024)\n")
 
 /**
  * Key parameters of fusefat32
@@ -59,8 +71,12 @@ enum {
   KEY_HELP,                     /**< indicates that user has acquired program
                                    usage information */
   KEY_VERBOSE,                  /**< print verbose information while mounting */
-  KEY_FOREGROUND                /**< run program in foreground and log all
+  KEY_FOREGROUND,               /**< run program in foreground and log all
                                    messages to @em stderr */
+  KEY_FAT_PRELOAD,              /**< load the whole FAT into memory at mount
+                                   time */
+  KEY_DEV_DIRECT                /**< bypass kernel caches when accessing the
+                                   device */
 };
 
 
@@ -71,6 +87,11 @@ enum {
 static struct fuse_opt fusefat32_options[] = {
   FUSEFAT32_OPT("dev=%s", device),
   FUSEFAT32_OPT("log=%s", log),
+  FUSEFAT32_OPT("fat_readahead=%u", fat_readahead),
+  FUSEFAT32_OPT("cache_size=%u", cache_size),
+  FUSEFAT32_OPT("partition=%u", partition),
+  FUSEFAT32_OPT("offset=%llu", offset),
+  FUSEFAT32_OPT("readahead=%u", readahead),
 
   FUSE_OPT_KEY("--version",    KEY_VERSION),
   FUSE_OPT_KEY("-V",           KEY_VERSION),
@@ -80,6 +101,8 @@ static struct fuse_opt fusefat32_options[] = {
   FUSE_OPT_KEY("-v",           KEY_VERBOSE),
   FUSE_OPT_KEY("-f",           KEY_FOREGROUND),
   FUSE_OPT_KEY("--foreground", KEY_FOREGROUND),
+  FUSE_OPT_KEY("fat_preload",  KEY_FAT_PRELOAD),
+  FUSE_OPT_KEY("dev_direct",   KEY_DEV_DIRECT),
   FUSE_OPT_END
 };
 
@@ -112,6 +135,16 @@ fusefat32_process_options(void *data, const char *arg, int key,
   case KEY_FOREGROUND:
     config->foreground = true;
 
+    /* discard option */
+    return 0;
+  case KEY_FAT_PRELOAD:
+    config->fat_preload = true;
+
+    /* discard option */
+    return 0;
+  case KEY_DEV_DIRECT:
+    config->dev_direct = true;
+
     /* discard option */
     return 0;
   case FUSE_OPT_KEY_NONOPT:
@@ -222,7 +255,20 @@ main(int argc, char *argv[])
 
   enum fat32_error_t ret;
   struct fat32_fs_params_t params = { .file_table_size = 1024,
-                                      .fh_table_size   = 1024, };
+                                      .fh_table_size   = 1024,
+                                      .extent_table_size = 1024,
+                                      .dir_table_size  = 1024,
+                                      .fat_cache_size  = 1024,
+                                      .fat_preload     = config->fat_preload,
+                                      .fat_readahead   =
+                                        config->fat_readahead,
+                                      .cluster_cache_size =
+                                        (uint64_t) config->cache_size << 20,
+                                      .dev_direct      = config->dev_direct,
+                                      .partition       = config->partition,
+                                      .dev_offset      = config->offset,
+                                      .readahead       =
+                                        config->readahead << 10, };
   ret = fat32_fs_open(config->device, &params,
                       &fusefat32.fs);
 
@@ -233,6 +279,9 @@ main(int argc, char *argv[])
 
     if (ret == FE_ERRNO) {
       log_error(_("Error description: %s"), strerror(errno));
+    } else if (ret == FE_NO_PARTITION) {
+      log_error(_("Partition %u is not found on the device."),
+                config->partition);
     } else {
       log_error(_("Can't get error description. Error code is %d"), ret);
     }
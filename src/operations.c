@@ -15,8 +15,12 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -37,6 +41,7 @@
 #include "fat32/direntry.h"
 #include "fat32/diriter.h"
 #include "fat32/fat.h"
+#include "fat32/extent_map.h"
 #include "fat32/utils.h"
 
 /**
@@ -55,7 +60,7 @@ fs_object_attrs(const struct fat32_fs_object_t *fs_object,
     stbuf->st_mode    = S_IFDIR | 0755;
     stbuf->st_nlink   = 1;
   } else {
-    stbuf->st_mode    = S_IFREG | 0444;
+    stbuf->st_mode    = S_IFREG | 0644;
     stbuf->st_nlink   = 1;
 
     off_t     size    = (off_t) fat32_fs_object_size(fs_object);
@@ -161,6 +166,17 @@ fat32_getattr(const char *path, struct stat *stbuf)
     if (fs_object == NULL) {
       return -ENOENT;
     } else {
+      struct fat32_file_info_t *file_info =
+        hash_table_lookup(ff_context->fs->file_table, path);
+
+      /* the size of an open file may not have reached the device yet */
+      if (file_info != NULL && fat32_fs_object_is_file(fs_object)) {
+        assert( pthread_rwlock_rdlock(&file_info->lock) == 0 );
+        memcpy(fs_object->direntry, file_info->direntry,
+               sizeof(struct fat32_direntry_t));
+        assert( pthread_rwlock_unlock(&file_info->lock) == 0 );
+      }
+
       fs_object_attrs(fs_object, stbuf);
       fat32_fs_object_free(fs_object);
 
@@ -300,6 +316,84 @@ cleanup:
   return retcode;
 }
 
+/**
+ * Attaches a file system object to the state shared by all open instances
+ * of the file. The state is created if the file is not open yet.
+ *
+ * @param fs        File system.
+ * @param path      A path to the file.
+ * @param fs_object File system object representing the file.
+ *
+ * @return Zero on success or negated error code.
+ */
+static int
+fat32_file_attach(struct fat32_fs_t *fs, const char *path,
+                  struct fat32_fs_object_t *fs_object)
+{
+  struct fat32_file_info_t *f32_file_info;
+
+  f32_file_info = hash_table_lookup(fs->file_table, path);
+  if (f32_file_info != NULL) {
+    f32_file_info->refs += 1;
+  } else {
+    /* as we supplied key cloner so it's valid to ignore const modifier
+     * of path variable */
+    if (hash_table_insert(fs->file_table, (void *) path, NULL) == NULL) {
+      return -errno;
+    }
+
+    f32_file_info = hash_table_lookup(fs->file_table, path);
+  }
+
+  /* all the instances of the file share its directory entry */
+  enum fat32_error_t ret = fat32_fs_object_attach(fs_object, f32_file_info);
+  if (ret != FE_OK) {
+    int retcode = (ret == FE_ERRNO) ? -errno : -EINVAL;
+
+    if (--f32_file_info->refs == 0) {
+      hash_table_delete(fs->file_table, path);
+    }
+
+    return retcode;
+  }
+
+  return 0;
+}
+
+/**
+ * Detaches a file system object from the state shared by all open instances
+ * of the file. The file is flushed. When the last instance is detached
+ * clusters preallocated past the end of the file are freed and the state is
+ * destroyed.
+ *
+ * @param fs        File system.
+ * @param path      A path to the file.
+ * @param fs_object File system object attached by ::fat32_file_attach.
+ *
+ * @return Result of flushing the file.
+ */
+static enum fat32_error_t
+fat32_file_detach(struct fat32_fs_t *fs, const char *path,
+                  struct fat32_fs_object_t *fs_object)
+{
+  struct fat32_file_info_t *f32_file_info = fs_object->file_info;
+
+  enum fat32_error_t ret = fat32_fs_object_flush(fs_object, true);
+
+  /* clusters preallocated past the end are not kept for closed files */
+  if (ret == FE_OK && f32_file_info->refs == 1) {
+    ret = fat32_fs_object_trim(fs_object);
+  }
+
+  if (--f32_file_info->refs == 0) {
+    /* data which could not be flushed gives its clusters back */
+    fat32_file_info_delayed_truncate(f32_file_info, fs->fat, 0);
+    hash_table_delete(fs->file_table, path);
+  }
+
+  return ret;
+}
+
 /**
  * Function that implements @em open system call.
  *
@@ -324,8 +418,8 @@ int fat32_open(const char *path, struct fuse_file_info *file_info)
     if (fs_object == NULL) {
       return -EPERM;
     } else {
-      const struct fat32_fs_t *fs = fs_object->fs;
-      fat32_fh_t         fh;
+      struct fat32_fs_t  *fs = ff_context->fs;
+      fat32_fh_t          fh;
 
       if (fat32_fs_object_is_directory(fs_object)) {
         retcode = -EISDIR;
@@ -344,25 +438,18 @@ int fat32_open(const char *path, struct fuse_file_info *file_info)
        */
       file_info->fh = fh;
       if (hash_table_insert(fs->fh_table, &fh, fs_object) == NULL) {
-        retcode = errno;
+        retcode = -errno;
         goto fat32_open_cleanup;
       }
 
-      struct fat32_file_info_t *f32_file_info;
-      f32_file_info = hash_table_lookup(fs->file_table, path);
-      if (f32_file_info != NULL) {
-        f32_file_info->refs += 1;
-      } else {
-        /* as we supplied key cloner so it's valid to ignore const modifier
-         * of path variable */
-        if (hash_table_insert(fs->file_table, (void *) path, NULL) == NULL) {
-          hash_table_delete(fs->fh_table, &fh);
-          retcode = errno;
-          goto fat32_open_cleanup;
-        }
+      retcode = fat32_file_attach(fs, path, fs_object);
+      if (retcode != 0) {
+        /* the object is owned by the table of file handles now */
+        hash_table_delete(fs->fh_table, &fh);
+        return retcode;
       }
 
-        return 0;
+      return 0;
 
     }
   } else {
@@ -397,319 +484,1451 @@ fat32_release(const char *path, struct fuse_file_info *file_info)
   struct fusefat32_context_t *ff_context =
     (struct fusefat32_context_t *) context->private_data;
   struct fat32_fs_t          *fs         = ff_context->fs;
-  struct fat32_file_info_t   *f32_file_info;
 
   /* TODO: file handle freeing */
 
-  hash_table_delete(fs->fh_table, &file_info->fh);
-
-  f32_file_info = hash_table_lookup(fs->file_table, path);
-  assert( f32_file_info != NULL );
+  struct fat32_fs_object_t   *fs_object =
+    hash_table_lookup(fs->fh_table, &file_info->fh);
+  assert( fs_object != NULL );
 
-  if (--f32_file_info->refs == 0) {
-    hash_table_delete(fs->file_table, path);
+  /* there is no way to report an error from release */
+  enum fat32_error_t ret = fat32_file_detach(fs, path, fs_object);
+  if (ret != FE_OK) {
+    log_error_loc(FUSEFAT32_INCONSISTENT_FS_MSG);
   }
 
+  hash_table_delete(fs->fh_table, &file_info->fh);
+
   return 0;
 }
 
 /**
- * Implements @em read system call.
+ * Converts a result of an operation modifying an open file to an error code.
  *
- * @param path      A path to file to read.
- * @param buffer    A buffer to store read data.
- * @param size      A size of data to be read.
- * @param offset    An offset from the beginning of the file.
- * @param file_info Additional information.
+ * @param ret Result of the operation.
  *
- * @return Number of read characters on success. 0 is returned when EOF occured.
- *         Negative value indicates an erorr. It's specified using @em errno.
+ * @return Operation result.
+ */
+static int
+fat32_file_result(enum fat32_error_t ret)
+{
+  switch (ret) {
+  case FE_OK:
+    return 0;
+  case FE_ERRNO:
+    return -errno;
+  case FE_FS_IS_FULL:
+    return -ENOSPC;
+  case FE_INVALID_DEV:
+    log_error_loc(FUSEFAT32_INVALID_DEVICE_MSG);
+    return -EINVAL;
+  case FE_INVALID_FS:
+    log_error_loc(FUSEFAT32_INVALID_FS_MSG);
+    return -EINVAL;
+  case FE_FS_INCONSISTENT:
+    log_error_loc(FUSEFAT32_INCONSISTENT_FS_MSG);
+    return -EIO;
+  case FE_FS_PARTIALLY_CONSISTENT:
+    log_error_loc(FUSEFAT32_PARTIALLY_INCONSISTENT_FS_MSG);
+    return 0;
+  default:
+    assert( false );
+  }
+}
+
+/**
+ * Implements @em flush which is called on every @em close of the file.
+ * Clusters are allocated for the data which has been written past the
+ * allocated ones. Modified directory entry is kept in memory till @em fsync
+ * or the last @em release so that files appended to and closed by many
+ * writers don't rewrite it on every close.
+ *
+ * @param path      A path to file.
+ * @param file_info File info.
+ *
+ * @return Operation result.
  */
 int
-fat32_read(const char *path, char *buffer, size_t size, off_t offset,
-           struct fuse_file_info *file_info)
+fat32_flush(const char *path, struct fuse_file_info *file_info)
 {
+  (void) path;
+
   struct fuse_context        *context    = fuse_get_context();
   struct fusefat32_context_t *ff_context =
     (struct fusefat32_context_t *) context->private_data;
   struct fat32_fs_t          *fs         = ff_context->fs;
-  struct fat32_bpb_t         *bpb        = fs->bpb;
-  struct fat32_fat_t         *fat        = fs->fat;
-
 
   struct fat32_fs_object_t   *fs_object =
     hash_table_lookup(fs->fh_table, &file_info->fh);
 
   assert( fs_object != NULL );
 
-  uint32_t file_size = fs_object->direntry->file_size;
-  if (offset >= file_size) {
-    /* EOF */
-    return 0;
-  }
-
-  if (offset + size > file_size) {
-    size = file_size - offset;
-  }
-
-  uint32_t           csize   = fs->cluster_size;
-  uint32_t           cluster = fat32_fs_object_first_cluster(fs_object);
-  uint32_t           n       = offset / csize;
-  uint16_t           coffset = offset % csize;
-  fat32_fat_entry_t  entry;
-  enum fat32_error_t ret     =
-    fat32_fat_get_nth_entry(fat, cluster, n, &entry);
-
-  ssize_t overall = 0;
-  while (size) {
-    if (ret == FE_OK) {
-      cluster                    = fat32_fat_entry_to_cluster(entry);
-      off_t              goffset =
-        fat32_cluster_to_offset(bpb, cluster) + coffset;
-
-      off_t seekret = lseek(fs->fd, goffset, SEEK_SET);
-      if (seekret == (off_t) -1) {
-        return -errno;
-      }
-
-      uint16_t  cunread = csize - coffset;
-      uint32_t  to_read = (cunread > size) ? size : cunread;
-      ssize_t     nread = xread(fs->fd, buffer, to_read);
-      if (nread == -1) {
-        return -errno;
-      } else if (nread < to_read) {
-        // invalid device again
-        return -EINVAL;
-      }
-      buffer  += nread;
-      overall += nread;
-      ret      = fat32_fat_get_entry(fat, cluster, &entry);
-      coffset  = 0;
-      size    -= nread;
-
-    } else {
-      switch (ret) {
-      case FE_ERRNO:
-        return -ret;
-      case FE_INVALID_FS:
-      case FE_INVALID_DEV:
-      case FE_CLUSTER_CHAIN_ENDED: /* this must not happen because
-                                    * we decreased requested size to fit
-                                    * in file */
-        return -EINVAL;
-      default:
-        assert( false );
-      }
-    }
-  }
-
-  /* TODO: cache file object cluster position */
-
-  return overall;
+  return fat32_file_result(fat32_fs_object_flush(fs_object, false));
 }
 
 /**
- * Implements unlink system call.
+ * Implements @em fsync system call. Besides allocating clusters for the
+ * data kept in memory and updating directory entry all the modified clusters
+ * and FAT are written back and the device is flushed.
  *
- * @param path A path to file.
+ * @param path      A path to file.
+ * @param datasync  Unused. Metadata is always written.
+ * @param file_info File info.
  *
- * @return Result of operation.
+ * @return Operation result.
  */
 int
-fat32_unlink(const char *path)
+fat32_fsync(const char *path, int datasync, struct fuse_file_info *file_info)
 {
+  (void) path;
+  (void) datasync;
+
   struct fuse_context        *context    = fuse_get_context();
   struct fusefat32_context_t *ff_context =
     (struct fusefat32_context_t *) context->private_data;
   struct fat32_fs_t          *fs         = ff_context->fs;
 
-  struct fat32_file_info_t   *file_info =
-    hash_table_lookup(fs->file_table, path);
+  struct fat32_fs_object_t   *fs_object =
+    hash_table_lookup(fs->fh_table, &file_info->fh);
 
-  /* TODO: for now we don't implement UNIX semantic of deletion */
-  if (file_info == NULL) {
-    return fat32_perform_unlink(fs, path);
-  } else {
-    return -EBUSY;
+  assert( fs_object != NULL );
+
+  int retcode = fat32_file_result(fat32_fs_object_flush(fs_object, true));
+  if (retcode != 0) {
+    return retcode;
+  }
+
+  enum fat32_error_t ret = fat32_cluster_cache_sync(fs->cluster_cache);
+  if (ret == FE_OK) {
+    ret = fat32_fat_sync(fs->fat);
+  }
+  if (ret == FE_OK) {
+    ret = fat32_dev_sync(&fs->dev);
   }
+
+  return fat32_file_result(ret);
 }
 
 /**
- * Implements @em rmdir system call
+ * Implements @em fallocate system call. Clusters are preallocated in as few
+ * extents as possible so that the file written later is not fragmented and
+ * writes need no allocation. With @em FALLOC_FL_KEEP_SIZE clusters past the
+ * end of the file are freed when it's closed for the last time.
  *
- * @param path A path to directory.
+ * @param path      A path to file.
+ * @param mode      Zero or @em FALLOC_FL_KEEP_SIZE.
+ * @param offset    An offset of the range to preallocate.
+ * @param length    Length of the range.
+ * @param file_info File info.
  *
  * @return Operation result.
  */
 int
-fat32_rmdir(const char *path)
+fat32_fallocate(const char *path, int mode, off_t offset, off_t length,
+                struct fuse_file_info *file_info)
 {
+  (void) path;
+
   struct fuse_context        *context    = fuse_get_context();
   struct fusefat32_context_t *ff_context =
     (struct fusefat32_context_t *) context->private_data;
   struct fat32_fs_t          *fs         = ff_context->fs;
 
-  struct fat32_fs_object_t *fs_object;
-  enum fat32_error_t        ret =
-    fat32_fs_get_object(fs, path, &fs_object, NULL);
+  struct fat32_fs_object_t   *fs_object =
+    hash_table_lookup(fs->fh_table, &file_info->fh);
 
-  int retcode;
+  assert( fs_object != NULL );
 
-  switch (ret) {
-  case FE_OK:
-    break;
-  case FE_ERRNO:
-    return -errno;
-  case FE_INVALID_DEV:
-    return -EINVAL;
-  default:
-    assert( false );
+  /* FAT has no holes */
+  if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) {
+    return -EOPNOTSUPP;
   }
 
-  if (fs_object == NULL) {
-    return -ENOENT;
+  if (offset < 0 || length <= 0) {
+    return -EINVAL;
   }
 
-  if (fat32_fs_object_is_file(fs_object)) {
-    retcode = -ENOTDIR;
-    goto cleanup;
+  /* file size is stored in 32 bits */
+  if ((uint64_t) offset + (uint64_t) length > UINT32_MAX) {
+    return -EFBIG;
   }
 
-  if (fat32_fs_object_is_root_directory(fs_object)) {
-    retcode = -EPERM;
-    goto cleanup;
-  }
+  enum fat32_error_t ret =
+    fat32_fs_object_preallocate(fs_object, offset + length,
+                                (mode & FALLOC_FL_KEEP_SIZE) != 0);
 
-  bool empty;
-  ret = fat32_fs_object_is_empty_directory(fs_object, &empty);
+  return fat32_file_result(ret);
+}
 
-  switch (ret) {
-  case FE_OK:
-    break;
-  case FE_ERRNO:
-    retcode = -errno;
-    goto cleanup;
-  case FE_INVALID_DEV:
-    retcode = -EINVAL;
-    goto cleanup;
-  default:
-    assert( false );
-  }
+/**
+ * Prefetches clusters of the file into the cluster cache asynchronously.
+ * For mapped images the kernel is asked to read them instead.
+ *
+ * @param fs    File system.
+ * @param map   Extent map of the file.
+ * @param first The first cluster in the chain to prefetch.
+ * @param end   A number following the last cluster in the chain to
+ *              prefetch.
+ */
+static void
+fat32_read_prefetch(const struct fat32_fs_t *fs,
+                    const struct fat32_extent_map_t *map,
+                    uint32_t first, uint32_t end)
+{
+  for (uint32_t n = first; n < end; ) {
+    uint32_t cluster;
+    uint32_t run;
 
-  if (!empty) {
-    retcode = -ENOTEMPTY;
-    goto cleanup;
-  }
+    if (!fat32_extent_map_lookup(map, n, &cluster, &run)) {
+      break;
+    }
 
-  ret = fat32_fs_object_delete(fs_object);
-  switch (ret) {
-  case FE_OK:
-    retcode = 0;
-    goto cleanup;
-  case FE_ERRNO:
-    retcode = -errno;
-    goto cleanup;
-  case FE_INVALID_DEV:
-    retcode = -EINVAL;
-    goto cleanup;
-  case FE_FS_PARTIALLY_CONSISTENT:
-    /* look at the comment in ::fat32_perform_unlink function */
-    log_error_loc(FUSEFAT32_PARTIALLY_INCONSISTENT_FS_MSG);
+    if (run > end - n) {
+      run = end - n;
+    }
 
-    retcode = 0;
-    break;
-  default:
-    assert( false );
+    fat32_cluster_cache_prefetch(fs->cluster_cache, cluster, run);
+    n += run;
   }
-
-cleanup:
-  fat32_fs_object_free(fs_object);
-  return retcode;
 }
 
 /**
- * Truncation function for files that are not opened.
+ * Detects sequential reading of the file and prefetches clusters ahead of
+ * the reader. The window grows twice on every sequential read up to the
+ * limit and shrinks four times on random access. A new part of the window
+ * is requested once less than a half of it is left ahead of the reader so
+ * that the device is kept busy while the reader consumes prefetched data.
  *
- * @param path   A path to file.
- * @param length Desired new length of file.
+ * Concurrent reads of the same handle may race here; this only affects how
+ * much is prefetched.
  *
- * @return Operation result.
+ * @param fs        File system.
+ * @param fs_object Object being read.
+ * @param map       Extent map of the object.
+ * @param offset    An offset of the read.
+ * @param size      Size of the read.
+ * @param initialized Size of the initialized data of the file. Data past
+ *                    it is read as zeros and is never prefetched.
  */
-int
-fat32_truncate(char *path, off_t length)
+static void
+fat32_read_ahead(const struct fat32_fs_t *fs,
+                 struct fat32_fs_object_t *fs_object,
+                 const struct fat32_extent_map_t *map,
+                 off_t offset, size_t size, uint32_t initialized)
 {
-  struct fuse_context        *context    = fuse_get_context();
-  struct fusefat32_context_t *ff_context =
-    (struct fusefat32_context_t *) context->private_data;
-  struct fat32_fs_t          *fs         = ff_context->fs;
-  struct fat32_fs_object_t   *fs_object  = NULL;
+  uint32_t csize   = fs->cluster_size;
+  uint32_t first   = offset / csize;
+  uint32_t next    = (offset + size + csize - 1) / csize;
+  uint32_t last    = (initialized + csize - 1) / csize;
+  uint32_t window  = fs_object->ra_window;
+
+  /* a read of the prefetched data counts as sequential even if it's come
+   * out of order */
+  bool sequential = (offset == fs_object->read_end) ||
+    (offset > fs_object->read_end && first < fs_object->ra_next);
+
+  if (sequential) {
+    window = (window == 0) ? next - first : window * 2;
+    if (window > fs->readahead_max) {
+      window = fs->readahead_max;
+    }
+  } else {
+    window /= 4;
+    fs_object->ra_next = 0;
+  }
 
-  enum fat32_error_t ret = fat32_fs_get_object(fs,
-                                               path,
-                                               &fs_object, NULL);
-  int retcode;
+  fs_object->read_end  = offset + size;
+  fs_object->ra_window = window;
 
+  if (window == 0) {
+    return;
+  }
 
-  switch (ret) {
-  case FE_OK:
-    break;
-  case FE_ERRNO:
-    return -errno;
-  case FE_INVALID_DEV:
-    log_error_loc(FUSEFAT32_INVALID_DEVICE_MSG);
-    return -EINVAL;
-  default:
-    assert( false );
+  uint32_t start = (fs_object->ra_next > next) ? fs_object->ra_next : next;
+  if (start - next > window / 2) {
+    return;
   }
 
-  if (fs_object == NULL) {
-    return -ENOENT;
+  uint32_t end = next + window;
+  if (end > last) {
+    end = last;
   }
 
-  if (fat32_fs_object_is_directory(fs_object)) {
-    retcode = -EISDIR;
+  if (start < end) {
+    fat32_read_prefetch(fs, map, start, end);
+    fs_object->ra_next = end;
+  }
+}
+
+/**
+ * Reads data of the file. Clusters found in the cluster cache are copied
+ * from it. Every run of physically contiguous clusters which are not cached
+ * is read by a single request and requests are collected into batches so
+ * that the device gets them at once. Clusters read completely are put into
+ * the cache afterwards.
+ *
+ * Data past the allocated clusters is copied from memory.
+ *
+ * @param fs        File system.
+ * @param file_info Information about the open file.
+ * @param map       Extent map of the file.
+ * @param buffer    A buffer to store read data.
+ * @param size      Size of data. Must not cross the end of the file.
+ * @param offset    An offset in the file.
+ *
+ * @return A number of read bytes or negated error code.
+ */
+static ssize_t
+fat32_read_clusters(struct fat32_fs_t *fs,
+                    const struct fat32_file_info_t *file_info,
+                    const struct fat32_extent_map_t *map,
+                    char *buffer, size_t size, off_t offset)
+{
+  struct fat32_bpb_t *bpb     = fs->bpb;
+  uint32_t            csize   = fs->cluster_size;
+  uint32_t            n       = offset / csize;
+  uint32_t            coffset = offset % csize;
+  ssize_t             overall = 0;
+  enum fat32_error_t  ret;
+
+  struct fat32_cluster_cache_t *cache = fs->cluster_cache;
+  struct fat32_dev_request_t    requests[FAT32_DEV_BATCH_SIZE];
+  uint32_t                      clusters[FAT32_DEV_BATCH_SIZE];
+  uint32_t                      offsets[FAT32_DEV_BATCH_SIZE];
+  unsigned int                  count  = 0;
+  size_t                        queued = 0;
+
+  while (size || count) {
+    if (size && count < FAT32_DEV_BATCH_SIZE) {
+      uint32_t cluster = 0;
+      uint32_t cunread = csize - coffset;
+      uint32_t to_read = (cunread > size) ? size : cunread;
+
+      if (!fat32_extent_map_lookup(map, n, &cluster, NULL)) {
+        if (!fat32_file_info_delayed_read(file_info, n, buffer, coffset,
+                                          to_read)) {
+          /* this must not happen because we decreased requested size to fit
+           * in file */
+          overall = -EINVAL;
+          break;
+        }
+
+        overall += to_read;
+      } else if (fat32_cluster_cache_read(cache, cluster, buffer, coffset,
+                                          to_read)) {
+        overall += to_read;
+      } else {
+        off_t goffset = fat32_cluster_to_offset(bpb, cluster) + coffset;
+
+        struct fat32_dev_request_t *last =
+          (count != 0) ? &requests[count - 1] : NULL;
+
+        if (last != NULL &&
+            last->offset + last->size == goffset &&
+            (char *) last->buffer + last->size == buffer) {
+          last->size += to_read;
+        } else {
+          requests[count].buffer = buffer;
+          requests[count].size   = to_read;
+          requests[count].offset = goffset;
+          clusters[count]        = cluster;
+          offsets[count]         = coffset;
+          ++count;
+        }
+
+        queued += to_read;
+      }
+
+      buffer  += to_read;
+      coffset  = 0;
+      size    -= to_read;
+      ++n;
+
+      continue;
+    }
+
+    ret = fat32_dev_read_batch(&fs->dev, requests, count);
+    if (ret == FE_ERRNO) {
+      overall = -errno;
+      break;
+    } else if (ret != FE_OK) {
+      // invalid device again
+      overall = -EINVAL;
+      break;
+    }
+
+    for (unsigned int i = 0; i < count; ++i) {
+      uint32_t cluster = clusters[i];
+      uint32_t inner   = offsets[i];
+
+      for (size_t done = 0; done < requests[i].size; ++cluster, inner = 0) {
+        size_t left  = requests[i].size - done;
+        size_t piece = (csize - inner > left) ? left : csize - inner;
+
+        if (piece == csize) {
+          fat32_cluster_cache_fill(cache, cluster,
+                                   (char *) requests[i].buffer + done);
+        }
+
+        done += piece;
+      }
+    }
+
+    overall += queued;
+    count    = 0;
+    queued   = 0;
+  }
+
+  return overall;
+}
+
+/**
+ * Determines how much of the data being read is initialized. The rest is
+ * read as zeros without accessing the device.
+ *
+ * @param file_info Information about the open file.
+ * @param size      Size of data being read.
+ * @param offset    An offset in the file.
+ *
+ * @return Size of initialized data at the beginning of the range.
+ */
+static size_t
+fat32_read_valid(const struct fat32_file_info_t *file_info,
+                 size_t size, off_t offset)
+{
+  if (offset >= file_info->initialized) {
+    return 0;
+  } else if (offset + size > file_info->initialized) {
+    return file_info->initialized - offset;
+  } else {
+    return size;
+  }
+}
+
+/**
+ * Implements @em read system call.
+ *
+ * @param path      A path to file to read.
+ * @param buffer    A buffer to store read data.
+ * @param size      A size of data to be read.
+ * @param offset    An offset from the beginning of the file.
+ * @param file_info Additional information.
+ *
+ * @return Number of read characters on success. 0 is returned when EOF occured.
+ *         Negative value indicates an erorr. It's specified using @em errno.
+ */
+int
+fat32_read(const char *path, char *buffer, size_t size, off_t offset,
+           struct fuse_file_info *file_info)
+{
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+
+  struct fat32_fs_object_t   *fs_object =
+    hash_table_lookup(fs->fh_table, &file_info->fh);
+
+  assert( fs_object != NULL );
+
+  struct fat32_file_info_t   *f32_file_info = fs_object->file_info;
+  ssize_t                     overall       = 0;
+
+  assert( pthread_rwlock_rdlock(&f32_file_info->lock) == 0 );
+
+  uint32_t file_size = fs_object->direntry->file_size;
+  if (offset >= file_size) {
+    /* EOF */
+    goto unlock;
+  }
+
+  if (offset + size > file_size) {
+    size = file_size - offset;
+  }
+
+  struct fat32_extent_map_t *map;
+  enum fat32_error_t         ret = fat32_fs_object_extent_map(fs_object, &map);
+
+  switch (ret) {
+  case FE_OK:
+    break;
+  case FE_ERRNO:
+    overall = -errno;
+    goto unlock;
+  case FE_INVALID_FS:
+  case FE_INVALID_DEV:
+    overall = -EINVAL;
+    goto unlock;
+  default:
+    assert( false );
+  }
+
+  uint32_t csize = fs->cluster_size;
+  size_t   valid = fat32_read_valid(f32_file_info, size, offset);
+
+  /* pages of mapped image would be faulted in one by one; the kernel is
+   * asked to read the whole range at once instead */
+  if (fs->dev.map != NULL && valid != 0) {
+    fat32_read_prefetch(fs, map, offset / csize,
+                        (offset + valid + csize - 1) / csize);
+  }
+
+  /* nothing is prefetched past the initialized data */
+  fat32_read_ahead(fs, fs_object, map, offset, valid,
+                   f32_file_info->initialized);
+
+  overall = fat32_read_clusters(fs, f32_file_info, map, buffer, valid, offset);
+  if (overall >= 0) {
+    memset(buffer + valid, 0, size - valid);
+    overall += size - valid;
+  }
+
+  fat32_extent_cache_release(fs->extent_cache, map);
+
+unlock:
+  assert( pthread_rwlock_unlock(&f32_file_info->lock) == 0 );
+
+  return overall;
+}
+
+/**
+ * Frees a buffer vector built by ::fat32_read_buf together with memory
+ * buffers it holds.
+ *
+ * @param bufv Buffer vector.
+ */
+static void
+fat32_bufvec_free(struct fuse_bufvec *bufv)
+{
+  for (size_t i = 0; i < bufv->count; ++i) {
+    free(bufv->buf[i].mem);
+  }
+
+  free(bufv);
+}
+
+/**
+ * Implements @em read system call without copying data through user space
+ * when possible. Runs of physically contiguous clusters are returned as
+ * ranges of the device file so that FUSE can splice them straight to the
+ * kernel. Clusters which are cached may be newer than their copies on the
+ * device so they are copied to memory buffers instead. Devices opened for
+ * direct I/O have no page cache to splice from and are read by
+ * ::fat32_read_clusters into a single memory buffer.
+ *
+ * @param      path      A path to file to read.
+ * @param[out] bufp      Buffer vector describing read data. Memory buffers
+ *                       are freed by FUSE.
+ * @param      size      A size of data to be read.
+ * @param      offset    An offset from the beginning of the file.
+ * @param      file_info Additional information.
+ *
+ * @return Zero on success. Negative value indicates an error.
+ */
+int
+fat32_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+               off_t offset, struct fuse_file_info *file_info)
+{
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+
+  struct fat32_fs_object_t   *fs_object =
+    hash_table_lookup(fs->fh_table, &file_info->fh);
+
+  assert( fs_object != NULL );
+
+  struct fat32_file_info_t   *f32_file_info = fs_object->file_info;
+  struct fat32_extent_map_t  *map           = NULL;
+  int                         retcode       = 0;
+
+  assert( pthread_rwlock_rdlock(&f32_file_info->lock) == 0 );
+
+  uint32_t file_size = fs_object->direntry->file_size;
+  if (offset >= file_size) {
+    size = 0;
+  } else if (offset + size > file_size) {
+    size = file_size - offset;
+  }
+
+  uint32_t csize   = fs->cluster_size;
+  uint32_t n       = offset / csize;
+  uint32_t coffset = offset % csize;
+  uint32_t ccount  = (size == 0) ? 1 : (coffset + size + csize - 1) / csize;
+  size_t   valid   = fat32_read_valid(f32_file_info, size, offset);
+
+  /* a cluster adds at most one buffer to the vector and zeros past the
+   * initialized data add one more */
+  struct fuse_bufvec *bufv =
+    malloc(sizeof(struct fuse_bufvec) + ccount * sizeof(struct fuse_buf));
+  if (bufv == NULL) {
+    assert( pthread_rwlock_unlock(&f32_file_info->lock) == 0 );
+    return -errno;
+  }
+
+  *bufv = FUSE_BUFVEC_INIT(0);
+  if (size == 0) {
+    /* EOF */
+    goto cleanup;
+  }
+
+  bufv->count = 0;
+
+  enum fat32_error_t ret = fat32_fs_object_extent_map(fs_object, &map);
+
+  switch (ret) {
+  case FE_OK:
+    break;
+  case FE_ERRNO:
+    retcode = -errno;
+    goto cleanup;
+  case FE_INVALID_FS:
+  case FE_INVALID_DEV:
+    retcode = -EINVAL;
+    goto cleanup;
+  default:
+    assert( false );
+  }
+
+  if (fs->dev.direct) {
+    char *buffer = malloc(size);
+    if (buffer == NULL) {
+      retcode = -errno;
+      goto cleanup;
+    }
+
+    bufv->buf[0].mem  = buffer;
+    bufv->count       = 1;
+
+    fat32_read_ahead(fs, fs_object, map, offset, valid,
+                     f32_file_info->initialized);
+
+    ssize_t read = fat32_read_clusters(fs, f32_file_info, map,
+                                       buffer, valid, offset);
+    if (read < 0) {
+      retcode = read;
+      goto cleanup;
+    }
+
+    memset(buffer + valid, 0, size - valid);
+    bufv->buf[0].size = size;
+    goto cleanup;
+  }
+
+  /* page cache of the device does readahead for spliced data itself */
+  fs_object->read_end = offset + size;
+
+  size_t zeros = size - valid;
+  size = valid;
+
+  while (size) {
+    uint32_t         cluster = 0;
+    uint32_t         cunread = csize - coffset;
+    uint32_t         to_read = (cunread > size) ? size : cunread;
+    bool             mapped  = fat32_extent_map_lookup(map, n, &cluster, NULL);
+    off_t            goffset = mapped ?
+      fat32_cluster_to_offset(fs->bpb, cluster) + coffset : 0;
+    off_t            foffset;
+    struct fuse_buf *last    =
+      (bufv->count != 0) ? &bufv->buf[bufv->count - 1] : NULL;
+
+    /* data past the allocated clusters is copied from memory */
+    if (mapped &&
+        !fat32_cluster_cache_contains(fs->cluster_cache, cluster) &&
+        fat32_dev_file_offset(&fs->dev, goffset, to_read, &foffset)) {
+      if (last != NULL && (last->flags & FUSE_BUF_IS_FD) &&
+          last->pos + (off_t) last->size == foffset) {
+        last->size += to_read;
+      } else {
+        struct fuse_buf *buf = &bufv->buf[bufv->count++];
+
+        buf->size  = to_read;
+        buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->mem   = NULL;
+        buf->fd    = fs->dev.fd;
+        buf->pos   = foffset;
+      }
+    } else {
+      if (last == NULL || (last->flags & FUSE_BUF_IS_FD)) {
+        last        = &bufv->buf[bufv->count++];
+        last->size  = 0;
+        last->flags = 0;
+        last->mem   = NULL;
+        last->fd    = -1;
+        last->pos   = 0;
+      }
+
+      char *mem = realloc(last->mem, last->size + to_read);
+      if (mem == NULL) {
+        retcode = -errno;
+        goto cleanup;
+      }
+      last->mem = mem;
+
+      if (!mapped) {
+        if (!fat32_file_info_delayed_read(f32_file_info, n, mem + last->size,
+                                          coffset, to_read)) {
+          /* this must not happen because we decreased requested size to fit
+           * in file */
+          retcode = -EINVAL;
+          goto cleanup;
+        }
+      } else if (!fat32_cluster_cache_read(fs->cluster_cache, cluster,
+                                           mem + last->size, coffset,
+                                           to_read)) {
+        /* the cluster could have been evicted since it was looked up; then
+         * the device holds its latest data */
+        ret = fat32_dev_read(&fs->dev, mem + last->size, to_read, goffset);
+        if (ret == FE_ERRNO) {
+          retcode = -errno;
+          goto cleanup;
+        } else if (ret != FE_OK) {
+          retcode = -EINVAL;
+          goto cleanup;
+        }
+      }
+
+      last->size += to_read;
+    }
+
+    coffset  = 0;
+    size    -= to_read;
+    ++n;
+  }
+
+  if (zeros != 0) {
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+
+    buf->size  = zeros;
+    buf->flags = 0;
+    buf->fd    = -1;
+    buf->pos   = 0;
+    buf->mem   = calloc(1, zeros);
+    if (buf->mem == NULL) {
+      retcode = -errno;
+      goto cleanup;
+    }
+  }
+
+cleanup:
+  fat32_extent_cache_release(fs->extent_cache, map);
+  assert( pthread_rwlock_unlock(&f32_file_info->lock) == 0 );
+
+  if (retcode != 0) {
+    fat32_bufvec_free(bufv);
+  } else {
+    *bufp = bufv;
+  }
+
+  return retcode;
+}
+
+/**
+ * Copies the next part of data being written from FUSE buffers to memory.
+ *
+ * @param src    Buffers with written data. Advanced past copied data.
+ * @param buffer Memory to copy data to.
+ * @param size   Size of data to copy.
+ *
+ * @return Zero on success or negated error code.
+ */
+static int
+fat32_write_copy(struct fuse_bufvec *src, void *buffer, size_t size)
+{
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  dst.buf[0].mem = buffer;
+
+  ssize_t copied = fuse_buf_copy(&dst, src, 0);
+  if (copied < 0) {
+    return copied;
+  }
+
+  return ((size_t) copied == size) ? 0 : -EIO;
+}
+
+/**
+ * Writes the next part of data from FUSE buffers straight to the device. If
+ * FUSE buffers refer to a pipe then data is spliced to the device file
+ * without copying it through user space. Devices opened for direct I/O
+ * can't be spliced to so data is copied to an aligned buffer for them.
+ *
+ * @param fs     File system.
+ * @param src    Buffers with written data. Advanced past written data.
+ * @param offset An offset on the device.
+ * @param size   Size of data to write.
+ *
+ * @return Zero on success or negated error code.
+ */
+static int
+fat32_write_device(struct fat32_fs_t *fs, struct fuse_bufvec *src,
+                   off_t offset, size_t size)
+{
+  off_t foffset;
+
+  if (fat32_dev_file_offset(&fs->dev, offset, size, &foffset)) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd    = fs->dev.fd;
+    dst.buf[0].pos   = foffset;
+
+    ssize_t copied = fuse_buf_copy(&dst, src, 0);
+    if (copied < 0) {
+      return copied;
+    }
+
+    return ((size_t) copied == size) ? 0 : -EIO;
+  }
+
+  void *buffer = fat32_dev_alloc(size);
+  if (buffer == NULL) {
+    return -errno;
+  }
+
+  int retcode = fat32_write_copy(src, buffer, size);
+  if (retcode == 0) {
+    enum fat32_error_t ret = fat32_dev_write(&fs->dev, buffer, size, offset);
+    if (ret == FE_ERRNO) {
+      retcode = -errno;
+    } else if (ret != FE_OK) {
+      retcode = -EINVAL;
+    }
+  }
+
+  free(buffer);
+
+  return retcode;
+}
+
+/**
+ * Implements @em write system call. Runs of whole clusters which are
+ * physically contiguous and not cached are written straight to the device
+ * so that FUSE can splice data from the kernel without copying it through
+ * user space. Heads and tails of the write which cover clusters partially
+ * as well as cached clusters are modified in the cluster cache.
+ *
+ * Data past the clusters allocated to the file is kept in memory in
+ * #fat32_file_info_t::delayed with free clusters reserved for it. Clusters
+ * are allocated for all of it at once when the file is flushed or when the
+ * memory it takes reaches #FAT32_FILE_INFO_DELAYED_MAX.
+ *
+ * @param path      A path to file to write.
+ * @param buf       Buffers holding data to be written.
+ * @param offset    An offset from the beginning of the file.
+ * @param file_info Additional information.
+ *
+ * @return A number of written bytes on success. Negative value indicates an
+ *         error.
+ */
+int
+fat32_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                struct fuse_file_info *file_info)
+{
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+
+  struct fat32_fs_object_t   *fs_object =
+    hash_table_lookup(fs->fh_table, &file_info->fh);
+
+  assert( fs_object != NULL );
+
+  size_t size = fuse_buf_size(buf);
+  if (size == 0) {
+    return 0;
+  }
+
+  /* file size is stored in 32 bits */
+  if (offset < 0 || (uint64_t) offset + size > UINT32_MAX) {
+    return -EFBIG;
+  }
+
+  struct fat32_file_info_t  *f32_file_info = fs_object->file_info;
+  struct fat32_extent_map_t *map;
+
+  assert( pthread_rwlock_wrlock(&f32_file_info->lock) == 0 );
+
+  enum fat32_error_t ret = fat32_fs_object_extent_map(fs_object, &map);
+
+  switch (ret) {
+  case FE_OK:
+    break;
+  case FE_ERRNO:
+    assert( pthread_rwlock_unlock(&f32_file_info->lock) == 0 );
+    return -errno;
+  case FE_INVALID_FS:
+  case FE_INVALID_DEV:
+    assert( pthread_rwlock_unlock(&f32_file_info->lock) == 0 );
+    return -EINVAL;
+  default:
+    assert( false );
+  }
+
+  struct fat32_cluster_cache_t *cache   = fs->cluster_cache;
+  uint32_t                      csize   = fs->cluster_size;
+  char                         *scratch = NULL;
+  size_t                        written = 0;
+  int                           retcode = 0;
+
+  /* data between the initialized part of the file and the written one would
+   * be read as zeros no more */
+  if (offset > f32_file_info->initialized) {
+    ret = fat32_fs_object_zero_range(fs_object, f32_file_info->initialized,
+                                     offset);
+    if (ret != FE_OK) {
+      retcode = (ret == FE_ERRNO) ? -errno : -EINVAL;
+      goto cleanup;
+    }
+
+    f32_file_info->initialized = offset;
+  }
+
+  while (written < size) {
+    uint32_t n       = (offset + written) / csize;
+    uint32_t coffset = (offset + written) % csize;
+    size_t   left    = size - written;
+    uint32_t piece   = (csize - coffset > left) ? left : csize - coffset;
+    uint32_t cluster;
+    uint32_t run;
+
+    /* Clusters past the allocated ones are kept in memory. They are
+     * allocated all at once on flush so that they get into as few extents as
+     * possible. Free clusters are reserved for them right away so that the
+     * allocation can't run out of space after the write has succeeded. */
+    if (!fat32_extent_map_lookup(map, n, &cluster, &run)) {
+      uint8_t *data = fat32_file_info_delayed_get(f32_file_info, fs->fat,
+                                                  csize, n);
+      if (data == NULL) {
+        retcode = -errno;
+        break;
+      }
+
+      retcode = fat32_write_copy(buf, data + coffset, piece);
+      if (retcode != 0) {
+        break;
+      }
+
+      written += piece;
+      continue;
+    }
+
+    off_t goffset = fat32_cluster_to_offset(fs->bpb, cluster) + coffset;
+
+    if (coffset == 0 && left >= csize) {
+      uint32_t whole = (run < left / csize) ? run : left / csize;
+      uint32_t count = 0;
+
+      /* cached clusters may be dirty so they are modified in the cache */
+      while (count < whole &&
+             !fat32_cluster_cache_contains(cache, cluster + count)) {
+        ++count;
+      }
+
+      if (count != 0) {
+        retcode = fat32_write_device(fs, buf, goffset, (size_t) count * csize);
+        if (retcode != 0) {
+          break;
+        }
+
+        /* cached clusters must not keep old data */
+        fat32_cluster_cache_invalidate(cache, cluster, count);
+
+        written += (size_t) count * csize;
+        continue;
+      }
+    }
+
+    if (scratch == NULL) {
+      scratch = malloc(csize);
+      if (scratch == NULL) {
+        retcode = -errno;
+        break;
+      }
+    }
+
+    retcode = fat32_write_copy(buf, scratch, piece);
+    if (retcode != 0) {
+      break;
+    }
+
+    ret = fat32_cluster_cache_write(cache, goffset, scratch, piece);
+    if (ret == FE_ERRNO) {
+      retcode = -errno;
+      break;
+    } else if (ret != FE_OK) {
+      retcode = -EINVAL;
+      break;
+    }
+
+    written += piece;
+  }
+
+  if (offset + written > f32_file_info->initialized) {
+    f32_file_info->initialized = offset + written;
+  }
+
+  /* the new size reaches the device together with allocated clusters */
+  if (offset + written > fat32_fs_object_size(fs_object)) {
+    fs_object->direntry->file_size = offset + written;
+    f32_file_info->direntry_dirty  = true;
+  }
+
+cleanup:
+  fat32_extent_cache_release(fs->extent_cache, map);
+  free(scratch);
+
+  /* holes take no memory so a write far past the end does not force them
+   * to be allocated and zeroed right away */
+  bool flush = (size_t) f32_file_info->delayed_buffers * csize >=
+    FAT32_FILE_INFO_DELAYED_MAX;
+
+  assert( pthread_rwlock_unlock(&f32_file_info->lock) == 0 );
+
+  /* errors are reported by the following flush or fsync */
+  if (flush) {
+    fat32_fs_object_flush(fs_object, false);
+  }
+
+  return (written != 0) ? (int) written : retcode;
+}
+
+/**
+ * Implements unlink system call.
+ *
+ * @param path A path to file.
+ *
+ * @return Result of operation.
+ */
+int
+fat32_unlink(const char *path)
+{
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+
+  struct fat32_file_info_t   *file_info =
+    hash_table_lookup(fs->file_table, path);
+
+  /* TODO: for now we don't implement UNIX semantic of deletion */
+  if (file_info == NULL) {
+    return fat32_perform_unlink(fs, path);
+  } else {
+    return -EBUSY;
+  }
+}
+
+/**
+ * Implements @em rmdir system call
+ *
+ * @param path A path to directory.
+ *
+ * @return Operation result.
+ */
+int
+fat32_rmdir(const char *path)
+{
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+
+  struct fat32_fs_object_t *fs_object;
+  enum fat32_error_t        ret =
+    fat32_fs_get_object(fs, path, &fs_object, NULL);
+
+  int retcode;
+
+  switch (ret) {
+  case FE_OK:
+    break;
+  case FE_ERRNO:
+    return -errno;
+  case FE_INVALID_DEV:
+    return -EINVAL;
+  default:
+    assert( false );
+  }
+
+  if (fs_object == NULL) {
+    return -ENOENT;
+  }
+
+  if (fat32_fs_object_is_file(fs_object)) {
+    retcode = -ENOTDIR;
     goto cleanup;
   }
 
-  ret = fat32_fs_object_truncate(fs_object, length);
+  if (fat32_fs_object_is_root_directory(fs_object)) {
+    retcode = -EPERM;
+    goto cleanup;
+  }
+
+  bool empty;
+  ret = fat32_fs_object_is_empty_directory(fs_object, &empty);
+
   switch (ret) {
   case FE_OK:
-    retcode = 0;
-    goto cleanup;
+    break;
   case FE_ERRNO:
     retcode = -errno;
     goto cleanup;
-  case FE_INVALID_FS:
-    log_error_loc(FUSEFAT32_INVALID_FS_MSG);
-    retcode = -EINVAL;
-    goto cleanup;
   case FE_INVALID_DEV:
-    log_error_loc(FUSEFAT32_INVALID_DEVICE_MSG);
     retcode = -EINVAL;
     goto cleanup;
-  case FE_FS_INCONSISTENT:
-    log_error_loc(FUSEFAT32_INCONSISTENT_FS_MSG);
+  default:
+    assert( false );
+  }
+
+  if (!empty) {
+    retcode = -ENOTEMPTY;
+    goto cleanup;
+  }
+
+  ret = fat32_fs_object_delete(fs_object);
+  switch (ret) {
+  case FE_OK:
+    retcode = 0;
+    goto cleanup;
+  case FE_ERRNO:
+    retcode = -errno;
+    goto cleanup;
+  case FE_INVALID_DEV:
     retcode = -EINVAL;
     goto cleanup;
   case FE_FS_PARTIALLY_CONSISTENT:
+    /* look at the comment in ::fat32_perform_unlink function */
     log_error_loc(FUSEFAT32_PARTIALLY_INCONSISTENT_FS_MSG);
+
     retcode = 0;
+    break;
+  default:
+    assert( false );
+  }
+
+cleanup:
+  fat32_fs_object_free(fs_object);
+  return retcode;
+}
+
+/**
+ * Creates an empty file or directory.
+ *
+ * @param fs        File system.
+ * @param path      A path to the new object.
+ * @param directory Whether a directory is created.
+ *
+ * @return Operation result.
+ */
+static int
+fat32_make_object(struct fat32_fs_t *fs, const char *path, bool directory)
+{
+  struct fat32_fs_object_t *fs_object   = NULL;
+  char                     *parent_path = NULL;
+  enum fat32_error_t        ret;
+  int                       retcode;
+
+  /* paths passed by FUSE are always absolute; an existing object with the
+   * same name is detected by the creation under the directory lock */
+  const char *name = strrchr(path, '/') + 1;
+
+  parent_path = strndup(path, name - path);
+  if (parent_path == NULL) {
+    return -errno;
+  }
+
+  ret = fat32_fs_get_object(fs, parent_path, &fs_object, NULL);
+  switch (ret) {
+  case FE_OK:
+    break;
+  case FE_ERRNO:
+    retcode = -errno;
+    goto cleanup;
+  case FE_INVALID_DEV:
+    retcode = -EINVAL;
+    goto cleanup;
+  default:
+    assert( false );
+  }
+
+  if (fs_object == NULL) {
+    retcode = -ENOENT;
+    goto cleanup;
+  }
+
+  if (!fat32_fs_object_is_directory(fs_object)) {
+    retcode = -ENOTDIR;
     goto cleanup;
+  }
+
+  ret = fat32_fs_object_create(fs_object, name, directory);
+  if (ret == FE_FS_PARTIALLY_CONSISTENT) {
+    /* the object has not been created after all */
+    log_error_loc(FUSEFAT32_PARTIALLY_INCONSISTENT_FS_MSG);
+    retcode = -EIO;
+  } else {
+    retcode = fat32_file_result(ret);
+  }
+
+cleanup:
+  if (fs_object != NULL) {
+    fat32_fs_object_free(fs_object);
+  }
+
+  free(parent_path);
+
+  return retcode;
+}
+
+/**
+ * Implements @em create system call. The file is created and opened.
+ *
+ * @param path      A path to the new file.
+ * @param mode      Ignored as FAT does not store permissions.
+ * @param file_info File info.
+ *
+ * @return Operation result.
+ */
+int
+fat32_create(const char *path, mode_t mode, struct fuse_file_info *file_info)
+{
+  (void) mode;
+
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+
+  int retcode = fat32_make_object(ff_context->fs, path, false);
+  if (retcode != 0) {
+    return retcode;
+  }
+
+  return fat32_open(path, file_info);
+}
+
+/**
+ * Implements @em mkdir system call.
+ *
+ * @param path A path to the new directory.
+ * @param mode Ignored as FAT does not store permissions.
+ *
+ * @return Operation result.
+ */
+int
+fat32_mkdir(const char *path, mode_t mode)
+{
+  (void) mode;
+
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+
+  return fat32_make_object(ff_context->fs, path, true);
+}
+
+/**
+ * Implements @em truncate system call. The file is attached to the state of
+ * the open file for the time of the operation. So if the file is not open
+ * clusters added to it are zeroed right away when it's detached.
+ *
+ * @param path   A path to file.
+ * @param length Desired new length of file.
+ *
+ * @return Operation result.
+ */
+int
+fat32_truncate(const char *path, off_t length)
+{
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+  struct fat32_fs_object_t   *fs_object  = NULL;
+
+  /* file size is stored in 32 bits */
+  if (length < 0) {
+    return -EINVAL;
+  } else if (length > UINT32_MAX) {
+    return -EFBIG;
+  }
+
+  enum fat32_error_t ret = fat32_fs_get_object(fs,
+                                               path,
+                                               &fs_object, NULL);
+  int retcode;
+
+
+  switch (ret) {
+  case FE_OK:
+    break;
+  case FE_ERRNO:
+    return -errno;
+  case FE_INVALID_DEV:
+    log_error_loc(FUSEFAT32_INVALID_DEVICE_MSG);
+    return -EINVAL;
   default:
     assert( false );
   }
 
+  if (fs_object == NULL) {
+    return -ENOENT;
+  }
+
+  if (fat32_fs_object_is_directory(fs_object)) {
+    retcode = -EISDIR;
+    goto cleanup;
+  }
+
+  retcode = fat32_file_attach(fs, path, fs_object);
+  if (retcode != 0) {
+    goto cleanup;
+  }
+
+  ret = fat32_fs_object_truncate(fs_object, length);
+
+  enum fat32_error_t detach_ret = fat32_file_detach(fs, path, fs_object);
+  if (ret == FE_OK) {
+    ret = detach_ret;
+  }
+
+  retcode = fat32_file_result(ret);
+
 cleanup:
   fat32_fs_object_free(fs_object);
   return retcode;
 }
 
+/**
+ * Implements @em ftruncate system call. Growing the file takes no time as
+ * added clusters are read as zeros until they are written or the file is
+ * flushed.
+ *
+ * @param path      A path to file.
+ * @param length    Desired new length of file.
+ * @param file_info File info.
+ *
+ * @return Operation result.
+ */
+int
+fat32_ftruncate(const char *path, off_t length,
+                struct fuse_file_info *file_info)
+{
+  (void) path;
+
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+
+  struct fat32_fs_object_t   *fs_object =
+    hash_table_lookup(fs->fh_table, &file_info->fh);
+
+  assert( fs_object != NULL );
+
+  /* file size is stored in 32 bits */
+  if (length < 0) {
+    return -EINVAL;
+  } else if (length > UINT32_MAX) {
+    return -EFBIG;
+  }
+
+  return fat32_file_result(fat32_fs_object_truncate(fs_object, length));
+}
+
+/**
+ * Implements @em statfs system call. Free space is taken from the counter
+ * maintained by FAT so no device access is needed.
+ *
+ * @param      path  Any path on the file system.
+ * @param[out] stbuf File system statistics.
+ *
+ * @return Operation result.
+ */
+int
+fat32_statfs(const char *path, struct statvfs *stbuf)
+{
+  (void) path;
+
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+  struct fat32_fs_t          *fs         = ff_context->fs;
+  uint32_t                    free       = fat32_fat_free_clusters(fs->fat);
+
+  memset(stbuf, 0, sizeof(struct statvfs));
+
+  stbuf->f_bsize   = fs->cluster_size;
+  stbuf->f_frsize  = fs->cluster_size;
+  stbuf->f_blocks  = fat32_bpb_clusters_count(fs->bpb);
+  stbuf->f_bfree   = free;
+  stbuf->f_bavail  = free;
+  /* short names only: 8 characters of base name, a dot and an extension */
+  stbuf->f_namemax = FAT32_DIRENTRY_NAME_SIZE + 1;
+
+  return 0;
+}
+
+/**
+ * Implements @em init which is called by the process serving requests once
+ * FUSE has daemonized. Background threads of the file system are started
+ * here since threads started before @em fork don't exist in the daemon.
+ *
+ * @param conn Connection parameters. Unused.
+ *
+ * @return Private data of the file system passed to @em fuse_main.
+ */
+void *
+fat32_init(struct fuse_conn_info *conn)
+{
+  (void) conn;
+
+  struct fuse_context        *context    = fuse_get_context();
+  struct fusefat32_context_t *ff_context =
+    (struct fusefat32_context_t *) context->private_data;
+
+  /* the file system works without readahead as well */
+  if (fat32_fs_start(ff_context->fs) != FE_OK) {
+    log_warning(_("Unable to start readahead threads: %s"),
+                strerror(errno));
+  }
+
+  return ff_context;
+}
+
+/**
+ * Implements @em destroy which is called on unmounting. Threads started by
+ * ::fat32_init are stopped.
+ *
+ * @param private_data Private data returned by ::fat32_init.
+ */
+void
+fat32_destroy(void *private_data)
+{
+  struct fusefat32_context_t *ff_context = private_data;
+
+  fat32_fs_stop(ff_context->fs);
+}
+
 const struct fuse_operations fusefat32_operations = {
+  .init    = fat32_init,
+  .destroy = fat32_destroy,
   .readdir = fat32_readdir,
   .getattr = fat32_getattr,
   .open    = fat32_open,
   .release = fat32_release,
+  .flush   = fat32_flush,
+  .fsync   = fat32_fsync,
+  .fallocate = fat32_fallocate,
+  .truncate  = fat32_truncate,
+  .ftruncate = fat32_ftruncate,
   .read    = fat32_read,
+  .read_buf = fat32_read_buf,
+  .write_buf = fat32_write_buf,
   .unlink  = fat32_unlink,
   .rmdir   = fat32_rmdir,
+  .create  = fat32_create,
+  .mkdir   = fat32_mkdir,
+  .statfs  = fat32_statfs,
 };
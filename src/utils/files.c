@@ -92,6 +92,32 @@ xread(int fd, void *buf, size_t count)
   return nread;
 }
 
+ssize_t
+xpread(int fd, void *buf, size_t count, off_t offset)
+{
+  ssize_t nread = 0;
+  ssize_t ret;
+
+  while (nread < count) {
+    ret = pread(fd, (char *) buf + nread, count - nread, offset + nread);
+
+    if (ret > 0) {
+      nread += ret;
+    } else if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else {
+        return ret;
+      }
+    } else {
+      /* ret is zero */
+      break;
+    }
+  }
+
+  return nread;
+}
+
 ssize_t
 xwrite(int fd, const void *buf, size_t count)
 {